@@ -55,4 +55,29 @@ static inline void u32_to_u8array (u8* item, int offset, u32 value) {
 	item[offset + 3] = (u8)(value >> 24);
 }
 
+/*-----------------------------------------------------------------
+Index of the lowest set bit, value must not be 0
+-----------------------------------------------------------------*/
+#if defined(__GNUC__)
+static inline u32 u32_ctz (u32 value) {
+	return (u32) __builtin_ctz(value);
+}
+#elif defined(_MSC_VER)
+#include <intrin.h>
+static inline u32 u32_ctz (u32 value) {
+	unsigned long index;
+	_BitScanForward(&index, value);
+	return (u32) index;
+}
+#else
+static inline u32 u32_ctz (u32 value) {
+	u32 index = 0;
+	while ((value & 1) == 0) {
+		value >>= 1;
+		index++;
+	}
+	return index;
+}
+#endif
+
 #endif // _BIT_OPS_H
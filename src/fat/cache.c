@@ -3,11 +3,12 @@
  The cache is not visible to the user. It should be flushed 
  when any file is closed or changes are made to the filesystem.
  
- This cache implements a least-used-page replacement policy. This will 
- distribute sectors evenly over the pages, so if less than the maximum 
- pages are used at once, they should all eventually remain in the cache.
- This also has the benefit of throwing out old sectors, so as not to keep
- too many stale pages around.
+ This cache implements a least-recently-used page replacement policy with
+ write-back. Pages are found through a hash of the sector number, dirty
+ pages are written back in runs of consecutive sectors.
+
+ A cache without pages accesses the disc directly. This is used for RAM
+ images, where a copy of the sector would not gain anything.
 
  Copyright (c) 2006 Michael "Chishm" Chisholm
 	
@@ -34,28 +35,172 @@
 */
 
 #include <string.h>
+#include <malloc.h>
 
 #include "fat/common.h"
 #include "fat/cache.h"
 #include "fat/file_allocation_table.h"
+#include "fat/stats.h"
+
+// Maximum number of sectors written back with one disc access
+#define CACHE_RUN_SECTORS 64
+
+static inline u32 _FAT_cache_hash (CACHE* cache, u32 sector) {
+	return (sector * 0x9E3779B1u) & cache->hashMask;
+}
+
+static u32 _FAT_cache_findPage (CACHE* cache, u32 sector) {
+	u32 page = cache->hashBuckets[_FAT_cache_hash(cache, sector)];
+
+	while (page != CACHE_FREE && cache->cacheEntries[page].sector != sector) {
+		page = cache->cacheEntries[page].hashNext;
+	}
+	return page;
+}
+
+static void _FAT_cache_hashInsert (CACHE* cache, u32 page) {
+	u32* bucket = cache->hashBuckets + _FAT_cache_hash(cache, cache->cacheEntries[page].sector);
+
+	cache->cacheEntries[page].hashNext = *bucket;
+	*bucket = page;
+}
+
+static void _FAT_cache_hashRemove (CACHE* cache, u32 page) {
+	u32* link = cache->hashBuckets + _FAT_cache_hash(cache, cache->cacheEntries[page].sector);
+
+	while (*link != page) {
+		link = &cache->cacheEntries[*link].hashNext;
+	}
+	*link = cache->cacheEntries[page].hashNext;
+}
+
+static void _FAT_cache_lruUnlink (CACHE* cache, u32 page) {
+	CACHE_ENTRY* entry = cache->cacheEntries + page;
+
+	if (entry->lruPrev != CACHE_FREE) {
+		cache->cacheEntries[entry->lruPrev].lruNext = entry->lruNext;
+	} else {
+		cache->lruFirst = entry->lruNext;
+	}
+	if (entry->lruNext != CACHE_FREE) {
+		cache->cacheEntries[entry->lruNext].lruPrev = entry->lruPrev;
+	} else {
+		cache->lruLast = entry->lruPrev;
+	}
+}
+
+static void _FAT_cache_lruPushFirst (CACHE* cache, u32 page) {
+	CACHE_ENTRY* entry = cache->cacheEntries + page;
+
+	entry->lruPrev = CACHE_FREE;
+	entry->lruNext = cache->lruFirst;
+	if (cache->lruFirst != CACHE_FREE) {
+		cache->cacheEntries[cache->lruFirst].lruPrev = page;
+	} else {
+		cache->lruLast = page;
+	}
+	cache->lruFirst = page;
+}
+
+static void _FAT_cache_lruPushLast (CACHE* cache, u32 page) {
+	CACHE_ENTRY* entry = cache->cacheEntries + page;
+
+	entry->lruNext = CACHE_FREE;
+	entry->lruPrev = cache->lruLast;
+	if (cache->lruLast != CACHE_FREE) {
+		cache->cacheEntries[cache->lruLast].lruNext = page;
+	} else {
+		cache->lruFirst = page;
+	}
+	cache->lruLast = page;
+}
+
+/*
+Forget the sector of a page without writing it back.
+The page becomes the next one to be reused.
+*/
+static void _FAT_cache_dropPage (CACHE* cache, u32 page) {
+	_FAT_cache_hashRemove(cache, page);
+	cache->cacheEntries[page].sector = CACHE_FREE;
+	cache->cacheEntries[page].dirty = false;
+	_FAT_cache_lruUnlink(cache, page);
+	_FAT_cache_lruPushLast(cache, page);
+}
 
-#define CACHE_FREE 0xFFFFFFFF
+static inline u32 _FAT_cache_findDirtyPage (CACHE* cache, u32 sector) {
+	u32 page = _FAT_cache_findPage(cache, sector);
+	return (page != CACHE_FREE && cache->cacheEntries[page].dirty) ? page : CACHE_FREE;
+}
 
-CACHE* _FAT_cache_constructor(CACHE* ptCache, const IO_INTERFACE* discInterface) {
+/*
+Write a dirty page back to disc, together with the dirty pages of the
+sectors next to it, so the run goes to the disc with one access.
+*/
+static bool _FAT_cache_writeBack (CACHE* cache, u32 page) {
+	u32 first = cache->cacheEntries[page].sector;
+	u32 count = 1;
 	u32 i;
-	CACHE_ENTRY* cacheEntries;
+	u32 runPage;
+
+	while (first > 0 && count < cache->runSectors && _FAT_cache_findDirtyPage(cache, first - 1) != CACHE_FREE) {
+		first--;
+		count++;
+	}
+	while (count < cache->runSectors && first + count != CACHE_FREE && _FAT_cache_findDirtyPage(cache, first + count) != CACHE_FREE) {
+		count++;
+	}
+
+	if (count == 1) {
+		if (!_FAT_disc_writeSectors(cache->disc, first, 1, cache->pages + cache->pageSize * page)) {
+			return false;
+		}
+		cache->cacheEntries[page].dirty = false;
+		return true;
+	}
 
+	for (i = 0; i < count; i++) {
+		runPage = _FAT_cache_findPage(cache, first + i);
+		memcpy(cache->runBuffer + cache->pageSize * i, cache->pages + cache->pageSize * runPage, cache->pageSize);
+	}
+	if (!_FAT_disc_writeSectors(cache->disc, first, count, cache->runBuffer)) {
+		return false;
+	}
+	for (i = 0; i < count; i++) {
+		cache->cacheEntries[_FAT_cache_findPage(cache, first + i)].dirty = false;
+	}
+	return true;
+}
+
+CACHE* _FAT_cache_constructor(CACHE* ptCache, const IO_INTERFACE* discInterface, u32 numberOfPages, u32 pageSize) {
+	u32 numberOfBuckets;
+
+	memset(ptCache, 0, sizeof(CACHE));
 	ptCache->disc = discInterface;
+	ptCache->pageSize = pageSize;
 
-	cacheEntries = ptCache->cacheEntries;
+	if (numberOfPages == 0) {
+		// Direct access, the run buffer takes a sector for discs which can't be mapped
+		ptCache->runBuffer = (u8*) _FAT_mem_allocate(discInterface, pageSize);
+		return ptCache->runBuffer != NULL ? ptCache : NULL;
+	}
 
-	for (i = 0; i < ptCache->numberOfPages; i++) 
-  {
-		cacheEntries[i].sector = CACHE_FREE;
-		cacheEntries[i].count = 0;
-		cacheEntries[i].dirty = false;
+	// At least two buckets per page keeps the hash chains short
+	for (numberOfBuckets = 1; numberOfBuckets < 2 * numberOfPages; numberOfBuckets <<= 1);
+
+	ptCache->numberOfPages = numberOfPages;
+	ptCache->hashMask = numberOfBuckets - 1;
+	ptCache->runSectors = numberOfPages < CACHE_RUN_SECTORS ? numberOfPages : CACHE_RUN_SECTORS;
+	ptCache->cacheEntries = (CACHE_ENTRY*) _FAT_mem_allocate(discInterface, sizeof(CACHE_ENTRY) * numberOfPages);
+	ptCache->pages = (u8*) _FAT_mem_allocate(discInterface, (size_t) pageSize * numberOfPages);
+	ptCache->hashBuckets = (u32*) _FAT_mem_allocate(discInterface, sizeof(u32) * numberOfBuckets);
+	ptCache->runBuffer = (u8*) _FAT_mem_allocate(discInterface, (size_t) pageSize * ptCache->runSectors);
+	if (ptCache->cacheEntries == NULL || ptCache->pages == NULL || ptCache->hashBuckets == NULL || ptCache->runBuffer == NULL) {
+		ptCache->numberOfPages = 0;
+		_FAT_cache_destructor(ptCache);
+		return NULL;
 	}
 
+	_FAT_cache_invalidate(ptCache);
 	return ptCache;
 }
 
@@ -63,60 +208,66 @@ void _FAT_cache_destructor (CACHE* cache)
 {
 	// Clear out cache before destroying it
 	_FAT_cache_flush(cache);
+
+	_FAT_mem_free(cache->cacheEntries);
+	_FAT_mem_free(cache->pages);
+	_FAT_mem_free(cache->hashBuckets);
+	_FAT_mem_free(cache->runBuffer);
+	cache->cacheEntries = NULL;
+	cache->pages = NULL;
+	cache->hashBuckets = NULL;
+	cache->runBuffer = NULL;
+	cache->numberOfPages = 0;
 }
 
 /*
 Retrieve a sector's page from the cache. If it is not found in the cache,
-load it into the cache and return the page it was loaded to.
+load it into the cache and return the page it was loaded to. The sector
+is not read if the caller overwrites the whole page anyway.
 Return CACHE_FREE on error.
 */
-static u32 _FAT_cache_getSector (CACHE* cache, u32 sector) {
-	u32 i;
-	CACHE_ENTRY* cacheEntries = cache->cacheEntries;
-	u32 numberOfPages = cache->numberOfPages;
+static u32 _FAT_cache_getSector (CACHE* cache, u32 sector, bool load) {
+	u32 page = _FAT_cache_findPage(cache, sector);
 
-	u32 leastUsed = 0;
-	u32 lowestCount = 0xFFFFFFFF;
+	if (page == CACHE_FREE) {
+		// Replace the least recently used page with the desired sector
+		page = cache->lruLast;
+		if (cache->cacheEntries[page].sector != CACHE_FREE) {
+			if (cache->cacheEntries[page].dirty && !_FAT_cache_writeBack(cache, page)) {
+				return CACHE_FREE;
+			}
+			_FAT_cache_hashRemove(cache, page);
+			cache->cacheEntries[page].sector = CACHE_FREE;
+		}
 
-	for (i = 0; (i < numberOfPages) && (cacheEntries[i].sector != sector); i++) {
-		// While searching for the desired sector, also search for the leased used page
-		if ( (cacheEntries[i].sector == CACHE_FREE) || (cacheEntries[i].count < lowestCount) ) {
-			leastUsed = i;
-			lowestCount = cacheEntries[i].count;
+		if (load && !_FAT_disc_readSectors(cache->disc, sector, 1, cache->pages + cache->pageSize * page)) {
+			return CACHE_FREE;
 		}
+		cache->cacheEntries[page].sector = sector;
+		_FAT_cache_hashInsert(cache, page);
 	}
 
-	// If it found the sector in the cache, return it
-	if ((i < numberOfPages) && (cacheEntries[i].sector == sector)) {
-		// Increment usage counter
-		cacheEntries[i].count += 1;
-		return i;
+	if (cache->lruFirst != page) {
+		_FAT_cache_lruUnlink(cache, page);
+		_FAT_cache_lruPushFirst(cache, page);
 	}
+	return page;
+}
 
-	// If it didn't, replace the least used cache page with the desired sector
-	if ((cacheEntries[leastUsed].sector != CACHE_FREE) && (cacheEntries[leastUsed].dirty == true)) {
-		// Write the page back to disc if it has been written to
-		if (!_FAT_disc_writeSectors (cache->disc, 
-                                 cacheEntries[leastUsed].sector, 
-                                 1, 
-                                 cache->pages + cache->pageSize * leastUsed)) {
-			return CACHE_FREE;
-		}
-		cacheEntries[leastUsed].dirty = false;
-	}
+/*
+Get the address of a sector for direct access, either in the disc memory
+or, if the disc can't be mapped, in the run buffer after reading it there.
+*/
+static u8* _FAT_cache_directSector (CACHE* cache, u32 sector, bool load) {
+	u8* pabSector = (u8*) _FAT_disc_mapSectors(cache->disc, sector, 1);
 
-	// Load the new sector into the cache
-	if (!_FAT_disc_readSectors (cache->disc, 
-                              sector, 
-                              1, 
-                              cache->pages + cache->pageSize * leastUsed)) {
-		return CACHE_FREE;
+	if (pabSector == NULL && cache->disc->fn_mapSectors == NULL) {
+		pabSector = cache->runBuffer;
+		if (load && !_FAT_disc_readSectors(cache->disc, sector, 1, pabSector)) {
+			pabSector = NULL;
+		}
 	}
-	cacheEntries[leastUsed].sector = sector;
-	// Increment the usage count, don't reset it
-	// This creates a paging policy of least used PAGE, not sector
-	cacheEntries[leastUsed].count += 1;
-	return leastUsed;
+	return pabSector;
 }
 
 /*
@@ -124,12 +275,23 @@ Reads some data from a cache page, determined by the sector number
 */
 bool _FAT_cache_readPartialSector (CACHE* cache, void* buffer, u32 sector, u32 offset, u32 size, u32 sectorsize) {
 	u32 page;
+	u8* pabSector;
 
-	if (offset + size > sectorsize) {
+	if (offset + size > sectorsize || sectorsize != cache->pageSize) {
 		return false;
 	}
+	FAT_STATS_ADD(cache->disc, partialReads, 1);
+
+	if (cache->numberOfPages == 0) {
+		pabSector = _FAT_cache_directSector(cache, sector, true);
+		if (pabSector == NULL) {
+			return false;
+		}
+		memcpy (buffer, pabSector + offset, size);
+		return true;
+	}
 
-	page = _FAT_cache_getSector (cache, sector);
+	page = _FAT_cache_getSector (cache, sector, true);
 	if (page == CACHE_FREE) {
 		return false;
 	}
@@ -142,18 +304,31 @@ Writes some data to a cache page, making sure it is loaded into memory first.
 */
 bool _FAT_cache_writePartialSector (CACHE* cache, const void* buffer, u32 sector, u32 offset, u32 size, u32 sectorsize) {
 	u32 page;
+	u8* pabSector;
 
-	if (offset + size > sectorsize) {
+	if (offset + size > sectorsize || sectorsize != cache->pageSize) {
 		return false;
 	}
+	FAT_STATS_ADD(cache->disc, partialWrites, 1);
+
+	if (cache->numberOfPages == 0) {
+		pabSector = _FAT_cache_directSector(cache, sector, size < sectorsize);
+		if (pabSector == NULL) {
+			return false;
+		}
+		memcpy (pabSector + offset, buffer, size);
+		_FAT_cache_markWritten (cache, sector, 1);
+		return pabSector != cache->runBuffer || _FAT_disc_writeSectors(cache->disc, sector, 1, pabSector);
+	}
 
-	page = _FAT_cache_getSector (cache, sector);
+	page = _FAT_cache_getSector (cache, sector, size < sectorsize);
 	if (page == CACHE_FREE) {
 		return false;
 	}
 	
 	memcpy (cache->pages + (cache->pageSize * page) + offset, buffer, size);
 	cache->cacheEntries[page].dirty = true;
+	_FAT_cache_markWritten (cache, sector, 1);
 
 	return true;
 }
@@ -163,42 +338,136 @@ Writes some data to a cache page, zeroing out the page first
 */
 bool _FAT_cache_eraseWritePartialSector (CACHE* cache, const void* buffer, u32 sector, u32 offset, u32 size, u32 sectorsize) {
 	u32 page;
+	u8* pabSector;
 
-	if (offset + size > sectorsize) {
+	if (offset + size > sectorsize || sectorsize != cache->pageSize) {
 		return false;
 	}
+	FAT_STATS_ADD(cache->disc, partialWrites, 1);
 
-	page = _FAT_cache_getSector (cache, sector);
+	if (cache->numberOfPages == 0) {
+		pabSector = _FAT_cache_directSector(cache, sector, false);
+		if (pabSector == NULL) {
+			return false;
+		}
+		memset (pabSector, 0, offset);
+		memcpy (pabSector + offset, buffer, size);
+		memset (pabSector + offset + size, 0, cache->pageSize - offset - size);
+		_FAT_cache_markWritten (cache, sector, 1);
+		return pabSector != cache->runBuffer || _FAT_disc_writeSectors(cache->disc, sector, 1, pabSector);
+	}
+
+	page = _FAT_cache_getSector (cache, sector, false);
 	if (page == CACHE_FREE) {
 		return false;
 	}
 	
-	memset (cache->pages + (cache->pageSize * page), 0, cache->pageSize);
-	memcpy (cache->pages + (cache->pageSize * page) + offset, buffer, size);
+	pabSector = cache->pages + (cache->pageSize * page);
+	memset (pabSector, 0, offset);
+	memcpy (pabSector + offset, buffer, size);
+	memset (pabSector + offset + size, 0, cache->pageSize - offset - size);
 	cache->cacheEntries[page].dirty = true;
+	_FAT_cache_markWritten (cache, sector, 1);
+
+	return true;
+}
+
+/*
+Calls fnVisit for every cached page of the sectors [sector, sector+numSectors).
+Looks up the sectors for short ranges and walks the pages for long ones.
+*/
+static bool _FAT_cache_visitRange (CACHE* cache, u32 sector, u32 numSectors, bool (*fnVisit)(CACHE*, u32, u32, void*), void* pvUser) {
+	u32 i;
+	u32 page;
+
+	if (numSectors <= cache->numberOfPages) {
+		for (i = 0; i < numSectors; i++) {
+			page = _FAT_cache_findPage(cache, sector + i);
+			if (page != CACHE_FREE && !fnVisit(cache, page, i, pvUser)) {
+				return false;
+			}
+		}
+	} else {
+		for (page = 0; page < cache->numberOfPages; page++) {
+			i = cache->cacheEntries[page].sector - sector;
+			if (cache->cacheEntries[page].sector != CACHE_FREE && i < numSectors && !fnVisit(cache, page, i, pvUser)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static bool _FAT_cache_mergeDirty (CACHE* cache, u32 page, u32 index, void* pvBuffer) {
+	if (cache->cacheEntries[page].dirty) {
+		memcpy((u8*) pvBuffer + cache->pageSize * index, cache->pages + cache->pageSize * page, cache->pageSize);
+	}
+	return true;
+}
+
+static bool _FAT_cache_drop (CACHE* cache, u32 page, u32 index, void* pvUser) {
+	(void) index;
+	(void) pvUser;
+	_FAT_cache_dropPage(cache, page);
+	return true;
+}
 
+static bool _FAT_cache_writeBackAndDrop (CACHE* cache, u32 page, u32 index, void* pvUser) {
+	(void) index;
+	(void) pvUser;
+	if (cache->cacheEntries[page].dirty && !_FAT_cache_writeBack(cache, page)) {
+		return false;
+	}
+	_FAT_cache_dropPage(cache, page);
 	return true;
 }
 
+bool _FAT_cache_readSectors (CACHE* cache, u32 sector, u32 numSectors, void* buffer) {
+	if (!_FAT_disc_readSectors(cache->disc, sector, numSectors, buffer)) {
+		return false;
+	}
+	return _FAT_cache_visitRange(cache, sector, numSectors, _FAT_cache_mergeDirty, buffer);
+}
+
+bool _FAT_cache_writeSectors (CACHE* cache, u32 sector, u32 numSectors, const void* buffer) {
+	if (!_FAT_disc_writeSectors(cache->disc, sector, numSectors, buffer)) {
+		return false;
+	}
+	_FAT_cache_markWritten (cache, sector, numSectors);
+	return _FAT_cache_visitRange(cache, sector, numSectors, _FAT_cache_drop, NULL);
+}
+
+bool _FAT_cache_fillSectors (CACHE* cache, u32 sector, u32 numSectors, u8 value) {
+	if (!_FAT_disc_fillSectors(cache->disc, sector, numSectors, value)) {
+		return false;
+	}
+	_FAT_cache_markWritten (cache, sector, numSectors);
+	return _FAT_cache_visitRange(cache, sector, numSectors, _FAT_cache_drop, NULL);
+}
+
+void* _FAT_cache_mapSectors (CACHE* cache, u32 sector, u32 numSectors) {
+	if (!_FAT_cache_visitRange(cache, sector, numSectors, _FAT_cache_writeBackAndDrop, NULL)) {
+		return NULL;
+	}
+	return _FAT_disc_mapSectors(cache->disc, sector, numSectors);
+}
+
+void _FAT_cache_markWritten (CACHE* cache, u32 sector, u32 numSectors) {
+	if (sector + numSectors > cache->highWater) {
+		cache->highWater = sector + numSectors;
+	}
+}
 
 /*
-Flushes all dirty pages to disc, clearing the dirty flag. 
-Also resets all pages' page count to 0.
+Flushes all dirty pages to disc, clearing the dirty flag.
 */
 bool _FAT_cache_flush (CACHE* cache) {
 	u32 i;
 
 	for (i = 0; i < cache->numberOfPages; i++) {
-		if (cache->cacheEntries[i].dirty) {
-			if (!_FAT_disc_writeSectors (cache->disc, 
-                                   cache->cacheEntries[i].sector, 
-                                   1, 
-                                   cache->pages + cache->pageSize * i)) {
-				return CACHE_FREE;
-			}
+		if (cache->cacheEntries[i].dirty && !_FAT_cache_writeBack(cache, i)) {
+			return false;
 		}
-		cache->cacheEntries[i].count = 0;
-		cache->cacheEntries[i].dirty = false;
 	}
 
 	return true;
@@ -206,9 +475,20 @@ bool _FAT_cache_flush (CACHE* cache) {
 
 void _FAT_cache_invalidate (CACHE* cache) {
 	u32 i;
+
+	if (cache->numberOfPages == 0) {
+		return;
+	}
+
+	for (i = 0; i <= cache->hashMask; i++) {
+		cache->hashBuckets[i] = CACHE_FREE;
+	}
+
+	cache->lruFirst = CACHE_FREE;
+	cache->lruLast = CACHE_FREE;
 	for (i = 0; i < cache->numberOfPages; i++) {
 		cache->cacheEntries[i].sector = CACHE_FREE;
-		cache->cacheEntries[i].count = 0;
 		cache->cacheEntries[i].dirty = false;
+		_FAT_cache_lruPushLast(cache, i);
 	}
 }
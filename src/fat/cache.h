@@ -3,11 +3,12 @@
  The cache is not visible to the user. It should be flushed 
  when any file is closed or changes are made to the filesystem.
  
- This cache implements a least-used-page replacement policy. This will 
- distribute sectors evenly over the pages, so if less than the maximum 
- pages are used at once, they should all eventually remain in the cache.
- This also has the benefit of throwing out old sectors, so as not to keep
- too many stale pages around.
+ This cache implements a least-recently-used page replacement policy with
+ write-back. Pages are found through a hash of the sector number, dirty
+ pages are written back in runs of consecutive sectors.
+
+ A cache without pages accesses the disc directly. This is used for RAM
+ images, where a copy of the sector would not gain anything.
 
  Copyright (c) 2006 Michael "Chishm" Chisholm
 	
@@ -47,19 +48,30 @@
 #define EXT_CACHE_PAGE_SIZE 4096
 #define STD_CACHE_PAGE_SIZE 512
 
+#define CACHE_FREE 0xFFFFFFFF
+
 typedef struct {
 	u32 sector;
-	u32 count;
+	u32 hashNext;		// Next page in the same hash bucket
+	u32 lruPrev;		// Towards the most recently used page
+	u32 lruNext;		// Towards the least recently used page
 	bool dirty;
 } CACHE_ENTRY;
 
 typedef struct {
 	const IO_INTERFACE* disc;
-	u32                 numberOfPages;
+	u32                 numberOfPages;		// 0: no caching, the sectors are accessed directly
 	CACHE_ENTRY*        cacheEntries;
 	u8*                 pages;
+	u32*                hashBuckets;
+	u32                 hashMask;
+	u32                 lruFirst;
+	u32                 lruLast;
+	u8*                 runBuffer;		// Collects a run of dirty pages for one write
+	u32                 runSectors;
   u32                 pageSize;
   void*               pvUser;
+	u32                 highWater;		// One past the highest sector written through the cache
 } CACHE;
 
 
@@ -107,7 +119,34 @@ static inline bool _FAT_cache_writeSector (CACHE* cache, const void* buffer, u32
 }
 
 /*
-Write any dirty sectors back to disc and clear out the contents of the cache
+Read or write whole sectors, bypassing the pages.
+Dirty pages in the range are merged into the data read, and pages of
+sectors that are written are dropped, so the cache stays consistent.
+*/
+bool _FAT_cache_readSectors (CACHE* cache, u32 sector, u32 numSectors, void* buffer);
+bool _FAT_cache_writeSectors (CACHE* cache, u32 sector, u32 numSectors, const void* buffer);
+
+/*
+Set every byte of whole sectors to value, see _FAT_disc_fillSectors.
+Pages of the sectors are dropped like for _FAT_cache_writeSectors.
+*/
+bool _FAT_cache_fillSectors (CACHE* cache, u32 sector, u32 numSectors, u8 value);
+
+/*
+Get a pointer to sectors in the disc memory, see _FAT_disc_mapSectors.
+Dirty pages in the range are written back and dropped first.
+Returns NULL if the disc can not be mapped.
+Writes through the pointer must be reported with _FAT_cache_markWritten.
+*/
+void* _FAT_cache_mapSectors (CACHE* cache, u32 sector, u32 numSectors);
+
+/*
+Record that the sectors were written, this moves the high-water mark.
+*/
+void _FAT_cache_markWritten (CACHE* cache, u32 sector, u32 numSectors);
+
+/*
+Write any dirty sectors back to disc. The pages stay valid.
 */
 bool _FAT_cache_flush (CACHE* cache);
 
@@ -116,8 +155,16 @@ Clear out the contents of the cache without writing any dirty sectors first
 */
 void _FAT_cache_invalidate (CACHE* cache);
 
-CACHE* _FAT_cache_constructor(CACHE* ptCache, const IO_INTERFACE* discInterface);
+/*
+Set up a cache with numberOfPages pages of pageSize bytes.
+numberOfPages = 0 accesses the disc directly.
+Returns NULL if the pages can not be allocated.
+*/
+CACHE* _FAT_cache_constructor(CACHE* ptCache, const IO_INTERFACE* discInterface, u32 numberOfPages, u32 pageSize);
 
+/*
+Flush the cache and free the pages, but not the CACHE structure itself.
+*/
 void _FAT_cache_destructor (CACHE* cache);
 
 #endif // _CACHE_H
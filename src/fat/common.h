@@ -36,6 +36,9 @@
 #include "compiler.h"
 
 
+typedef uint64_t u64;
+typedef int64_t s64;
+
 typedef uint32_t u32;
 typedef int32_t s32;
 
@@ -61,6 +64,18 @@ typedef int8_t s8;
 
 //#define BYTES_PER_READ 512
 
+/*
+*pullResult = ullA * ullB
+Returns false if the product does not fit into 64 bits.
+*/
+static inline bool u64_mulChecked(u64 ullA, u64 ullB, u64 *pullResult) {
+	if (ullA != 0 && ullB > UINT64_MAX / ullA) {
+		return false;
+	}
+	*pullResult = ullA * ullB;
+	return true;
+}
+
 #ifndef NULL
  #define NULL 0
 #endif
@@ -43,12 +43,14 @@
 */
 
 #include <string.h>
+#include <stdio.h>
 #if defined(_MSC_VER)
 	int strncasecmp(const char* s1, const char* s2, size_t len) { return _strnicmp(s1, s2, len); }
 	int strcasecmp(const char* s1, const char* s2) { return _stricmp(s1, s2); }
 #endif
 
 #include <ctype.h>
+#include <stdlib.h>
 
 #include "platform.h"
 #include "fat/directory.h"
@@ -56,6 +58,7 @@
 #include "fat/partition.h"
 #include "fat/file_allocation_table.h"
 #include "fat/bit_ops.h"
+#include "fat/stats.h"
 #include "fat/filetime.h"
 
 // Directory entry codes
@@ -282,6 +285,7 @@ bool _FAT_directory_getNextEntry (PARTITION* partition, DIR_ENTRY* entry) {
 		if (_FAT_directory_incrementDirEntryPosition (partition, &entryEnd, false) == false) {
 			notFound = true;
 		}
+		FAT_STATS_ADD(partition->disc, dirEntriesScanned, 1);
 
 		_FAT_cache_readPartialSector (partition->cache, 
                                   entryData, 
@@ -345,6 +349,7 @@ bool _FAT_directory_getNextEntry (PARTITION* partition, DIR_ENTRY* entry) {
 }
 
 bool _FAT_directory_getFirstEntry (PARTITION* partition, DIR_ENTRY* entry, u32 dirCluster) {
+	entry->dirCluster = dirCluster;
 	entry->dataStart.cluster = dirCluster;
 	entry->dataStart.sector = 0;
 	entry->dataStart.offset = -1; // Start before the beginning of the directory
@@ -360,6 +365,7 @@ bool _FAT_directory_getRootEntry (PARTITION* partition, DIR_ENTRY* entry) {
 	entry->dataStart.offset = 0;
 	
 	entry->dataEnd = entry->dataStart;	
+	entry->dirCluster = partition->rootDirCluster;
 	
 	memset (entry->filename, '\0', MAX_FILENAME_LENGTH);
 	entry->filename[0] = '.';
@@ -434,12 +440,309 @@ bool _FAT_directory_entryFromPosition (PARTITION* partition, DIR_ENTRY* entry) {
 
 
 
+/*-----------------------------------------------------------------
+Directory lookup index
+Each directory gets a hash table which maps the case folded long
+names and aliases of its entries to the entry positions. The table is
+built on the first lookup in a directory and kept up to date by
+_FAT_directory_addEntry and _FAT_directory_removeEntry. A hit is
+always verified by reading the entry from the disc.
+-----------------------------------------------------------------*/
+#define DIR_INDEX_NONE 0xFFFFFFFF
+#define DIR_INDEX_MIN_BUCKETS 64
+
+typedef struct {
+	u32 hash;
+	u32 next;							// Next node in the bucket or the free list
+	bool used;
+	DIR_ENTRY_POSITION dataStart;
+	DIR_ENTRY_POSITION dataEnd;
+} DIR_INDEX_NODE;
+
+typedef struct DIR_INDEX_STRUCT {
+	struct DIR_INDEX_STRUCT* nextIndex;
+	const IO_INTERFACE* disc;			// The buckets are allocated through it, see stats.h
+	u32 dirCluster;
+	u32* buckets;
+	u32 bucketCount;					// Always a power of 2
+	DIR_INDEX_NODE* nodes;
+	u32 nodeCount;						// Nodes in use or on the free list
+	u32 nodeSize;						// Allocated nodes
+	u32 freeNode;
+	u32 keyCount;
+	DIR_ENTRY_POSITION scanStart;		// All entries before it are in use
+	bool scanStartValid;
+} DIR_INDEX;
+
+static u32 _FAT_directory_hashName (const char* name, size_t length) {
+	u32 hash = 2166136261U;
+	size_t i;
+
+	// FNV-1a over the lower case characters
+	for (i = 0; (i < length) && (name[i] != '\0'); i++) {
+		hash ^= (u8) tolower((u8) name[i]);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static u32 _FAT_directory_indexCluster (PARTITION* partition, u32 dirCluster) {
+	return (dirCluster == FAT16_ROOT_DIR_CLUSTER) ? partition->rootDirCluster : dirCluster;
+}
+
+static void _FAT_directory_indexDestroy (DIR_INDEX* index) {
+	_FAT_mem_free(index->buckets);
+	_FAT_mem_free(index->nodes);
+	_FAT_mem_free(index);
+}
+
+static DIR_INDEX* _FAT_directory_indexFind (PARTITION* partition, u32 dirCluster) {
+	DIR_INDEX* index;
+	DIR_INDEX** link;
+
+	dirCluster = _FAT_directory_indexCluster(partition, dirCluster);
+	for (link = &partition->dirIndex; (index = *link) != NULL; link = &index->nextIndex) {
+		if (index->dirCluster == dirCluster) {
+			// Move it to the front, lookups tend to stay in the same directory
+			*link = index->nextIndex;
+			index->nextIndex = partition->dirIndex;
+			partition->dirIndex = index;
+			return index;
+		}
+	}
+	return NULL;
+}
+
+static void _FAT_directory_indexDrop (PARTITION* partition, u32 dirCluster) {
+	DIR_INDEX* index = _FAT_directory_indexFind(partition, dirCluster);
+
+	if (index != NULL) {
+		// indexFind moved it to the front
+		partition->dirIndex = index->nextIndex;
+		_FAT_directory_indexDestroy(index);
+	}
+}
+
+void _FAT_directory_freeIndex (PARTITION* partition) {
+	DIR_INDEX* index;
+
+	while ((index = partition->dirIndex) != NULL) {
+		partition->dirIndex = index->nextIndex;
+		_FAT_directory_indexDestroy(index);
+	}
+}
+
+static bool _FAT_directory_indexRehash (DIR_INDEX* index, u32 bucketCount) {
+	u32* buckets;
+	u32 i;
+	u32 bucket;
+
+	buckets = (u32*) _FAT_mem_allocate(index->disc, bucketCount * sizeof(u32));
+	if (buckets == NULL) {
+		return false;
+	}
+	memset(buckets, 0xFF, bucketCount * sizeof(u32));
+
+	for (i = 0; i < index->nodeCount; i++) {
+		if (index->nodes[i].used) {
+			bucket = index->nodes[i].hash & (bucketCount - 1);
+			index->nodes[i].next = buckets[bucket];
+			buckets[bucket] = i;
+		}
+	}
+
+	_FAT_mem_free(index->buckets);
+	index->buckets = buckets;
+	index->bucketCount = bucketCount;
+	return true;
+}
+
+static bool _FAT_directory_indexInsertKey (DIR_INDEX* index, u32 hash, const DIR_ENTRY* entry) {
+	DIR_INDEX_NODE* nodes;
+	u32 node;
+	u32 bucket;
+
+	if ((index->keyCount >= index->bucketCount) && !_FAT_directory_indexRehash(index, index->bucketCount * 2)) {
+		return false;
+	}
+
+	if (index->freeNode != DIR_INDEX_NONE) {
+		node = index->freeNode;
+		index->freeNode = index->nodes[node].next;
+	} else {
+		if (index->nodeCount == index->nodeSize) {
+			nodes = (DIR_INDEX_NODE*) _FAT_mem_reallocate(index->nodes, index->nodeSize * 2 * sizeof(DIR_INDEX_NODE));
+			if (nodes == NULL) {
+				return false;
+			}
+			index->nodes = nodes;
+			index->nodeSize *= 2;
+		}
+		node = index->nodeCount++;
+	}
+
+	bucket = hash & (index->bucketCount - 1);
+	index->nodes[node].hash = hash;
+	index->nodes[node].used = true;
+	index->nodes[node].dataStart = entry->dataStart;
+	index->nodes[node].dataEnd = entry->dataEnd;
+	index->nodes[node].next = index->buckets[bucket];
+	index->buckets[bucket] = node;
+	index->keyCount++;
+	return true;
+}
+
+static bool _FAT_directory_indexInsert (DIR_INDEX* index, const DIR_ENTRY* entry) {
+	char alias[MAX_ALIAS_LENGTH];
+
+	if (!_FAT_directory_indexInsertKey(index, _FAT_directory_hashName(entry->filename, MAX_FILENAME_LENGTH), entry)) {
+		return false;
+	}
+	// The alias only needs a key of its own if it differs from the long name
+	if (_FAT_directory_entryGetAlias(entry->entryData, alias) && (strcasecmp(alias, entry->filename) != 0)) {
+		return _FAT_directory_indexInsertKey(index, _FAT_directory_hashName(alias, MAX_ALIAS_LENGTH), entry);
+	}
+	return true;
+}
+
+static u32 _FAT_directory_indexRemoveFromBucket (DIR_INDEX* index, u32 bucket, const DIR_ENTRY_POSITION* dataEnd) {
+	u32* link;
+	u32 node;
+	u32 removed = 0;
+
+	link = &index->buckets[bucket];
+	while ((node = *link) != DIR_INDEX_NONE) {
+		if ((index->nodes[node].dataEnd.cluster == dataEnd->cluster)
+			&& (index->nodes[node].dataEnd.sector == dataEnd->sector)
+			&& (index->nodes[node].dataEnd.offset == dataEnd->offset)) {
+			*link = index->nodes[node].next;
+			index->nodes[node].used = false;
+			index->nodes[node].next = index->freeNode;
+			index->freeNode = node;
+			index->keyCount--;
+			removed++;
+		} else {
+			link = &index->nodes[node].next;
+		}
+	}
+	return removed;
+}
+
+static void _FAT_directory_indexRemove (DIR_INDEX* index, const DIR_ENTRY* entry) {
+	char alias[MAX_ALIAS_LENGTH];
+	u32 removed;
+	u32 bucket;
+
+	removed = _FAT_directory_indexRemoveFromBucket(index,
+		_FAT_directory_hashName(entry->filename, MAX_FILENAME_LENGTH) & (index->bucketCount - 1), &entry->dataEnd);
+	if (_FAT_directory_entryGetAlias(entry->entryData, alias)) {
+		removed += _FAT_directory_indexRemoveFromBucket(index,
+			_FAT_directory_hashName(alias, MAX_ALIAS_LENGTH) & (index->bucketCount - 1), &entry->dataEnd);
+	}
+	if (removed == 0) {
+		// The name in entry was not the one that was indexed, search all buckets
+		for (bucket = 0; bucket < index->bucketCount; bucket++) {
+			_FAT_directory_indexRemoveFromBucket(index, bucket, &entry->dataEnd);
+		}
+	}
+}
+
+static DIR_INDEX* _FAT_directory_indexGet (PARTITION* partition, u32 dirCluster) {
+	DIR_INDEX* index;
+	DIR_ENTRY tempEntry;
+	bool foundFile;
+
+	index = _FAT_directory_indexFind(partition, dirCluster);
+	if (index != NULL) {
+		return index;
+	}
+
+	// Build the index from the directory entries
+	index = (DIR_INDEX*) _FAT_mem_allocate(partition->disc, sizeof(DIR_INDEX));
+	if (index == NULL) {
+		return NULL;
+	}
+	memset(index, 0, sizeof(DIR_INDEX));
+	index->disc = partition->disc;
+	index->dirCluster = _FAT_directory_indexCluster(partition, dirCluster);
+	index->freeNode = DIR_INDEX_NONE;
+	index->nodeSize = DIR_INDEX_MIN_BUCKETS;
+	index->nodes = (DIR_INDEX_NODE*) _FAT_mem_allocate(partition->disc, index->nodeSize * sizeof(DIR_INDEX_NODE));
+	if ((index->nodes == NULL) || !_FAT_directory_indexRehash(index, DIR_INDEX_MIN_BUCKETS)) {
+		_FAT_directory_indexDestroy(index);
+		return NULL;
+	}
+
+	foundFile = _FAT_directory_getFirstEntry (partition, &tempEntry, dirCluster);
+	while (foundFile) {
+		if (!_FAT_directory_indexInsert(index, &tempEntry)) {
+			_FAT_directory_indexDestroy(index);
+			return NULL;
+		}
+		foundFile = _FAT_directory_getNextEntry (partition, &tempEntry);
+	}
+
+	index->nextIndex = partition->dirIndex;
+	partition->dirIndex = index;
+	return index;
+}
+
+/*
+Looks up name in the directory starting at dirCluster.
+If mustBeDir is set, only directories are found.
+Returns 1 and fills in entry if the name was found, 0 if it was not found
+and -1 if there is no index, then the directory must be scanned.
+*/
+static int _FAT_directory_indexLookup (PARTITION* partition, DIR_ENTRY* entry, u32 dirCluster, const char* name, size_t nameLength, bool mustBeDir) {
+	DIR_INDEX* index;
+	u32 hash;
+	u32 node;
+	char alias[MAX_ALIAS_LENGTH];
+
+	index = _FAT_directory_indexGet(partition, dirCluster);
+	if (index == NULL) {
+		return -1;
+	}
+
+	hash = _FAT_directory_hashName(name, nameLength);
+	for (node = index->buckets[hash & (index->bucketCount - 1)]; node != DIR_INDEX_NONE; node = index->nodes[node].next) {
+		if (index->nodes[node].hash != hash) {
+			continue;
+		}
+
+		entry->dataStart = index->nodes[node].dataStart;
+		entry->dataEnd = index->nodes[node].dataEnd;
+		entry->dirCluster = dirCluster;
+		if (!_FAT_directory_entryFromPosition (partition, entry)) {
+			continue;
+		}
+		if (mustBeDir && !(entry->entryData[DIR_ENTRY_attributes] & ATTRIB_DIR)) {
+			continue;
+		}
+
+		// Check if the filename or the alias matches
+		if ((nameLength == strnlen(entry->filename, MAX_FILENAME_LENGTH))
+			&& (strncasecmp(entry->filename, name, nameLength) == 0)) {
+				return 1;
+		}
+		_FAT_directory_entryGetAlias (entry->entryData, alias);
+		if ((nameLength == strnlen(alias, MAX_ALIAS_LENGTH))
+			&& (strncasecmp(alias, name, nameLength) == 0)) {
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+
 bool _FAT_directory_entryFromPath (PARTITION* partition, DIR_ENTRY* entry, const char* path, const char* pathEnd) {
 	size_t dirnameLength;
 	const char* pathPosition;
 	const char* nextPathPosition;
 	u32 dirCluster;
 	bool foundFile;
+	int lookupResult;
 
 	char alias[MAX_ALIAS_LENGTH];
 
@@ -493,10 +796,16 @@ bool _FAT_directory_entryFromPath (PARTITION* partition, DIR_ENTRY* entry, const
 			return false;
 		}
 
-		// Look for the directory within the path
-		foundFile = _FAT_directory_getFirstEntry (partition, entry, dirCluster);
+		// Look the name up in the directory's index
+		lookupResult = _FAT_directory_indexLookup (partition, entry, dirCluster, pathPosition, dirnameLength, nextPathPosition != NULL);
+		if (lookupResult >= 0) {
+			foundFile = (lookupResult == 1);
+		} else {
+			// There is no index, look for the directory within the path
+			foundFile = _FAT_directory_getFirstEntry (partition, entry, dirCluster);
+		}
 
-		while (foundFile && !found && !notFound) {			// It hasn't already found the file
+		while (foundFile && !found && !notFound && (lookupResult < 0)) {			// It hasn't already found the file
 			// Check if the filename matches
 			if ((dirnameLength == strnlen(entry->filename, MAX_FILENAME_LENGTH))
 				&& (strncasecmp(entry->filename, pathPosition, dirnameLength) == 0)) {
@@ -557,9 +866,22 @@ bool _FAT_directory_removeEntry (PARTITION* partition, DIR_ENTRY* entry) {
 	bool finished;
 
 	u8 entryData[DIR_ENTRY_DATA_SIZE];
+	DIR_INDEX* index;
+
 	entryStart = entry->dataStart;
 	entryEnd = entry->dataEnd;
 
+	// Remove the entry from the index of its directory
+	index = _FAT_directory_indexFind (partition, entry->dirCluster);
+	if (index != NULL) {
+		_FAT_directory_indexRemove (index, entry);
+		index->scanStartValid = false;
+	}
+	// A removed directory's clusters may be reused, forget its index
+	if (entry->entryData[DIR_ENTRY_attributes] & ATTRIB_DIR) {
+		_FAT_directory_indexDrop (partition, _FAT_directory_entryGetCluster (entry->entryData));
+	}
+
 	// Create an empty directory entry to overwrite the old ones with
 	for ( entryStillValid = true, finished = false; 
 		entryStillValid && !finished; 
@@ -588,16 +910,26 @@ static bool _FAT_directory_findEntryGap (PARTITION* partition, DIR_ENTRY* entry,
 
 	u8 entryData[DIR_ENTRY_DATA_SIZE];
 
+	DIR_ENTRY_POSITION firstUnused;
+	DIR_INDEX* index;
+
 	u32 dirEntryRemain;
 
-	bool endOfDirectory, entryStillValid;
+	bool endOfDirectory, entryStillValid, foundUnused;
 
-	// Scan Dir for free entry
-	gapEnd.offset = 0;
-	gapEnd.sector = 0;
-	gapEnd.cluster = dirCluster;
+	// Scan Dir for free entry, skipping the entries known to be in use
+	index = _FAT_directory_indexFind (partition, dirCluster);
+	if ((index != NULL) && index->scanStartValid) {
+		gapEnd = index->scanStart;
+	} else {
+		gapEnd.offset = 0;
+		gapEnd.sector = 0;
+		gapEnd.cluster = dirCluster;
+	}
 
 	gapStart = gapEnd;
+	firstUnused = gapEnd;
+	foundUnused = false;
 
 	entryStillValid = true;
 	dirEntryRemain = size;
@@ -605,6 +937,10 @@ static bool _FAT_directory_findEntryGap (PARTITION* partition, DIR_ENTRY* entry,
 	
 	while (entryStillValid && !endOfDirectory && (dirEntryRemain > 0)) {
 		_FAT_cache_readPartialSector (partition->cache, entryData, _FAT_fat_clusterToSector(partition, gapEnd.cluster) + gapEnd.sector, gapEnd.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE, partition->bytesPerSector);
+		if ((entryData[0] == DIR_ENTRY_LAST || entryData[0] == DIR_ENTRY_FREE) && !foundUnused) {
+			firstUnused = gapEnd;
+			foundUnused = true;
+		}
 		if (entryData[0] == DIR_ENTRY_LAST) {
 			gapStart = gapEnd;
 			-- dirEntryRemain;
@@ -633,7 +969,8 @@ static bool _FAT_directory_findEntryGap (PARTITION* partition, DIR_ENTRY* entry,
 
 	if (endOfDirectory) {
 		memset (entryData, DIR_ENTRY_LAST, DIR_ENTRY_DATA_SIZE);
-		dirEntryRemain += 1;	// Increase by one to take account of End Of Directory Marker
+		// The gap starts at the End Of Directory Marker, free entries before it don't count
+		dirEntryRemain = size;
 		while ((dirEntryRemain > 0) && entryStillValid) {
 			// Get the gapEnd before incrementing it, so the second to last one is saved
 			entry->dataEnd = gapEnd;
@@ -650,6 +987,17 @@ static bool _FAT_directory_findEntryGap (PARTITION* partition, DIR_ENTRY* entry,
 		entry->dataEnd = gapEnd;
 	}
 
+	// The next search can start behind the gap if it was the first unused space
+	if (index != NULL) {
+		if (foundUnused && (gapStart.cluster == firstUnused.cluster) && (gapStart.sector == firstUnused.sector)
+			&& (gapStart.offset == firstUnused.offset)) {
+			index->scanStart = entry->dataEnd;
+		} else {
+			index->scanStart = firstUnused;
+		}
+		index->scanStartValid = true;
+	}
+
 	return true;
 }
 
@@ -658,14 +1006,20 @@ static bool _FAT_directory_entryExists (PARTITION* partition, const char* name,
 	bool foundFile;
 	char alias[MAX_ALIAS_LENGTH];
 	u32 dirnameLength;
+	int lookupResult;
 
 	dirnameLength = strnlen(name, MAX_FILENAME_LENGTH);
 
 	if (dirnameLength >= MAX_FILENAME_LENGTH) {
 		return false;
 	}
+
+	lookupResult = _FAT_directory_indexLookup (partition, &tempEntry, dirCluster, name, dirnameLength, false);
+	if (lookupResult >= 0) {
+		return (lookupResult == 1);
+	}
 	
-	// Make sure the entry doesn't already exist
+	// There is no index, make sure the entry doesn't already exist
 	foundFile = _FAT_directory_getFirstEntry (partition, &tempEntry, dirCluster);
 
 	while (foundFile) {			// It hasn't already found the file
@@ -688,6 +1042,187 @@ static bool _FAT_directory_entryExists (PARTITION* partition, const char* name,
 
 
 
+/*
+Alias tails
+A generated alias is the stem, cut short so that "~" and the tail number
+still fit into 8 characters, followed by the extension. The plain stem is
+the start of the long name. When its first tails are all taken a hashed
+stem is used instead, so adding many similar names keeps working.
+*/
+#define ALIAS_STEM_LENGTH 6
+#define ALIAS_PLAIN_TAILS 9
+#define ALIAS_HASHED_TAILS 65535
+
+/*
+Returns the tail number if name is the alias with the given stem and extension, 0 otherwise
+*/
+static u32 _FAT_directory_aliasTail (const char* name, const char* stem, const char* ext) {
+	const char* tilde;
+	const char* dot;
+	u32 tail = 0;
+	u32 digits = 0;
+	u32 stemLength;
+
+	tilde = strchr (name, '~');
+	if (tilde == NULL) {
+		return 0;
+	}
+	for (dot = tilde + 1; isdigit((u8) *dot); dot++) {
+		tail = tail * 10 + (*dot - '0');
+		digits++;
+	}
+	if ((digits < 1) || (digits > 6) || (tilde[1] == '0') || ((*dot != '.') && (*dot != '\0'))) {
+		return 0;
+	}
+
+	stemLength = strlen (stem);
+	if (stemLength > 7 - digits) {
+		stemLength = 7 - digits;
+	}
+	if (((u32)(tilde - name) != stemLength) || (strncasecmp (name, stem, stemLength) != 0)) {
+		return 0;
+	}
+	if (*dot == '.') {
+		dot++;
+	}
+	return (strcasecmp (dot, ext) == 0) ? tail : 0;
+}
+
+static void _FAT_directory_markAliasTail (u32* usedTails, u32 maxTail, u32 tail) {
+	if ((tail > 0) && (tail <= maxTail)) {
+		usedTails[tail / 32] |= 1U << (tail % 32);
+	}
+}
+
+static u32 _FAT_directory_firstFreeTail (const u32* usedTails, u32 maxTail) {
+	u32 tail;
+
+	for (tail = 1; tail <= maxTail; tail++) {
+		if ((usedTails[tail / 32] & (1U << (tail % 32))) == 0) {
+			return tail;
+		}
+	}
+	return 0;
+}
+
+static void _FAT_directory_formatAlias (char* alias, const char* stem, const char* ext, u32 tail) {
+	u32 stemLength;
+	u32 digits;
+	u32 i;
+
+	// Shorten the stem so that the tail fits into 8 characters
+	stemLength = strlen (stem);
+	for (digits = 1, i = tail; i >= 10; i /= 10) {
+		digits++;
+	}
+	if (stemLength > 7 - digits) {
+		stemLength = 7 - digits;
+	}
+	sprintf (alias, "%.*s~%u%s%s", (int) stemLength, stem, (unsigned int) tail, (ext[0] != '\0') ? "." : "", ext);
+}
+
+/*
+Looks for a free tail with the directory's index, one lookup per candidate.
+Returns false if there is no index.
+*/
+static bool _FAT_directory_probeAlias (PARTITION* partition, u32 dirCluster, const char* stem, const char* hashedStem, const char* ext, char* alias, u32* tail) {
+	DIR_ENTRY tempEntry;
+	int lookupResult;
+
+	for (*tail = 1; *tail <= ALIAS_PLAIN_TAILS + ALIAS_HASHED_TAILS; (*tail)++) {
+		if (*tail <= ALIAS_PLAIN_TAILS) {
+			_FAT_directory_formatAlias (alias, stem, ext, *tail);
+		} else {
+			_FAT_directory_formatAlias (alias, hashedStem, ext, *tail - ALIAS_PLAIN_TAILS);
+		}
+		lookupResult = _FAT_directory_indexLookup (partition, &tempEntry, dirCluster, alias, strlen (alias), false);
+		if (lookupResult < 0) {
+			return false;
+		} else if (lookupResult == 0) {
+			return true;
+		}
+	}
+	*tail = 0;
+	return true;
+}
+
+/*
+Creates a unique alias for a long filename in alias, as "BASE.EXT".
+If the directory has an index, the candidates are looked up in it. Otherwise
+the directory is scanned only once, collecting the used tails of the plain
+and the hashed stem. Long names are checked too, as entryExists does.
+*/
+static bool _FAT_directory_createAlias (PARTITION* partition, const char* filename, u32 dirCluster, char* alias) {
+	char stem[ALIAS_STEM_LENGTH + 1];
+	char hashedStem[ALIAS_STEM_LENGTH + 1];
+	char ext[4];
+	char entryAlias[MAX_ALIAS_LENGTH];
+	const char* extStart;
+	DIR_ENTRY tempEntry;
+	bool foundFile;
+	u32 plainTails[1];
+	u32* hashedTails;
+	u32 tail;
+	int i, j;
+
+	// The stem is made from the first alphanumeric characters
+	extStart = strrchr (filename, '.');
+	for (i = 0, j = 0; (j < ALIAS_STEM_LENGTH) && (filename[i] != '\0') && (filename + i != extStart); i++) {
+		if (isalnum((u8) filename[i])) {
+			stem[j++] = toupper((u8) filename[i]);
+		}
+	}
+	if (j == 0) {
+		stem[j++] = '_';
+	}
+	stem[j] = '\0';
+
+	ext[0] = '\0';
+	if (extStart != NULL) {
+		for (i = 1, j = 0; (j < 3) && (extStart[i] != '\0'); i++, j++) {
+			ext[j] = toupper((u8) extStart[i]);
+		}
+		ext[j] = '\0';
+	}
+
+	// Hashed stem: the first 2 characters and 4 hex digits of the long name's hash
+	sprintf (hashedStem, "%.2s%04X", stem, (unsigned int) (_FAT_directory_hashName (filename, MAX_FILENAME_LENGTH) & 0xFFFF));
+
+	if (_FAT_directory_probeAlias (partition, dirCluster, stem, hashedStem, ext, alias, &tail)) {
+		return (tail != 0);
+	}
+
+	hashedTails = (u32*) _FAT_mem_callocate (partition->disc, (ALIAS_HASHED_TAILS / 32) + 1, sizeof(u32));
+	if (hashedTails == NULL) {
+		return false;
+	}
+	plainTails[0] = 0;
+
+	foundFile = _FAT_directory_getFirstEntry (partition, &tempEntry, dirCluster);
+	while (foundFile) {
+		_FAT_directory_entryGetAlias (tempEntry.entryData, entryAlias);
+		_FAT_directory_markAliasTail (plainTails, ALIAS_PLAIN_TAILS, _FAT_directory_aliasTail (entryAlias, stem, ext));
+		_FAT_directory_markAliasTail (plainTails, ALIAS_PLAIN_TAILS, _FAT_directory_aliasTail (tempEntry.filename, stem, ext));
+		_FAT_directory_markAliasTail (hashedTails, ALIAS_HASHED_TAILS, _FAT_directory_aliasTail (entryAlias, hashedStem, ext));
+		_FAT_directory_markAliasTail (hashedTails, ALIAS_HASHED_TAILS, _FAT_directory_aliasTail (tempEntry.filename, hashedStem, ext));
+		foundFile = _FAT_directory_getNextEntry (partition, &tempEntry);
+	}
+
+	tail = _FAT_directory_firstFreeTail (plainTails, ALIAS_PLAIN_TAILS);
+	if (tail == 0) {
+		tail = _FAT_directory_firstFreeTail (hashedTails, ALIAS_HASHED_TAILS);
+		strcpy (stem, hashedStem);
+	}
+	_FAT_mem_free (hashedTails);
+	if (tail == 0) {
+		// Couldn't get a tail number
+		return false;
+	}
+
+	_FAT_directory_formatAlias (alias, stem, ext, tail);
+	return true;
+}
+
 bool _FAT_directory_addEntry (PARTITION* partition, DIR_ENTRY* entry, u32 dirCluster) {
 	u32 entrySize;
 	u8 lfnEntry[DIR_ENTRY_DATA_SIZE];
@@ -697,6 +1232,7 @@ bool _FAT_directory_addEntry (PARTITION* partition, DIR_ENTRY* entry, u32 dirClu
 	bool entryStillValid;
 	u8 aliasCheckSum = 0;
 	char alias [MAX_ALIAS_LENGTH];
+	DIR_INDEX* index;
 
 	// Make sure the filename is not 0 length
 	if (strnlen (entry->filename, MAX_FILENAME_LENGTH) < 1) {
@@ -768,61 +1304,20 @@ bool _FAT_directory_addEntry (PARTITION* partition, DIR_ENTRY* entry, u32 dirClu
 		// Long filename needed
 		entrySize = ((strnlen (entry->filename, MAX_FILENAME_LENGTH) + LFN_ENTRY_LENGTH - 1) / LFN_ENTRY_LENGTH) + 1;
 		// Generate alias
-		tmpCharPtr = strrchr (entry->filename, '.');
-		if (tmpCharPtr == NULL) {
-			tmpCharPtr = strrchr (entry->filename, '\0');
-		}
-		for (i = 0, j = 0; (j < 6) && (entry->filename + i < tmpCharPtr); i++) {
-			if ( isalnum(entry->filename[i])) {
-				alias[j] = entry->filename[i];
-				++ j;
-			}
-		}
-		while (j < 8) {
-			alias[j] = '_';
-			++ j;
-		}
-		tmpCharPtr = strrchr (entry->filename, '.');
-		if (tmpCharPtr != NULL) {
-			alias[8] = '.';
-			// Copy extension
-			while ((*tmpCharPtr != '\0') && (j < 12)) {
-				alias[j] = tmpCharPtr[0];
-				++ tmpCharPtr;
-				++ j;
-			}
-			alias[j] = '\0';
-		} else {
-			for (j = 8; j < MAX_ALIAS_LENGTH; j++) {
-				alias[j] = '\0';
-			}
-		}
-
-		// Get a valid tail number
-		alias[5] = '~';
-		i = 0;
-		do {
-			i++;
-			alias[6] = '0' + ((i / 10) % 10);	// 10's digit
-			alias[7] = '0' + (i % 10);	// 1's digit
-		} while (_FAT_directory_entryExists (partition, alias, dirCluster) && (i < 100));
-		if (i == 100) {
-			// Couldn't get a tail number
+		if (!_FAT_directory_createAlias (partition, entry->filename, dirCluster, alias)) {
 			return false;
 		}
 
-		// Make it upper case
-		strupr (alias);
-
 		// Now copy it into the directory entry data
-		memcpy (entry->entryData, alias, 8);
-		memcpy (entry->entryData + 8, alias + 9, 3);
-		for (i = 0; i < 10; i++) {
-			if (entry->entryData[i] < 0x20) {
-				// Replace null and control characters with spaces
-				entry->entryData[i] = 0x20;
+		tmpCharPtr = strchr (alias, '.');
+		for (i = 0; (i < 8) && (alias + i != tmpCharPtr) && (alias[i] != '\0'); i++) {
+			entry->entryData[i] = alias[i];
+		}
+		if (tmpCharPtr != NULL) {
+			for (i = 0; (i < 3) && (tmpCharPtr[i + 1] != '\0'); i++) {
+				entry->entryData[8 + i] = tmpCharPtr[i + 1];
 			}
-		}	
+		}
 		// Generate alias checksum
 		for (i=0; i < 11; i++)
 		{
@@ -869,9 +1364,71 @@ bool _FAT_directory_addEntry (PARTITION* partition, DIR_ENTRY* entry, u32 dirClu
 		}
 	}
 
+	// Add the new entry to the index of the directory
+	entry->dirCluster = dirCluster;
+	index = _FAT_directory_indexFind (partition, dirCluster);
+	if ((index != NULL) && !_FAT_directory_indexInsert (index, entry)) {
+		_FAT_directory_indexDrop (partition, dirCluster);
+	}
+
 	return true;	
 }
 
+u32 _FAT_directory_entryCount (const char* name) {
+	if (_FAT_directory_isValidAlias (name)) {
+		return 1;
+	}
+	return ((strnlen (name, MAX_FILENAME_LENGTH) + LFN_ENTRY_LENGTH - 1) / LFN_ENTRY_LENGTH) + 1;
+}
+
+bool _FAT_directory_reserveEntries (PARTITION* partition, u32 dirCluster, u32 count) {
+	DIR_ENTRY_POSITION position;
+	u8 entryData[DIR_ENTRY_DATA_SIZE];
+	u32 entriesPerCluster;
+	u32 freeEntries;
+	u32 newClusters;
+	u32 cluster;
+	bool endOfDirectory;
+
+	dirCluster = _FAT_directory_indexCluster (partition, dirCluster);
+	if (dirCluster == FAT16_ROOT_DIR_CLUSTER) {
+		// The FAT12/16 root directory has a fixed size
+		return true;
+	}
+
+	// Count the unused entries behind the end of directory marker
+	position.cluster = dirCluster;
+	position.sector = 0;
+	position.offset = 0;
+	freeEntries = 0;
+	endOfDirectory = false;
+	do {
+		if (!endOfDirectory) {
+			_FAT_cache_readPartialSector (partition->cache, entryData, _FAT_fat_clusterToSector(partition, position.cluster) + position.sector, position.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE, partition->bytesPerSector);
+			endOfDirectory = (entryData[0] == DIR_ENTRY_LAST);
+		}
+		if (endOfDirectory) {
+			++ freeEntries;
+		}
+	} while (_FAT_directory_incrementDirEntryPosition (partition, &position, false));
+
+	// Room for the end of directory marker is needed too
+	if (freeEntries >= count + 1) {
+		return true;
+	}
+
+	entriesPerCluster = partition->sectorsPerCluster * (partition->bytesPerSector / DIR_ENTRY_DATA_SIZE);
+	newClusters = (count + 1 - freeEntries + entriesPerCluster - 1) / entriesPerCluster;
+	cluster = _FAT_fat_linkExtent (partition, position.cluster, newClusters);
+	if (cluster == CLUSTER_FREE) {
+		// No contiguous space, the directory grows one cluster at a time when entries are added
+		return true;
+	}
+
+	// A cleared cluster is filled with end of directory markers, the extent is contiguous
+	return _FAT_cache_fillSectors (partition->cache, _FAT_fat_clusterToSector (partition, cluster), newClusters * partition->sectorsPerCluster, 0);
+}
+
 bool _FAT_directory_chdir (PARTITION* partition, const char* path) {
 	DIR_ENTRY entry;
 
@@ -68,6 +68,7 @@ typedef struct {
 	u8 entryData[DIR_ENTRY_DATA_SIZE];
 	DIR_ENTRY_POSITION dataStart;		// Points to the start of the LFN entries of a file, or the alias for no LFN
 	DIR_ENTRY_POSITION dataEnd;			// Always points to the file/directory's alias entry
+	u32 dirCluster;						// First cluster of the directory containing the entry
 	char filename[MAX_FILENAME_LENGTH];
 } DIR_ENTRY;
 
@@ -169,6 +170,24 @@ Fill in a stat struct based on a file entry
 */
 /* void _FAT_directory_entryStat (PARTITION* partition, DIR_ENTRY* entry, struct stat *st); */
 
+/*
+Returns the number of directory entries needed for a file called name
+*/
+u32 _FAT_directory_entryCount (const char* name);
+
+/*
+Makes sure the directory starting at dirCluster has room for count more
+entries, allocating the missing clusters as one contiguous extent.
+Returns false if the disc could not be accessed
+*/
+bool _FAT_directory_reserveEntries (PARTITION* partition, u32 dirCluster, u32 count);
+
+/*
+Frees the lookup indexes of all directories.
+Must be called if directories were modified without the functions in this file.
+*/
+void _FAT_directory_freeIndex (PARTITION* partition);
+
 bool _FAT_directory_isValidLfn (const char* name);
 bool _FAT_directory_isValidAlias (const char* name);
 bool _FAT_directory_getRootEntry (PARTITION* partition, DIR_ENTRY* entry);
@@ -8,8 +8,11 @@
 #define IO_TYPE_RAM				2
 #define IO_TYPE_PARFLASH	3
 #define IO_TYPE_SDMMC     4
+#define IO_TYPE_MMAP      5
+#define IO_TYPE_FILE      6
 
 struct IO_INTERFACE_STRUCT;
+struct FAT_STATS_STRUCT;
 
 typedef int (* FN_MEDIUM_STARTUP)(const struct IO_INTERFACE_STRUCT* ptIO);
 typedef int (* FN_MEDIUM_ISINSERTED)(const struct IO_INTERFACE_STRUCT* ptIO);
@@ -17,6 +20,8 @@ typedef int (* FN_MEDIUM_READSECTORS)(const struct IO_INTERFACE_STRUCT* ptIO, un
 typedef int (* FN_MEDIUM_WRITESECTORS)(const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors, const void* buffer);
 typedef int (* FN_MEDIUM_CLEARSTATUS)(const struct IO_INTERFACE_STRUCT* ptIO);
 typedef int (* FN_MEDIUM_SHUTDOWN)(const struct IO_INTERFACE_STRUCT* ptIO);
+typedef void* (* FN_MEDIUM_MAPSECTORS)(const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors);
+typedef int (* FN_MEDIUM_FILLSECTORS)(const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors, unsigned char value);
 
 
 typedef void (*FN_FATFS_ERROR_HANDLER)(void *pvUser, const char* strFormat, ...);
@@ -34,13 +39,20 @@ struct IO_INTERFACE_STRUCT {
   unsigned long           ulBlockSize;
   unsigned long           ulPagePerSecCnt;
   void                    *pvUser;
-  unsigned long           ulStartOffset;
-  unsigned long           ulDiskSize;
+  unsigned long long      ullStartOffset;   // byte offsets and sizes may exceed 4GB
+  unsigned long long      ullDiskSize;
 
   FN_FATFS_ERROR_HANDLER  pfnErrorHandler;
   FN_FATFS_VPRINTF        pfnvprintf;
   void*                   pvErrUser;
 
+  /* optional: returns a pointer to the sectors in memory, NULL if they can not be accessed directly */
+  FN_MEDIUM_MAPSECTORS    fn_mapSectors ;
+  /* optional: sets every byte of the sectors to a value, NULL if the sectors must be written */
+  FN_MEDIUM_FILLSECTORS   fn_fillSectors ;
+
+  /* optional: counters of the partition, see fat/stats.h, NULL if they are not collected */
+  struct FAT_STATS_STRUCT* ptStats;
 } ;
 
 typedef struct IO_INTERFACE_STRUCT IO_INTERFACE ;
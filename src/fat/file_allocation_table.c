@@ -39,169 +39,347 @@
 
 #include "fat/file_allocation_table.h"
 #include "fat/partition.h"
+#include "fat/bit_ops.h"
+#include "fat/stats.h"
 #include <string.h>
+#include <stdlib.h>
 
 /*
-Gets the cluster linked from input cluster
+FAT12 packs two entries into three bytes. The kernels work on such a pair
+at a time, so every byte is loaded or stored once and there is no carry
+between the entries.
 */
-u32 _FAT_fat_nextCluster(PARTITION* partition, u32 cluster)
-{
-	u32 nextCluster = CLUSTER_FREE;
-	u32 sector;
-	int offset;
-  u32 sectorsize  = partition->bytesPerSector;
-	
-	switch (partition->filesysType) 
-	{
-		case FS_UNKNOWN:
-			nextCluster = CLUSTER_FREE;
-			break;
-			
-		case FS_FAT12:
-			sector = partition->fat.fatStart + (((cluster * 3) / 2) / sectorsize);
-			offset = ((cluster * 3) / 2) % sectorsize;
+static void _FAT_fat12_decode (const u8* raw, u32* table, u32 count) {
+	const u8* pair = raw;
+	u32 i;
 
+	for (i = 0; i + 1 < count; i += 2, pair += 3) {
+		table[i] = pair[0] | ((u32)(pair[1] & 0x0F) << 8);
+		table[i + 1] = (pair[1] >> 4) | ((u32)pair[2] << 4);
+	}
+	if (i < count) {
+		table[i] = pair[0] | ((u32)(pair[1] & 0x0F) << 8);
+	}
+}
 
-			_FAT_cache_readPartialSector (partition->cache, &nextCluster, sector, offset, sizeof(u8), partition->bytesPerSector);
+/*
+Encodes the entries first to last. The range is widened to whole pairs,
+the extra entry is not dirty and encodes to the bytes it already has.
+*/
+static void _FAT_fat12_encode (u8* raw, const u32* table, u32 first, u32 last, u32 count) {
+	u32 i = first & ~1u;
+	u8* pair = raw + (i >> 1) * 3;
+
+	for (; i <= last && i + 1 < count; i += 2, pair += 3) {
+		pair[0] = (u8)table[i];
+		pair[1] = (u8)(((table[i] >> 8) & 0x0F) | (table[i + 1] << 4));
+		pair[2] = (u8)(table[i + 1] >> 4);
+	}
+	if (i <= last) {
+		// The last entry of the table has no partner, keep the upper nibble
+		pair[0] = (u8)table[i];
+		pair[1] = (u8)((pair[1] & 0xF0) | ((table[i] >> 8) & 0x0F));
+	}
+}
 
-			offset++;
-			
-			if (offset >= sectorsize) {
-				offset = 0;
-				sector++;
-			}
-			
-			_FAT_cache_readPartialSector (partition->cache, ((u8*)&nextCluster) + sizeof(u8), sector, offset, sizeof(u8), partition->bytesPerSector);
-			
-			if (cluster & 0x01) {
-				nextCluster = nextCluster >> 4;
-			} else 	{
-				nextCluster &= 0x0FFF;
-			}
-			
-			if (nextCluster >= 0x0FF7)
-			{
-				nextCluster = CLUSTER_EOF;
-			}
+/*
+Reads the FAT of the partition and decodes all entries into fat.table.
+The raw sectors are kept to write changed entries back in _FAT_fat_flush.
+*/
+bool _FAT_fat_load (PARTITION* partition) {
+	FAT* fat = &partition->fat;
+	u32 rawSize;
+	u32 capacity;
+	u32 i;
 
+	_FAT_fat_free(partition);
+
+	rawSize = fat->sectorsPerFat * partition->bytesPerSector;
+	switch (partition->filesysType)
+	{
+		case FS_FAT12:
+			capacity = (rawSize * 2) / 3;
+			fat->entryMask = 0x0FFF;
+			fat->eofMark = 0x0FF7;
 			break;
-			
 		case FS_FAT16:
-			sector = partition->fat.fatStart + ((cluster << 1) / sectorsize);
-			offset = (cluster % (sectorsize >> 1)) << 1;
-			
-			_FAT_cache_readPartialSector (partition->cache, &nextCluster, sector, offset, sizeof(u16), partition->bytesPerSector);
-			
-			if (nextCluster >= 0xFFF7)
-			{
-				nextCluster = CLUSTER_EOF;
-			}
+			capacity = rawSize / 2;
+			fat->entryMask = 0xFFFF;
+			fat->eofMark = 0xFFF7;
 			break;
-			
 		case FS_FAT32:
-			sector = partition->fat.fatStart + ((cluster << 2) / sectorsize);
-			offset = (cluster % (sectorsize >> 2)) << 2;
-			
-			_FAT_cache_readPartialSector (partition->cache, &nextCluster, sector, offset, sizeof(u32), partition->bytesPerSector);
-			
-			if (nextCluster >= 0x0FFFFFF7)
-			{
-				nextCluster = CLUSTER_EOF;
+			capacity = rawSize / 4;
+			fat->entryMask = 0x0FFFFFFF;
+			fat->eofMark = 0x0FFFFFF7;
+			break;
+		default:
+			return false;
+	}
+
+	// Entries 0 and 1 are reserved, the data clusters start at 2
+	fat->numberOfEntries = fat->lastCluster + 2;
+	if (fat->numberOfEntries > capacity) {
+		// The FAT is too small for the data area, do not use the clusters it can't describe
+		if (capacity < CLUSTER_FIRST + 1) {
+			return false;
+		}
+		fat->numberOfEntries = capacity;
+		fat->lastCluster = capacity - 1;
+	}
+
+	fat->raw = (u8*) _FAT_mem_allocate(partition->disc, rawSize);
+	fat->table = (u32*) _FAT_mem_allocate(partition->disc, fat->numberOfEntries * sizeof(u32));
+	fat->freeMap = (u32*) _FAT_mem_callocate(partition->disc, (fat->numberOfEntries + 31) / 32, sizeof(u32));
+	if (fat->raw == NULL || fat->table == NULL || fat->freeMap == NULL) {
+		_FAT_fat_free(partition);
+		return false;
+	}
+
+	if (!_FAT_cache_readSectors(partition->cache, fat->fatStart, fat->sectorsPerFat, fat->raw)) {
+		_FAT_fat_free(partition);
+		return false;
+	}
+
+	switch (partition->filesysType)
+	{
+		case FS_FAT12:
+			_FAT_fat12_decode(fat->raw, fat->table, fat->numberOfEntries);
+			break;
+		case FS_FAT16:
+			for (i = 0; i < fat->numberOfEntries; i++) {
+				fat->table[i] = u8array_to_u16(fat->raw, i << 1);
 			}
 			break;
-			
 		default:
-			nextCluster = CLUSTER_FREE;
+			for (i = 0; i < fat->numberOfEntries; i++) {
+				fat->table[i] = u8array_to_u32(fat->raw, i << 2);
+			}
 			break;
 	}
-	
-	return nextCluster;
+
+	// Build the free cluster map
+	fat->freeCount = 0;
+	for (i = CLUSTER_FIRST; i <= fat->lastCluster; i++) {
+		if ((fat->table[i] & fat->entryMask) == CLUSTER_FREE) {
+			fat->freeMap[i >> 5] |= 1U << (i & 31);
+			fat->freeCount++;
+		}
+	}
+
+	fat->dirtyFirst = 1;
+	fat->dirtyLast = 0;
+	return true;
 }
 
 /*
-writes value into the correct offset within a partition's FAT, based 
-on the cluster number.
+Encodes the entries changed since the last flush and writes the
+affected FAT sectors to the disc.
 */
-static bool _FAT_fat_writeFatEntry (PARTITION* partition, u32 cluster, u32 value) {
-	u32 sector;
-	int offset;
-	u8 oldValue;
-  u32 sectorsize = partition->bytesPerSector;
-
-	if ((cluster < 0x0002) || (cluster > partition->fat.lastCluster))
-	{
-		return false;
+bool _FAT_fat_flush (PARTITION* partition) {
+	FAT* fat = &partition->fat;
+	u32 sectorsize = partition->bytesPerSector;
+	u32 i;
+	u32 firstByte;
+	u32 lastByte;
+	u32 firstSector;
+	u32 lastSector;
+	u32 copy;
+
+	if (fat->table == NULL || fat->dirtyFirst > fat->dirtyLast) {
+		return true;
 	}
-	
-	switch (partition->filesysType) 
+
+	switch (partition->filesysType)
 	{
-		case FS_UNKNOWN:
-			return false;
-			break;
-			
 		case FS_FAT12:
-			sector = partition->fat.fatStart + (((cluster * 3) / 2) / sectorsize);
-			offset = ((cluster * 3) / 2) % sectorsize;
+			_FAT_fat12_encode(fat->raw, fat->table, fat->dirtyFirst, fat->dirtyLast, fat->numberOfEntries);
+			firstByte = (fat->dirtyFirst * 3) / 2;
+			lastByte = (fat->dirtyLast * 3) / 2 + 1;
+			break;
+		case FS_FAT16:
+			for (i = fat->dirtyFirst; i <= fat->dirtyLast; i++) {
+				u16_to_u8array(fat->raw, i << 1, (u16)fat->table[i]);
+			}
+			firstByte = fat->dirtyFirst << 1;
+			lastByte = (fat->dirtyLast << 1) + 1;
+			break;
+		default:
+			for (i = fat->dirtyFirst; i <= fat->dirtyLast; i++) {
+				u32_to_u8array(fat->raw, i << 2, fat->table[i]);
+			}
+			firstByte = fat->dirtyFirst << 2;
+			lastByte = (fat->dirtyLast << 2) + 3;
+			break;
+	}
 
-			if (cluster & 0x01) {
+	// Write the changed sectors to every copy of the FAT
+	firstSector = firstByte / sectorsize;
+	lastSector = lastByte / sectorsize;
+	for (copy = 0; copy < fat->numberOfFats; copy++) {
+		if (!_FAT_cache_writeSectors(partition->cache, fat->fatStart + copy * fat->sectorsPerFat + firstSector,
+			lastSector - firstSector + 1, fat->raw + firstSector * sectorsize)) {
+			return false;
+		}
+	}
 
-				_FAT_cache_readPartialSector (partition->cache, &oldValue, sector, offset, sizeof(u8), partition->bytesPerSector);
+	fat->dirtyFirst = 1;
+	fat->dirtyLast = 0;
+	return true;
+}
 
-				value = (value << 4) | (oldValue & 0x0F);
+/*
+Frees the in-memory FAT without writing it back
+*/
+void _FAT_fat_free (PARTITION* partition) {
+	_FAT_mem_free(partition->fat.raw);
+	_FAT_mem_free(partition->fat.table);
+	_FAT_mem_free(partition->fat.freeMap);
+	partition->fat.raw = NULL;
+	partition->fat.table = NULL;
+	partition->fat.freeMap = NULL;
+	partition->fat.numberOfEntries = 0;
+	partition->fat.freeCount = 0;
+	partition->fat.dirtyFirst = 1;
+	partition->fat.dirtyLast = 0;
+}
 
-				_FAT_cache_writePartialSector (partition->cache, &value, sector, offset, sizeof(u8), partition->bytesPerSector);
+/*
+Gets the cluster linked from input cluster
+*/
+u32 _FAT_fat_nextCluster(PARTITION* partition, u32 cluster)
+{
+	u32 nextCluster;
 
-				offset++;
-				if (offset >= sectorsize) {
-					offset = 0;
-					sector++;
-				}
+	FAT_STATS_ADD(partition->disc, nextClusterLookups, 1);
+	if (cluster >= partition->fat.numberOfEntries) {
+		return CLUSTER_FREE;
+	}
 
-				_FAT_cache_writePartialSector (partition->cache, ((u8*)&value) + sizeof(u8), sector, offset, sizeof(u8), partition->bytesPerSector);
+	nextCluster = partition->fat.table[cluster] & partition->fat.entryMask;
+	if (nextCluster >= partition->fat.eofMark) {
+		nextCluster = CLUSTER_EOF;
+	}
 
-			} else {
-			
-				_FAT_cache_writePartialSector (partition->cache, &value, sector, offset, sizeof(u8), partition->bytesPerSector);
-		
-				offset++;
-				if (offset >= sectorsize) {
-					offset = 0;
-					sector++;
-				}
-				
-				_FAT_cache_readPartialSector (partition->cache, &oldValue, sector, offset, sizeof(u8), partition->bytesPerSector);
+	return nextCluster;
+}
 
-				value = ((value >> 8) & 0x0F) | (oldValue & 0xF0);
+/*
+writes value into the correct entry of the partition's FAT, based 
+on the cluster number. The change is written to the disc by _FAT_fat_flush.
+*/
+static bool _FAT_fat_writeFatEntry (PARTITION* partition, u32 cluster, u32 value) {
+	FAT* fat = &partition->fat;
 
-				_FAT_cache_writePartialSector (partition->cache, &value, sector, offset, sizeof(u8), partition->bytesPerSector);
-			}
+	if ((cluster < 0x0002) || (cluster > fat->lastCluster))
+	{
+		return false;
+	}
 
+	switch (partition->filesysType) 
+	{
+		case FS_FAT12:
+			value &= 0x0FFF;
 			break;
-			
 		case FS_FAT16:
-			sector = partition->fat.fatStart + ((cluster << 1) / sectorsize);
-			offset = (cluster % (sectorsize >> 1)) << 1; 
-
-			_FAT_cache_writePartialSector (partition->cache, &value, sector, offset, sizeof(u16), partition->bytesPerSector);
-
+			value &= 0xFFFF;
 			break;
-			
 		case FS_FAT32:
-			sector = partition->fat.fatStart + ((cluster << 2) / sectorsize);
-			offset = (cluster % (sectorsize >> 2)) << 2;
-			
-			_FAT_cache_writePartialSector (partition->cache, &value, sector, offset, sizeof(u32), partition->bytesPerSector);
-
 			break;
-			
 		default:
 			return false;
-			break;
 	}
-			
+
+	// Keep the free cluster map up to date
+	if ((fat->table[cluster] & fat->entryMask) == CLUSTER_FREE) {
+		if ((value & fat->entryMask) != CLUSTER_FREE) {
+			fat->freeMap[cluster >> 5] &= ~(1U << (cluster & 31));
+			fat->freeCount--;
+		}
+	} else if ((value & fat->entryMask) == CLUSTER_FREE) {
+		fat->freeMap[cluster >> 5] |= 1U << (cluster & 31);
+		fat->freeCount++;
+	}
+
+	fat->table[cluster] = value;
+	FAT_STATS_ADD(partition->disc, fatWrites, 1);
+	if (fat->dirtyFirst > fat->dirtyLast) {
+		fat->dirtyFirst = fat->dirtyLast = cluster;
+	} else if (cluster < fat->dirtyFirst) {
+		fat->dirtyFirst = cluster;
+	} else if (cluster > fat->dirtyLast) {
+		fat->dirtyLast = cluster;
+	}
+
 	return true;
 }
 
+/*
+Returns the first free cluster in the range first..last (inclusive)
+or CLUSTER_FREE if there is none. The free map is scanned a word at a time.
+*/
+static u32 _FAT_fat_scanFreeMap (const FAT* fat, u32 first, u32 last) {
+	u32 word = first >> 5;
+	u32 lastWord = last >> 5;
+	u32 bits = fat->freeMap[word] & (0xFFFFFFFFU << (first & 31));
+	u32 cluster;
+
+	while (bits == 0) {
+		if (++word > lastWord) {
+			return CLUSTER_FREE;
+		}
+		bits = fat->freeMap[word];
+	}
+
+	cluster = (word << 5) + u32_ctz(bits);
+	return (cluster <= last) ? cluster : CLUSTER_FREE;
+}
+
+/*
+Returns the first cluster in the range first..last (inclusive) which
+is in use, or last + 1 if all of them are free.
+*/
+static u32 _FAT_fat_scanUsedMap (const FAT* fat, u32 first, u32 last) {
+	u32 word = first >> 5;
+	u32 lastWord = last >> 5;
+	u32 bits = ~fat->freeMap[word] & (0xFFFFFFFFU << (first & 31));
+	u32 cluster;
+
+	while (bits == 0) {
+		if (++word > lastWord) {
+			return last + 1;
+		}
+		bits = ~fat->freeMap[word];
+	}
+
+	cluster = (word << 5) + u32_ctz(bits);
+	return (cluster <= last) ? cluster : last + 1;
+}
+
+/*
+Returns the first free cluster at or after start, wrapping around
+to the beginning of the FAT. Returns CLUSTER_FREE if the FAT is full.
+The free map words read are counted as probes.
+*/
+static u32 _FAT_fat_findFreeCluster (PARTITION* partition, u32 start) {
+	const FAT* fat = &partition->fat;
+	u32 cluster;
+
+	if (fat->freeCount == 0) {
+		return CLUSTER_FREE;
+	}
+	if ((start < CLUSTER_FIRST) || (start > fat->lastCluster)) {
+		start = CLUSTER_FIRST;
+	}
+
+	cluster = _FAT_fat_scanFreeMap(fat, start, fat->lastCluster);
+	FAT_STATS_ADD(partition->disc, freeClusterProbes, (((cluster == CLUSTER_FREE) ? fat->lastCluster : cluster) >> 5) - (start >> 5) + 1);
+	if ((cluster == CLUSTER_FREE) && (start > CLUSTER_FIRST)) {
+		cluster = _FAT_fat_scanFreeMap(fat, CLUSTER_FIRST, start - 1);
+		FAT_STATS_ADD(partition->disc, freeClusterProbes, (((cluster == CLUSTER_FREE) ? start - 1 : cluster) >> 5) - (CLUSTER_FIRST >> 5) + 1);
+	}
+	return cluster;
+}
+
 /*-----------------------------------------------------------------
 gets the first available free cluster, sets it
 to end of file, links the input cluster to it then returns the 
@@ -212,7 +390,6 @@ u32 _FAT_fat_linkFreeCluster(PARTITION* partition, u32 cluster) {
 	u32 firstFree;
 	u32 curLink;
 	u32 lastCluster;
-	bool loopedAroundFAT = false;
 
 	lastCluster =  partition->fat.lastCluster;
 
@@ -226,28 +403,12 @@ u32 _FAT_fat_linkFreeCluster(PARTITION* partition, u32 cluster) {
 		return curLink;	// Return the current link - don't allocate a new one
 	}
 	
-	// Get a free cluster
-	firstFree = partition->fat.firstFree;
-	// Start at first valid cluster
-	if (firstFree < CLUSTER_FIRST) {
-		firstFree = CLUSTER_FIRST;
-	}
-
-	// Search until a free cluster is found
-	while (_FAT_fat_nextCluster(partition, firstFree) != CLUSTER_FREE) {
-		firstFree++;
-		if (firstFree > lastCluster) {
-			if (loopedAroundFAT) {
-				// If couldn't get a free cluster then return, saying this fact
-				partition->fat.firstFree = firstFree;
-				return CLUSTER_FREE;
-			} else {
-				// Try looping back to the beginning of the FAT
-				// This was suggested by loopy
-				firstFree = CLUSTER_FIRST;
-				loopedAroundFAT = true;
-			}
-		}
+	// Get a free cluster, searching from the last allocation and looping
+	// back to the beginning of the FAT (this was suggested by loopy)
+	firstFree = _FAT_fat_findFreeCluster(partition, partition->fat.firstFree);
+	if (firstFree == CLUSTER_FREE) {
+		// If couldn't get a free cluster then return, saying this fact
+		return CLUSTER_FREE;
 	}
 	partition->fat.firstFree = firstFree;
 
@@ -262,6 +423,71 @@ u32 _FAT_fat_linkFreeCluster(PARTITION* partition, u32 cluster) {
 	return firstFree;
 }
 
+/*-----------------------------------------------------------------
+_FAT_fat_allocateExtent
+Allocates count physically contiguous clusters and links them into
+a chain. The smallest run of free clusters which is large enough is
+used (best fit). Returns the first cluster of the chain, or
+CLUSTER_FREE if there is no run of count free clusters.
+-----------------------------------------------------------------*/
+u32 _FAT_fat_allocateExtent (PARTITION* partition, u32 count) {
+	FAT* fat = &partition->fat;
+	u32 runStart;
+	u32 runEnd;
+	u32 bestStart = CLUSTER_FREE;
+	u32 bestLength = 0;
+	u32 cluster;
+
+	if ((count == 0) || (count > fat->freeCount)) {
+		return CLUSTER_FREE;
+	}
+
+	// Walk all runs of free clusters
+	runStart = _FAT_fat_scanFreeMap(fat, CLUSTER_FIRST, fat->lastCluster);
+	while (runStart != CLUSTER_FREE) {
+		runEnd = _FAT_fat_scanUsedMap(fat, runStart, fat->lastCluster);
+		if ((runEnd - runStart >= count) && ((bestStart == CLUSTER_FREE) || (runEnd - runStart < bestLength))) {
+			bestStart = runStart;
+			bestLength = runEnd - runStart;
+			if (bestLength == count) {
+				break;
+			}
+		}
+		if (runEnd > fat->lastCluster) {
+			break;
+		}
+		runStart = _FAT_fat_scanFreeMap(fat, runEnd, fat->lastCluster);
+	}
+
+	if (bestStart == CLUSTER_FREE) {
+		return CLUSTER_FREE;
+	}
+
+	// Link the chain in one pass
+	for (cluster = bestStart; cluster < bestStart + count - 1; cluster++) {
+		_FAT_fat_writeFatEntry (partition, cluster, cluster + 1);
+	}
+	_FAT_fat_writeFatEntry (partition, cluster, CLUSTER_EOF);
+
+	return bestStart;
+}
+
+/*-----------------------------------------------------------------
+_FAT_fat_linkExtent
+Allocates count contiguous clusters like _FAT_fat_allocateExtent and
+appends them to the chain ending at cluster. Returns the first new
+cluster, or CLUSTER_FREE if there is no run of count free clusters.
+-----------------------------------------------------------------*/
+u32 _FAT_fat_linkExtent (PARTITION* partition, u32 cluster, u32 count) {
+	u32 firstCluster;
+
+	firstCluster = _FAT_fat_allocateExtent (partition, count);
+	if ((firstCluster != CLUSTER_FREE) && (cluster >= CLUSTER_FIRST)) {
+		_FAT_fat_writeFatEntry (partition, cluster, firstCluster);
+	}
+	return firstCluster;
+}
+
 /*-----------------------------------------------------------------
 gets the first available free cluster, sets it
 to end of file, links the input cluster to it, clears the new
@@ -270,9 +496,6 @@ If an error occurs, return CLUSTER_FREE
 -----------------------------------------------------------------*/
 u32 _FAT_fat_linkFreeClusterCleared (PARTITION* partition, u32 cluster) {
 	u32 newCluster;
-	int i;
-	u8 emptySector[EXT_CACHE_PAGE_SIZE];
-  u32 sectorsize = partition->bytesPerSector;
 	
 	// Link the cluster
 	newCluster = _FAT_fat_linkFreeCluster(partition, cluster);
@@ -282,12 +505,8 @@ u32 _FAT_fat_linkFreeClusterCleared (PARTITION* partition, u32 cluster) {
 	}
 
 	// Clear all the sectors within the cluster
-	memset (emptySector, 0, sectorsize);
-	for (i = 0; i < partition->sectorsPerCluster; i++) {
-		_FAT_disc_writeSectors (partition->disc, 
-			_FAT_fat_clusterToSector (partition, newCluster) + i,
-			1, emptySector);
-	}
+	_FAT_cache_fillSectors (partition->cache, _FAT_fat_clusterToSector (partition, newCluster),
+		partition->sectorsPerCluster, 0);
 	
 	return newCluster;
 }
@@ -322,13 +541,48 @@ bool _FAT_fat_clearLinks (PARTITION* partition, u32 cluster) {
 	return true;
 }
 
+/*-----------------------------------------------------------------
+_FAT_fat_trimChain
+Drop all clusters past chainLength in the chain starting at startCluster.
+If chainLength is 0, all clusters are freed.
+Returns the new last cluster of the chain, or CLUSTER_FREE if the chain
+is empty or shorter than chainLength.
+-----------------------------------------------------------------*/
+u32 _FAT_fat_trimChain (PARTITION* partition, u32 startCluster, u32 chainLength) {
+	u32 nextCluster;
+
+	if (chainLength == 0) {
+		_FAT_fat_clearLinks (partition, startCluster);
+		return CLUSTER_FREE;
+	}
+
+	// Find the last cluster to keep
+	while (--chainLength > 0) {
+		startCluster = _FAT_fat_nextCluster (partition, startCluster);
+		if ((startCluster == CLUSTER_FREE) || (startCluster == CLUSTER_EOF)) {
+			return CLUSTER_FREE;
+		}
+	}
+
+	// Free the rest of the chain and end it at the last cluster
+	nextCluster = _FAT_fat_nextCluster (partition, startCluster);
+	if ((nextCluster != CLUSTER_FREE) && (nextCluster != CLUSTER_EOF)) {
+		_FAT_fat_clearLinks (partition, nextCluster);
+		_FAT_fat_writeFatEntry (partition, startCluster, CLUSTER_EOF);
+	}
+
+	return startCluster;
+}
+
 /*-----------------------------------------------------------------
 _FAT_fat_lastCluster
 Trace the cluster links until the last one is found
 -----------------------------------------------------------------*/
 u32 _FAT_fat_lastCluster (PARTITION* partition, u32 cluster) {
-	while ((_FAT_fat_nextCluster(partition, cluster) != CLUSTER_FREE) && (_FAT_fat_nextCluster(partition, cluster) != CLUSTER_EOF)) {
-		cluster = _FAT_fat_nextCluster(partition, cluster);
+	u32 nextCluster;
+
+	while (((nextCluster = _FAT_fat_nextCluster(partition, cluster)) != CLUSTER_FREE) && (nextCluster != CLUSTER_EOF)) {
+		cluster = nextCluster;
 	}
 	return cluster;
 }
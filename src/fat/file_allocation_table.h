@@ -48,12 +48,19 @@
 #define CLUSTERS_PER_FAT16 65525
 
 
+bool _FAT_fat_load (PARTITION* partition);
+bool _FAT_fat_flush (PARTITION* partition);
+void _FAT_fat_free (PARTITION* partition);
+
 u32 _FAT_fat_nextCluster(PARTITION* partition, u32 cluster);
 
 u32 _FAT_fat_linkFreeCluster(PARTITION* partition, u32 cluster);
 u32 _FAT_fat_linkFreeClusterCleared (PARTITION* partition, u32 cluster);
+u32 _FAT_fat_allocateExtent (PARTITION* partition, u32 count);
+u32 _FAT_fat_linkExtent (PARTITION* partition, u32 cluster, u32 count);
 
 bool _FAT_fat_clearLinks (PARTITION* partition, u32 cluster);
+u32 _FAT_fat_trimChain (PARTITION* partition, u32 startCluster, u32 chainLength);
 
 u32 _FAT_fat_lastCluster (PARTITION* partition, u32 cluster);
 
@@ -64,6 +71,8 @@ static inline u32 _FAT_fat_clusterToSector (PARTITION* partition, u32 cluster) {
 
 bool _FAT_disc_readSectors (const IO_INTERFACE *ptIo, u32 sector, u32 numSectors, void* buffer);
 bool _FAT_disc_writeSectors (const IO_INTERFACE *ptIo, u32 sector, u32 numSectors, const void* buffer);
+void* _FAT_disc_mapSectors (const IO_INTERFACE *ptIo, u32 sector, u32 numSectors);
+bool _FAT_disc_fillSectors (const IO_INTERFACE *ptIo, u32 sector, u32 numSectors, u8 value);
 bool _FAT_disc_startup (const IO_INTERFACE *ptIo);
 bool _FAT_disc_isInserted (const IO_INTERFACE *ptIo);
 bool _FAT_disc_clearStatus (const IO_INTERFACE *ptIo);
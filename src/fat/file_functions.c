@@ -1,6 +1,7 @@
 
 #include <string.h>
 #include <stdio.h> // printf
+#include <stdlib.h>
 
 #include "fat/common.h"
 #include "fat/file_functions.h"
@@ -83,7 +84,12 @@ int file_delete_direntry(PARTITION *ptPartition, DIR_ENTRY *ptDirEntry)
         iRet = 0;
     }
     
-    // Flush any sectors in the disc cache
+    // Write the changed FAT entries and flush any sectors in the disc cache
+    iResult = _FAT_fat_flush(ptPartition);
+    if( !iResult )
+    {
+        iRet = 0;
+    }
     iResult = _FAT_cache_flush(ptPartition->cache);
     if( !iResult )
     {
@@ -184,6 +190,8 @@ int FileCreate(PARTITION *ptPartition, const char *szFile, FILE_STRUCT *ptFile)
     ptFile->tDirEntryStart      = tDirEntry.dataStart;
     ptFile->tDirEntryEnd        = tDirEntry.dataEnd;
     ptFile->tPosition.ulCluster = ulFirstFileCluster;
+    ptFile->ulEntryCluster      = _FAT_directory_entryGetCluster(tDirEntry.entryData);
+    memcpy(ptFile->abEntryName, tDirEntry.entryData + DIR_ENTRY_name, FILE_ENTRY_NAME_SIZE);
   }
   return 1;
 }
@@ -207,7 +215,18 @@ int FileClose(FILE_STRUCT* ptFile)
   // Must the filesize and start cluster be updated?
   ulOldFilesize = u8array_to_u32(dirEntryData, DIR_ENTRY_fileSize);
   ulOldStartCluster = u8array_to_u16(dirEntryData, DIR_ENTRY_cluster) | (u8array_to_u16(dirEntryData, DIR_ENTRY_clusterHigh) << 16);
-  if( ulOldFilesize!=ptFile->ulFilesize || ulOldStartCluster!=ptFile->ulStartCluster )
+  if( ulOldStartCluster!=ptFile->ulEntryCluster || memcmp(dirEntryData + DIR_ENTRY_name, ptFile->abEntryName, FILE_ENTRY_NAME_SIZE)!=0 )
+  {
+    /* the file was deleted or replaced since it was opened, the slot belongs to another entry now.
+       Nothing refers to the clusters of the handle any more, free them to keep the FAT consistent.
+       fatfs refuses to delete an open file, so they can't belong to another file. */
+    if( ptFile->ulStartCluster!=CLUSTER_FREE && ptFile->ulStartCluster!=ulOldStartCluster )
+    {
+      _FAT_fat_clearLinks(ptFile->ptPartition, ptFile->ulStartCluster);
+    }
+    iRet = 0;
+  }
+  else if( ulOldFilesize!=ptFile->ulFilesize || ulOldStartCluster!=ptFile->ulStartCluster )
   {
     // Write new data to the directory entry
     // File size
@@ -232,16 +251,22 @@ int FileClose(FILE_STRUCT* ptFile)
                                   ptFile->ptPartition->bytesPerSector);
   }
 
-  // Flush any sectors in the disc cache
+  // Write the changed FAT entries and flush any sectors in the disc cache
+  if (!_FAT_fat_flush(ptFile->ptPartition)) 
+  {
+    iRet = 0;
+  }
   if (!_FAT_cache_flush(ptFile->ptPartition->cache)) 
   {
     iRet = 0;
   }
+
+  FileFreeExtents(ptFile);
   
   return iRet;
 }
 
-int FileWrite(FILE_STRUCT* ptFile, const void* pvData, unsigned long ulDataLen)
+unsigned long FileWrite(FILE_STRUCT* ptFile, const void* pvData, unsigned long ulDataLen)
 {
   PARTITION*      ptPartition = ptFile->ptPartition;
   CACHE*          ptCache     = ptPartition->cache;  
@@ -252,8 +277,37 @@ int FileWrite(FILE_STRUCT* ptFile, const void* pvData, unsigned long ulDataLen)
   int             fAppend     = 0;
   const unsigned char*  pbData      = (const unsigned char*)pvData;
   int             fNoError    = 1;
+  unsigned long   ulMaxClusters;
+  unsigned long   ulRunClusters;
+  unsigned long   ulRunCluster;
  
 
+  /* Nothing to write, do not allocate a cluster for it */
+  if( ulDataLen==0 )
+  {
+    return 0;
+  }
+
+  /* The file must not grow beyond what the directory entry can hold */
+  if( ulDataLen > FILE_MAX_SIZE - ptFile->ulCurrentPosition )
+  {
+    return 0;
+  }
+
+  /* An empty file may have no cluster at all, get the first one */
+  if( ptFile->ulStartCluster==CLUSTER_FREE )
+  {
+    ulTempNextCluster = _FAT_fat_linkFreeCluster(ptPartition, CLUSTER_FREE);
+    if( ulTempNextCluster==CLUSTER_FREE )
+    {
+      return 0;
+    }
+    ptFile->ulStartCluster      = ulTempNextCluster;
+    ptFile->tPosition.ulCluster = ulTempNextCluster;
+    ptFile->tPosition.ulSector  = 0;
+    ptFile->tPosition.ulByte    = 0;
+  }
+
   tPosition = ptFile->tPosition;
   /* Check if we are appending */
   if( (ulDataLen + ptFile->ulCurrentPosition) > ptFile->ulFilesize) 
@@ -324,11 +378,11 @@ int FileWrite(FILE_STRUCT* ptFile, const void* pvData, unsigned long ulDataLen)
 
   if(iTempVar > 0) 
   {
-    _FAT_disc_writeSectors(ptPartition->disc, 
-                           _FAT_fat_clusterToSector(ptPartition, 
-                                                    tPosition.ulCluster) + tPosition.ulSector, 
-                           iTempVar, 
-                           pbData);
+    _FAT_cache_writeSectors(ptPartition->cache, 
+                            _FAT_fat_clusterToSector(ptPartition, 
+                                                     tPosition.ulCluster) + tPosition.ulSector, 
+                            iTempVar, 
+                            pbData);
                            
     pbData   += iTempVar * ptPartition->bytesPerSector;
     ulRemain -= iTempVar * ptPartition->bytesPerSector;
@@ -354,15 +408,30 @@ int FileWrite(FILE_STRUCT* ptFile, const void* pvData, unsigned long ulDataLen)
     }
   }
 
-  // Write whole clusters
+  // Write whole clusters, one request for each run of adjacent clusters
   while( (ulRemain >= ptPartition->bytesPerCluster) && fNoError) 
   {
-    _FAT_disc_writeSectors(ptPartition->disc, 
-                           _FAT_fat_clusterToSector(ptPartition, tPosition.ulCluster),
-                           ptPartition->sectorsPerCluster, 
-                           pbData);
-    pbData   += ptPartition->bytesPerCluster;
-    ulRemain -= ptPartition->bytesPerCluster;
+    ulMaxClusters = ulRemain / ptPartition->bytesPerCluster;
+    ulRunClusters = 1;
+    ulRunCluster  = tPosition.ulCluster;
+    while( ulRunClusters < ulMaxClusters )
+    {
+      ulTempNextCluster = _FAT_fat_nextCluster(ptPartition, ulRunCluster);
+      if( ulTempNextCluster != ulRunCluster + 1 )
+      {
+        break;
+      }
+      ulRunCluster = ulTempNextCluster;
+      ++ulRunClusters;
+    }
+
+    _FAT_cache_writeSectors(ptPartition->cache, 
+                            _FAT_fat_clusterToSector(ptPartition, tPosition.ulCluster),
+                            ulRunClusters * ptPartition->sectorsPerCluster, 
+                            pbData);
+    pbData   += ulRunClusters * ptPartition->bytesPerCluster;
+    ulRemain -= ulRunClusters * ptPartition->bytesPerCluster;
+    tPosition.ulCluster = ulRunCluster;
     
     if(ulRemain > 0) 
     {
@@ -393,10 +462,10 @@ int FileWrite(FILE_STRUCT* ptFile, const void* pvData, unsigned long ulDataLen)
   
   if( (iTempVar > 0) && fNoError) 
   {
-    _FAT_disc_writeSectors(ptPartition->disc, 
-                           _FAT_fat_clusterToSector(ptPartition, tPosition.ulCluster), 
-                           iTempVar,
-                           pbData);
+    _FAT_cache_writeSectors(ptPartition->cache, 
+                            _FAT_fat_clusterToSector(ptPartition, tPosition.ulCluster), 
+                            iTempVar,
+                            pbData);
     pbData             += iTempVar * ptPartition->bytesPerSector;
     ulRemain           -= iTempVar * ptPartition->bytesPerSector;
     tPosition.ulSector += iTempVar;
@@ -429,13 +498,376 @@ int FileWrite(FILE_STRUCT* ptFile, const void* pvData, unsigned long ulDataLen)
   // Amount read is the originally requested amount minus stuff remaining
   ulDataLen = ulDataLen - ulRemain;
 
-  // Update file information
-  ptFile->tPosition   = tPosition;
-  ptFile->ulFilesize += ulDataLen;
+  // Update file information, existing data was overwritten in place
+  ptFile->tPosition          = tPosition;
+  ptFile->ulCurrentPosition += ulDataLen;
+  if( ptFile->ulCurrentPosition > ptFile->ulFilesize )
+  {
+    ptFile->ulFilesize = ptFile->ulCurrentPosition;
+  }
 
   return ulDataLen;
 }
 
+/* number of extents allocated for the first run of a file */
+#define FILE_EXTENTS_INITIAL 16
+
+/*
+  Appends ulCluster to the runs in ptFile->ptExtents.
+  Returns 0 if there is no memory for a new run.
+*/
+static int file_extents_add(FILE_STRUCT *ptFile, unsigned long ulCluster)
+{
+  FILE_EXTENT*  ptExtent;
+  unsigned long ulFileCluster;
+  unsigned long ulMax;
+
+
+  ulFileCluster = 0;
+  if( ptFile->ulExtents>0 )
+  {
+    ptExtent = ptFile->ptExtents + ptFile->ulExtents - 1;
+    if( ulCluster==ptExtent->ulCluster + ptExtent->ulClusters )
+    {
+      /* the cluster continues the last run */
+      ++ptExtent->ulClusters;
+      return 1;
+    }
+    ulFileCluster = ptExtent->ulFileCluster + ptExtent->ulClusters;
+  }
+
+  if( ptFile->ulExtents==ptFile->ulExtentsMax )
+  {
+    ulMax = (ptFile->ulExtentsMax==0) ? FILE_EXTENTS_INITIAL : ptFile->ulExtentsMax * 2;
+    /* not counted in the heap statistics, a handle may be freed after its partition */
+    ptExtent = (FILE_EXTENT*)realloc(ptFile->ptExtents, ulMax * sizeof(FILE_EXTENT));
+    if( ptExtent==NULL )
+    {
+      return 0;
+    }
+    ptFile->ptExtents = ptExtent;
+    ptFile->ulExtentsMax = ulMax;
+  }
+
+  ptExtent = ptFile->ptExtents + ptFile->ulExtents;
+  ptExtent->ulFileCluster = ulFileCluster;
+  ptExtent->ulCluster     = ulCluster;
+  ptExtent->ulClusters    = 1;
+  ++ptFile->ulExtents;
+
+  return 1;
+}
+
+/*
+  Returns the cluster with the index ulClusterIndex in the file, or
+  CLUSTER_FREE if the chain is shorter.
+  The runs of adjacent clusters are recorded in ptFile->ptExtents while the
+  chain is followed, so every link is followed only once. A cluster in the
+  recorded part of the chain is found by a binary search over the runs.
+  Without memory for the runs, the rest of the chain is followed link by link.
+*/
+static unsigned long file_get_cluster(FILE_STRUCT *ptFile, unsigned long ulClusterIndex)
+{
+  PARTITION*         ptPartition = ptFile->ptPartition;
+  const FILE_EXTENT* ptExtent;
+  unsigned long      ulIndexed;
+  unsigned long      ulCluster;
+  unsigned long      ulLow;
+  unsigned long      ulHigh;
+  unsigned long      ulMid;
+  int                fRecord;
+
+
+  if( ptFile->ulExtents==0 )
+  {
+    ulCluster = ptFile->ulStartCluster;
+    if( ulCluster<CLUSTER_FIRST || ulCluster>ptPartition->fat.lastCluster )
+    {
+      return CLUSTER_FREE;
+    }
+    fRecord = file_extents_add(ptFile, ulCluster);
+    ulIndexed = 1;
+  }
+  else
+  {
+    ptExtent = ptFile->ptExtents + ptFile->ulExtents - 1;
+    ulCluster = ptExtent->ulCluster + ptExtent->ulClusters - 1;
+    ulIndexed = ptExtent->ulFileCluster + ptExtent->ulClusters;
+    fRecord = 1;
+  }
+
+  if( ulClusterIndex>=ulIndexed || fRecord==0 )
+  {
+    /* follow the chain behind the recorded part */
+    while( ulIndexed<=ulClusterIndex )
+    {
+      ulCluster = _FAT_fat_nextCluster(ptPartition, ulCluster);
+      if( ulCluster<CLUSTER_FIRST || ulCluster>ptPartition->fat.lastCluster )
+      {
+        return CLUSTER_FREE;
+      }
+      if( fRecord!=0 )
+      {
+        fRecord = file_extents_add(ptFile, ulCluster);
+      }
+      ++ulIndexed;
+    }
+    return ulCluster;
+  }
+
+  /* find the last run starting at or before the cluster */
+  ulLow = 0;
+  ulHigh = ptFile->ulExtents - 1;
+  while( ulLow<ulHigh )
+  {
+    ulMid = ulLow + (ulHigh - ulLow + 1) / 2;
+    if( ptFile->ptExtents[ulMid].ulFileCluster<=ulClusterIndex )
+    {
+      ulLow = ulMid;
+    }
+    else
+    {
+      ulHigh = ulMid - 1;
+    }
+  }
+  ptExtent = ptFile->ptExtents + ulLow;
+
+  return ptExtent->ulCluster + (ulClusterIndex - ptExtent->ulFileCluster);
+}
+
+/*
+  Drops the runs behind the first ulClusters clusters,
+  after the chain was cut or replaced.
+*/
+static void file_extents_trim(FILE_STRUCT *ptFile, unsigned long ulClusters)
+{
+  FILE_EXTENT* ptExtent;
+
+
+  while( ptFile->ulExtents>0 )
+  {
+    ptExtent = ptFile->ptExtents + ptFile->ulExtents - 1;
+    if( ptExtent->ulFileCluster<ulClusters )
+    {
+      if( ptExtent->ulClusters>ulClusters - ptExtent->ulFileCluster )
+      {
+        ptExtent->ulClusters = ulClusters - ptExtent->ulFileCluster;
+      }
+      break;
+    }
+    --ptFile->ulExtents;
+  }
+}
+
+/*
+  Frees the runs recorded by FileSeek. FileClose does this too.
+*/
+void FileFreeExtents(FILE_STRUCT *ptFile)
+{
+  free(ptFile->ptExtents);
+  ptFile->ptExtents    = NULL;
+  ptFile->ulExtents    = 0;
+  ptFile->ulExtentsMax = 0;
+}
+
+/*
+  Moves the position to ulPosition, which must not be behind the end of the file.
+  Like FileWrite, a position on a cluster boundary stays at the end of the
+  previous cluster, so the end of the file never needs a cluster that does
+  not exist yet. The cluster is looked up in the runs of the file, see
+  file_get_cluster.
+  Returns 1 if successful, 0 if the position is behind the end of the file or
+  the cluster chain is too short.
+*/
+int FileSeek(FILE_STRUCT *ptFile, unsigned long ulPosition)
+{
+  PARTITION*    ptPartition = ptFile->ptPartition;
+  unsigned long ulClusterIndex;
+  unsigned long ulOffset;
+  unsigned long ulCluster;
+
+
+  if( ulPosition>ptFile->ulFilesize )
+  {
+    return 0;
+  }
+
+  if( ulPosition==0 )
+  {
+    ptFile->ulCurrentPosition   = 0;
+    ptFile->tPosition.ulCluster = ptFile->ulStartCluster;
+    ptFile->tPosition.ulSector  = 0;
+    ptFile->tPosition.ulByte    = 0;
+    return 1;
+  }
+
+  /* the cluster holding the byte before the new position */
+  ulClusterIndex = (ulPosition - 1) / ptPartition->bytesPerCluster;
+  ulOffset = ulPosition - ulClusterIndex * ptPartition->bytesPerCluster;
+
+  ulCluster = file_get_cluster(ptFile, ulClusterIndex);
+  if( ulCluster==CLUSTER_FREE )
+  {
+    return 0;
+  }
+
+  ptFile->ulCurrentPosition   = ulPosition;
+  ptFile->tPosition.ulCluster = ulCluster;
+  ptFile->tPosition.ulSector  = ulOffset / ptPartition->bytesPerSector;
+  ptFile->tPosition.ulByte    = ulOffset % ptPartition->bytesPerSector;
+
+  return 1;
+}
+
+/*
+  Cuts the file to ulSize bytes, which must not be more than the file size.
+  The clusters behind the new end are freed, a file cut to 0 bytes has no
+  clusters. A position behind the new end moves to the end.
+  The directory entry is updated by FileClose.
+*/
+int FileTruncate(FILE_STRUCT *ptFile, unsigned long ulSize)
+{
+  PARTITION*    ptPartition = ptFile->ptPartition;
+  unsigned long ulClusters;
+
+
+  if( ulSize>ptFile->ulFilesize )
+  {
+    return 0;
+  }
+
+  /* move the position into the clusters which are kept, while the chain is still complete */
+  if( ptFile->ulCurrentPosition>=ulSize && !FileSeek(ptFile, ulSize) )
+  {
+    return 0;
+  }
+
+  if( ptFile->ulStartCluster!=CLUSTER_FREE )
+  {
+    ulClusters = ulSize / ptPartition->bytesPerCluster + (ulSize % ptPartition->bytesPerCluster != 0);
+    if( ulClusters==0 )
+    {
+      _FAT_fat_clearLinks(ptPartition, ptFile->ulStartCluster);
+      ptFile->ulStartCluster      = CLUSTER_FREE;
+      ptFile->tPosition.ulCluster = CLUSTER_FREE;
+    }
+    else if( _FAT_fat_trimChain(ptPartition, ptFile->ulStartCluster, ulClusters)==CLUSTER_FREE )
+    {
+      return 0;
+    }
+    file_extents_trim(ptFile, ulClusters);
+  }
+  ptFile->ulFilesize = ulSize;
+
+  return 1;
+}
+
+int FilePreallocate(FILE_STRUCT* ptFile, unsigned long ulSize)
+{
+  PARTITION*    ptPartition = ptFile->ptPartition;
+  unsigned long ulClusters;
+  unsigned long ulFirstCluster;
+
+  /* only possible for a new, empty file */
+  if( ptFile->ulFilesize!=0 || ptFile->ulCurrentPosition!=0 || ulSize>FILE_MAX_SIZE )
+  {
+    return 0;
+  }
+
+  /* round up without overflowing for sizes close to 4GB */
+  ulClusters = ulSize / ptPartition->bytesPerCluster + (ulSize % ptPartition->bytesPerCluster != 0);
+  if( ulClusters<=1 )
+  {
+    /* FileCreate already allocated one cluster */
+    return 1;
+  }
+
+  ulFirstCluster = _FAT_fat_allocateExtent(ptPartition, ulClusters);
+  if( ulFirstCluster==CLUSTER_FREE )
+  {
+    /* no free run is large enough */
+    return 0;
+  }
+
+  /* release the cluster allocated by FileCreate and use the extent instead */
+  if( ptFile->ulStartCluster!=CLUSTER_FREE )
+  {
+    _FAT_fat_clearLinks(ptPartition, ptFile->ulStartCluster);
+  }
+  ptFile->ulStartCluster      = ulFirstCluster;
+  ptFile->tPosition.ulCluster = ulFirstCluster;
+  ptFile->tPosition.ulSector  = 0;
+  ptFile->tPosition.ulByte    = 0;
+  file_extents_trim(ptFile, 0);
+
+  return 1;
+}
+
+/*
+  Makes sure the cluster chain of the file has room for ulSize bytes before it
+  is overwritten. An empty file gets its clusters like in FilePreallocate.
+  Otherwise the missing clusters are appended behind the last cluster in one
+  piece, the existing clusters stay where they are.
+  If there is no free run large enough, FileWrite allocates the clusters one
+  by one. The file size does not change.
+  Returns 1 if the chain is large enough now, 0 otherwise.
+*/
+int FileReserve(FILE_STRUCT *ptFile, unsigned long ulSize)
+{
+  PARTITION*         ptPartition = ptFile->ptPartition;
+  const FILE_EXTENT* ptExtent;
+  unsigned long      ulClusters;
+  unsigned long      ulChainClusters;
+  unsigned long      ulLastCluster;
+  unsigned long      ulFirstCluster;
+
+
+  if( ptFile->ulFilesize==0 && ptFile->ulCurrentPosition==0 )
+  {
+    return FilePreallocate(ptFile, ulSize);
+  }
+
+  /* round up without overflowing for sizes close to 4GB */
+  ulClusters = ulSize / ptPartition->bytesPerCluster + (ulSize % ptPartition->bytesPerCluster != 0);
+  if( ulClusters==0 || file_get_cluster(ptFile, ulClusters - 1)!=CLUSTER_FREE )
+  {
+    /* the chain is long enough */
+    return 1;
+  }
+
+  /* the lookup recorded the whole chain, it must end properly */
+  ulChainClusters = 0;
+  ulLastCluster = CLUSTER_FREE;
+  if( ptFile->ulStartCluster!=CLUSTER_FREE )
+  {
+    if( ptFile->ulExtents==0 )
+    {
+      return 0;
+    }
+    ptExtent = ptFile->ptExtents + ptFile->ulExtents - 1;
+    ulChainClusters = ptExtent->ulFileCluster + ptExtent->ulClusters;
+    ulLastCluster = ptExtent->ulCluster + ptExtent->ulClusters - 1;
+    if( _FAT_fat_nextCluster(ptPartition, ulLastCluster)!=CLUSTER_EOF )
+    {
+      return 0;
+    }
+  }
+
+  ulFirstCluster = _FAT_fat_linkExtent(ptPartition, ulLastCluster, ulClusters - ulChainClusters);
+  if( ulFirstCluster==CLUSTER_FREE )
+  {
+    /* no free run is large enough */
+    return 0;
+  }
+  if( ptFile->ulStartCluster==CLUSTER_FREE )
+  {
+    ptFile->ulStartCluster      = ulFirstCluster;
+    ptFile->tPosition.ulCluster = ulFirstCluster;
+  }
+
+  return 1;
+}
+
 int FileDelete(PARTITION *ptPartition, const char *szFile)
 {
   int iResult;
@@ -463,22 +895,10 @@ int FileExists(PARTITION *ptPartition, const char *szFile)
 }
 
 
-unsigned long GetFreeDiskSpace(const PARTITION *ptPartition)
+unsigned long long GetFreeDiskSpace(const PARTITION *ptPartition)
 {
-  /* TODO: How to calculate free disk space */
-/*
-  u32 ulFatSector =  partition->fat.fatStart;
-
-  while(ulFatSector < partition->fat.sectorsPerFat)
-  {
-    // Read FAT sector
-    
-    
-    
-    ++ulFatSector;
-  } 
-*/
-  return 0xFFFFFFFF;  
+  /* the free clusters are counted in the FAT's free map */
+  return (unsigned long long)ptPartition->fat.freeCount * ptPartition->bytesPerCluster;
 }
 
 
@@ -514,6 +934,8 @@ int FileOpenForRead(PARTITION *ptPartition, const char *szFile, FILE_STRUCT *ptF
   ptFile->tDirEntryStart      = tDirEntry.dataStart;
   ptFile->tDirEntryEnd        = tDirEntry.dataEnd;
   ptFile->tPosition.ulCluster = ulFirstFileCluster;
+  ptFile->ulEntryCluster      = ulFirstFileCluster;
+  memcpy(ptFile->abEntryName, tDirEntry.entryData + DIR_ENTRY_name, FILE_ENTRY_NAME_SIZE);
 
   return 1;
 }
@@ -574,6 +996,11 @@ int FileRead(FILE_STRUCT *ptFile, void *pvData, unsigned long ulDataLen)
     unsigned long ulBlockSize;
     unsigned char *pbData;
     unsigned long ulSector;
+    unsigned long ulSectors;
+    unsigned long ulMaxSectors;
+    unsigned long ulRunCluster;
+    unsigned long ulRunSector;
+    unsigned long ulNextCluster;
     int iResult;
 
 
@@ -604,6 +1031,19 @@ int FileRead(FILE_STRUCT *ptFile, void *pvData, unsigned long ulDataLen)
 
     tPosition = ptFile->tPosition;
 
+    /* the position can be at the end of a cluster after FileWrite or FileSeek */
+    if( tPosition.ulSector>=ptPartition->sectorsPerCluster )
+    {
+        ulNextCluster = _FAT_fat_nextCluster(ptPartition, tPosition.ulCluster);
+        if( (ulNextCluster==CLUSTER_EOF) || (ulNextCluster==CLUSTER_FREE) )
+        {
+            /* the cluster chain ends before the file */
+            return -1;
+        }
+        tPosition.ulCluster = ulNextCluster;
+        tPosition.ulSector = 0;
+    }
+
     /* get the number of bytes to read in the first sector */
     ulChunk = ulBlockSize - tPosition.ulByte;
     /* limit read chunk to the requested size and the remaining sector length */
@@ -629,31 +1069,58 @@ int FileRead(FILE_STRUCT *ptFile, void *pvData, unsigned long ulDataLen)
         iResult = file_inc_position(ptPartition, &tPosition, ulChunk);
     }
 
-    /* read complete sectors */
+    /* read complete sectors, one request for each run of adjacent clusters */
     while( iResult!=0 && ulRemain>=ulBlockSize )
     {
-        /* read one complete sector */
-        ulSector = _FAT_fat_clusterToSector(ptPartition, tPosition.ulCluster) + tPosition.ulSector;
-        _FAT_disc_readSectors(ptPartition->disc, ulSector, 1, pbData);
-        /* one sector processed */
-        pbData += ulBlockSize;
-        ulRemain -= ulBlockSize;
-        /* increase position */
-        iResult = file_inc_position(ptPartition, &tPosition, ulBlockSize);
+        /* sectors up to the end of the current cluster */
+        ulMaxSectors = ulRemain / ulBlockSize;
+        ulSectors = ptPartition->sectorsPerCluster - tPosition.ulSector;
+        if( ulSectors>ulMaxSectors )
+        {
+            ulSectors = ulMaxSectors;
+        }
+        ulRunCluster = tPosition.ulCluster;
+        ulRunSector = tPosition.ulSector + ulSectors - 1;
+
+        /* extend the run while the next cluster follows directly on the disc */
+        while( ulSectors<ulMaxSectors )
+        {
+            ulNextCluster = _FAT_fat_nextCluster(ptPartition, ulRunCluster);
+            if( ulNextCluster!=ulRunCluster+1 )
+            {
+                break;
+            }
+            ulRunCluster = ulNextCluster;
+            ulChunk = ulMaxSectors - ulSectors;
+            if( ulChunk>ptPartition->sectorsPerCluster )
+            {
+                ulChunk = ptPartition->sectorsPerCluster;
+            }
+            ulSectors += ulChunk;
+            ulRunSector = ulChunk - 1;
+        }
 
-        /* file_inc_position will try to switch to next cluster if possible
-           and returns an error on EOF. */
-        if( (0 == iResult)  &&
-            (0 == ulRemain) )
+        ulSector = _FAT_fat_clusterToSector(ptPartition, tPosition.ulCluster) + tPosition.ulSector;
+        if( !_FAT_cache_readSectors(ptPartition->cache, ulSector, ulSectors, pbData) )
         {
-          unsigned long ulNewFilePosition = ptFile->ulCurrentPosition + ulDataLen;
-          
-          if(ulNewFilePosition == ptFile->ulFilesize)
-          {
-            /* We will override this error here, as we have already read the whole file */
-            iResult = 1;
-          }
+            iResult = 0;
+            break;
         }
+        pbData += ulSectors * ulBlockSize;
+        ulRemain -= ulSectors * ulBlockSize;
+
+        /* move to the last sector of the run and step over it */
+        tPosition.ulCluster = ulRunCluster;
+        tPosition.ulSector = ulRunSector;
+        iResult = file_inc_position(ptPartition, &tPosition, ulBlockSize);
+    }
+
+    /* file_inc_position returns an error if there is no cluster after the last
+       one read. This does not matter once all data is read, the position stays
+       at the end of the cluster. */
+    if( ulRemain==0 )
+    {
+        iResult = 1;
     }
 
     /* read partial sector? */
@@ -783,7 +1250,12 @@ int FileMakeDir(PARTITION* ptPartition, const char *path)
                                 DIR_ENTRY_DATA_SIZE,
                                 ptPartition->bytesPerSector);
 
-  // Flush any sectors in the disc cache
+  // Write the changed FAT entries and flush any sectors in the disc cache
+  if(!_FAT_fat_flush(ptPartition)) 
+  {
+    printf("_FAT_fat_flush failed \n");
+    return 0;
+  }
   if(!_FAT_cache_flush(ptPartition->cache)) 
   {
     printf("_FAT_cache_flush failed \n");
@@ -847,66 +1319,131 @@ int FileCalculateMD5(char* szFile, unsigned char *abMD5)
 }
 #endif
 
+/*
+  Passes the whole file to pfnSpan, one call for each run of adjacent clusters.
+  If the disc can be mapped, pfnSpan gets a pointer into the disc memory.
+  Otherwise the run is read into pvBuffer in pieces of ulBufferSize bytes,
+  which must be a multiple of the sector size.
+  Returns 1 if the whole file was passed, 0 if it could not be read or
+  pfnSpan returned 0.
+*/
+int FileReadSpans(FILE_STRUCT *ptFile, FN_FILE_SPAN pfnSpan, void *pvUser, void *pvBuffer, unsigned long ulBufferSize)
+{
+  PARTITION*    ptPartition = ptFile->ptPartition;
+  unsigned long ulBlockSize = ptPartition->bytesPerSector;
+  unsigned long ulRemain;
+  unsigned long ulCluster;
+  unsigned long ulNextCluster;
+  unsigned long ulRunSector;
+  unsigned long ulRunLen;
+  unsigned long ulOffset;
+  unsigned long ulChunk;
+  const void*   pvData;
+
+  ulRemain  = ptFile->ulFilesize;
+  ulCluster = ptFile->ulStartCluster;
+  while( ulRemain>0 )
+  {
+    /* the cluster chain must not end before the file */
+    if( ulCluster<CLUSTER_FIRST || ulCluster>ptPartition->fat.lastCluster )
+    {
+      return 0;
+    }
+
+    /* collect the run of adjacent clusters */
+    ulRunSector = _FAT_fat_clusterToSector(ptPartition, ulCluster);
+    ulRunLen = ptPartition->bytesPerCluster;
+    ulNextCluster = _FAT_fat_nextCluster(ptPartition, ulCluster);
+    while( ulRunLen<ulRemain && ulNextCluster==ulCluster+1 )
+    {
+      ulCluster = ulNextCluster;
+      ulRunLen += ptPartition->bytesPerCluster;
+      ulNextCluster = _FAT_fat_nextCluster(ptPartition, ulCluster);
+    }
+    if( ulRunLen>ulRemain )
+    {
+      ulRunLen = ulRemain;
+    }
+
+    pvData = _FAT_cache_mapSectors(ptPartition->cache, ulRunSector, (ulRunLen + ulBlockSize - 1) / ulBlockSize);
+    if( pvData!=NULL )
+    {
+      /* pass the data directly from the disc */
+      if( !pfnSpan(pvUser, pvData, ulRunLen) )
+      {
+        return 0;
+      }
+    }
+    else
+    {
+      /* read the run piece by piece */
+      for( ulOffset=0; ulOffset<ulRunLen; ulOffset+=ulChunk )
+      {
+        ulChunk = ulRunLen - ulOffset;
+        if( ulChunk>ulBufferSize )
+        {
+          ulChunk = ulBufferSize;
+        }
+        if( ulChunk==0 ||
+            !_FAT_cache_readSectors(ptPartition->cache, ulRunSector + ulOffset / ulBlockSize, (ulChunk + ulBlockSize - 1) / ulBlockSize, pvBuffer) ||
+            !pfnSpan(pvUser, pvBuffer, ulChunk) )
+        {
+          return 0;
+        }
+      }
+    }
+
+    ulRemain -= ulRunLen;
+    ulCluster = ulNextCluster;
+  }
+
+  return 1;
+}
+
+/*
+  Fills ptClusterChain with the runs of adjacent clusters of the file, each
+  with its byte offset in the disc and its size in DWORDs. The runs are
+  recorded in the file like for FileSeek.
+  Returns the number of entries, or 0 if the file has no clusters, the
+  chain is broken or the table has less than the needed entries.
+*/
 unsigned long FileReadClusterchain(FILE_STRUCT *ptFile, CLUSTER_CHAIN *ptClusterChain, unsigned long ulMaxTableEntries)
 {
     PARTITION *ptPartition;
-    CACHE *ptCache;
-    unsigned long ulBytesPerCluster;
-    unsigned long ulClusterCnt;
-    unsigned long ulStartCluster;
+    const FILE_EXTENT *ptExtent;
+    unsigned long ulLastCluster;
     unsigned long ulNextCluster;
-    unsigned long ulCurrentCluster;
-    unsigned long ulChunkSize;
-    unsigned long ulSectorSize;
+    unsigned long ulCnt;
 
 
-    /* get the partition and cache */
+    /* get the partition */
     ptPartition = ptFile->ptPartition;
-    ptCache = ptPartition->cache;
-
-    /* init cluster counter */
-    ulClusterCnt = 0;
-
-    ulSectorSize = ptPartition->bytesPerSector;
 
-    /* get the current cluster */
-    ulStartCluster = ptFile->ulStartCluster;
+    /* record the whole chain, no chain has more clusters than the FAT */
+    file_get_cluster(ptFile, ptPartition->fat.lastCluster);
+    if( ptFile->ulExtents==0 )
+    {
+        return 0;
+    }
 
-    ulBytesPerCluster = ptPartition->bytesPerCluster;
+    /* the chain must end properly behind the last run */
+    ptExtent = ptFile->ptExtents + ptFile->ulExtents - 1;
+    ulLastCluster = ptExtent->ulCluster + ptExtent->ulClusters - 1;
+    ulNextCluster = _FAT_fat_nextCluster(ptPartition, ulLastCluster);
+    if( ulNextCluster!=CLUSTER_EOF || ptFile->ulExtents>ulMaxTableEntries )
+    {
+        /* broken chain, no memory for the runs or too many runs */
+        return 0;
+    }
 
-    /* get the sector list */
-    do
+    for( ulCnt=0; ulCnt<ptFile->ulExtents; ++ulCnt )
     {
-        /* try to group the clusters */
-        ulNextCluster = ulStartCluster;
-        ulChunkSize = 0;
-        do
-        {
-            /* increase the chunk size */
-            ulChunkSize += ulBytesPerCluster;
-            /* move to the new cluster */
-            ulCurrentCluster = ulNextCluster;
-            /* get the next cluster */
-            ulNextCluster = _FAT_fat_nextCluster(ptPartition, ulCurrentCluster);
-        } while( ulNextCluster==ulCurrentCluster+1 );
-
-        /* write the new element */
-        ptClusterChain->ulSector = _FAT_fat_clusterToSector(ptPartition, ulStartCluster) * ulSectorSize + ptPartition->disc->ulStartOffset;
-        ptClusterChain->ulSize = ulChunkSize/sizeof(uint32_t);
+        ptExtent = ptFile->ptExtents + ulCnt;
+        ptClusterChain->ullOffset = (unsigned long long)_FAT_fat_clusterToSector(ptPartition, ptExtent->ulCluster) * ptPartition->bytesPerSector + ptPartition->disc->ullStartOffset;
+        ptClusterChain->ulSize = ptExtent->ulClusters * ptPartition->bytesPerCluster / sizeof(uint32_t);
         ++ptClusterChain;
-        ++ulClusterCnt;
-        if( ulClusterCnt>ulMaxTableEntries )
-        {
-            /* error, too many clusters */
-            ulClusterCnt = 0;
-            break;
-        }
-
-        /* move to the new cluster */
-        ulStartCluster = ulNextCluster;
-    } while( ulStartCluster!=CLUSTER_EOF );
+    }
 
     /* return the number of entries in the table */
-    return ulClusterCnt;
+    return ptFile->ulExtents;
 }
-
@@ -13,6 +13,20 @@ typedef struct FILE_POSITIONtag
   
 } FILE_POSITION;
 
+/* the directory entry stores the file size in 32 bits */
+#define FILE_MAX_SIZE 0xFFFFFFFFUL
+
+/* name and extension of the alias entry */
+#define FILE_ENTRY_NAME_SIZE 11
+
+/* a run of adjacent clusters in the cluster chain of a file */
+typedef struct
+{
+  unsigned long ulFileCluster;   // index of the first cluster of the run in the file
+  unsigned long ulCluster;       // first cluster of the run
+  unsigned long ulClusters;      // number of clusters in the run
+} FILE_EXTENT;
+
 typedef struct {
   PARTITION*         ptPartition;
   unsigned long      ulFilesize;
@@ -21,20 +35,34 @@ typedef struct {
   FILE_POSITION      tPosition;
   DIR_ENTRY_POSITION tDirEntryStart;   // Points to the start of the LFN entries of a file, or the alias for no LFN
   DIR_ENTRY_POSITION tDirEntryEnd;     // Always points to the file's alias entry
+  unsigned long      ulEntryCluster;   // start cluster and name in the alias entry at open time,
+  u8                 abEntryName[FILE_ENTRY_NAME_SIZE];  // FileClose only updates an entry which still matches
+  FILE_EXTENT*       ptExtents;        // runs of the start of the chain, built by FileSeek, freed by FileClose
+  unsigned long      ulExtents;
+  unsigned long      ulExtentsMax;
 } FILE_STRUCT;
 
 typedef struct {
-  unsigned long ulSector;
+  unsigned long long ullOffset;   // byte offset in the disc, including ullStartOffset
   unsigned long ulSize;
 } CLUSTER_CHAIN;
 
 int FileCreate(PARTITION *ptPartition, const char *szFile, FILE_STRUCT *ptFile);
 int FileExists(PARTITION *ptPartition, const char *szFile);
 int FileClose(FILE_STRUCT* ptFile);
-int FileWrite(FILE_STRUCT* ptFile, const void* pvData, unsigned long ulDataLen);
+unsigned long FileWrite(FILE_STRUCT* ptFile, const void* pvData, unsigned long ulDataLen);
+int FilePreallocate(FILE_STRUCT* ptFile, unsigned long ulSize);
+int FileReserve(FILE_STRUCT* ptFile, unsigned long ulSize);
 int FileDelete(PARTITION *ptPartition, const char *szFile);
 int FileOpenForRead(PARTITION *ptPartition, const char *szFile, FILE_STRUCT *ptFile);
 int FileRead(FILE_STRUCT* ptFile, void* pvData, unsigned long ulDataLen);
+int FileSeek(FILE_STRUCT *ptFile, unsigned long ulPosition);
+int FileTruncate(FILE_STRUCT *ptFile, unsigned long ulSize);
+void FileFreeExtents(FILE_STRUCT *ptFile);
+
+/* receives one piece of a file, returns 0 to stop reading */
+typedef int (*FN_FILE_SPAN)(void *pvUser, const void *pvData, unsigned long ulDataLen);
+int FileReadSpans(FILE_STRUCT *ptFile, FN_FILE_SPAN pfnSpan, void *pvUser, void *pvBuffer, unsigned long ulBufferSize);
 int FileMakeDir(PARTITION* ptPartition, const char *path); 
 //int FileCalculateMD5(char* szFile, unsigned char *abMD5);
 unsigned long FileReadClusterchain(FILE_STRUCT *ptFile, CLUSTER_CHAIN *ptClusterChain, unsigned long ulMaxTableEntries);
@@ -42,6 +70,6 @@ unsigned long FileReadClusterchain(FILE_STRUCT *ptFile, CLUSTER_CHAIN *ptCluster
 int file_delete_direntry(PARTITION *ptPartition, DIR_ENTRY *ptDirEntry);
 const char *getFilenameExtension(const DIR_ENTRY *ptDirEntry);
 
-unsigned long GetFreeDiskSpace(const PARTITION *ptPartition);
+unsigned long long GetFreeDiskSpace(const PARTITION *ptPartition);
 
 #endif /*FILE_FUNCTIONS_H_*/
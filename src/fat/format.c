@@ -41,9 +41,25 @@
 #include "compiler.h"
 #include "fat/format.h"
 #include "fat/partition.h"
+#include "fat/bit_ops.h"
+#include "fat/file_allocation_table.h"
+#include "fat/stats.h"
 //#include "serflash/Drv_SpiFlash.h"
+#include <stdlib.h> /* calloc/free */
 #include <string.h> /* memcpy/memset */
 
+/* number of fat copies, flash images keep a single fat */
+#ifndef FORMAT_NUMBER_OF_FATS
+#define FORMAT_NUMBER_OF_FATS 1
+#endif
+
+/* the fat and the root directory are written in chunks of this size */
+#define FORMAT_WRITE_BYTES 0x100000
+
+/* sector of the fat32 fsinfo and of the boot sector backup */
+#define FORMAT_FAT32_FSINFO_SECTOR 1
+#define FORMAT_FAT32_BACKUP_SECTOR 6
+
 
 static const unsigned char abBootSector0[11] =
   {
@@ -62,22 +78,74 @@ typedef union
 } FAT_BOOTSECTOR_U;
 
 /*****************************************************************************/
-/*! Initialize the FAT for the partition
- *   \param ptPartition Partition to initialize 
+/*! Write a region of sectors. The region starts with the header, all other
+ *  bytes are zero. If the disc can fill sectors, everything behind the first
+ *  sector is cleared with one call. Otherwise each run of up to
+ *  ulBufferSectors sectors is written with one call.
+ *   \param ptIo            I/O Interface to use
+ *   \param ulSector        first sector of the region
+ *   \param ulCount         number of sectors in the region
+ *   \param pbHeader        data at the start of the region
+ *   \param ulHeaderLen     length of the header, at most one sector
+ *   \param pbBuffer        zeroed buffer, it is zeroed again on return
+ *   \param ulBufferSectors size of pbBuffer in sectors
  *   \return !=0 on success                                                  */
 /*****************************************************************************/
-static int initFat(PARTITION *ptPartition, FAT_BOOTSECTOR_U* puBootSec)
+static int writeRegion(const IO_INTERFACE *ptIo, unsigned long ulSector, unsigned long ulCount,
+                       const uint8_t *pbHeader, unsigned long ulHeaderLen,
+                       uint8_t *pbBuffer, unsigned long ulBufferSectors)
+{
+  int iResult;
+  unsigned long ulRun;
+
+  /* assume success */
+  iResult = (1 == 1);
+
+  memcpy(pbBuffer, pbHeader, ulHeaderLen);
+  if ( ptIo->fn_fillSectors!=NULL && ulCount > 1 )
+  {
+    iResult = _FAT_disc_writeSectors(ptIo, ulSector, 1, pbBuffer);
+    memset(pbBuffer, 0, ulHeaderLen);
+    return iResult && ptIo->fn_fillSectors(ptIo, ulSector + 1, ulCount - 1, 0);
+  }
+  while ( iResult && ulCount > 0 )
+  {
+    ulRun = (ulCount < ulBufferSectors) ? ulCount : ulBufferSectors;
+    iResult = _FAT_disc_writeSectors(ptIo, ulSector, ulRun, pbBuffer);
+    /* the header is only written once */
+    memset(pbBuffer, 0, ulHeaderLen);
+    ulSector += ulRun;
+    ulCount -= ulRun;
+  }
+
+  return iResult;
+}
+
+/*****************************************************************************/
+/*! Initialize all copies of the FAT for the partition
+ *   \param ptPartition     Partition to initialize 
+ *   \param ulNumFats       Number of FAT copies
+ *   \param pbBuffer        zeroed buffer
+ *   \param ulBufferSectors size of pbBuffer in sectors
+ *   \return !=0 on success                                                  */
+/*****************************************************************************/
+static int initFat(PARTITION *ptPartition, unsigned long ulNumFats, uint8_t *pbBuffer, unsigned long ulBufferSectors)
 {
   int iResult;
   const IO_INTERFACE *ptIo;
   FS_TYPE tFatType;
   unsigned long ulFatStartSector;
   unsigned long ulFatSizeInSectors;
-  unsigned long ulBytesPerSector;
+  unsigned long ulHeaderLen;
+  unsigned long ulFat;
+  union
+  {
+    uint8_t  ab[12];
+    uint32_t ul[3];
+  } uHeader;
 
   ptIo = ptPartition->disc;
   tFatType = ptPartition->filesysType;
-  ulBytesPerSector = ptPartition->bytesPerSector;
   ulFatSizeInSectors = ptPartition->fat.sectorsPerFat;
   ulFatStartSector = ptPartition->fat.fatStart;
 
@@ -88,51 +156,39 @@ static int initFat(PARTITION *ptPartition, FAT_BOOTSECTOR_U* puBootSec)
     return (1 == 0);
   }
 
-  /* assume success */
-  iResult = (1 == 1);
-
-  /* init the fat */
-  memset(puBootSec->ab, 0, ulBytesPerSector);
-
   /* the first fat entry must contain the media type in the lower 8 bits,
    * the second entry must be EOC */
+  memset(uHeader.ab, 0, sizeof(uHeader));
   switch (tFatType)
   {
     case FS_FAT12:
-      puBootSec->ul[0] = 0x0ff8 | (0x0fff << 12);
+      uHeader.ul[0] = 0x0ff8 | (0x0fff << 12);
+      ulHeaderLen = 3;
       break;
 
     case FS_FAT16:
-      puBootSec->ul[0] = 0xfff8 | (0xffff << 16);
+      uHeader.ul[0] = 0xfff8 | (0xffff << 16);
+      ulHeaderLen = 4;
       break;
 
     case FS_FAT32:
-      puBootSec->ul[0] = 0x0ffffff8;
-      puBootSec->ul[1] = 0x0fffffff;
+      uHeader.ul[0] = 0x0ffffff8;
+      uHeader.ul[1] = 0x0fffffff;
+      /* the root directory is a single cluster chain */
+      uHeader.ul[2] = 0x0fffffff;
+      ulHeaderLen = 12;
       break;
 
     default:
-      iResult = (1 == 0);
+      return (1 == 0);
   }
 
-  if ( iResult )
+  /* write every copy of the fat */
+  iResult = (1 == 1);
+  for (ulFat = 0; iResult && ulFat < ulNumFats; ++ulFat)
   {
-    iResult = ptIo->fn_writeSectors(ptIo, ulFatStartSector, 1, puBootSec->ab);
-    if ( iResult )
-    {
-      /* clear the fat buffer */
-      memset(puBootSec->ab, 0, ulBytesPerSector);
-
-      /* loop over all other fat sectors and clear them */
-      while ( --ulFatSizeInSectors )
-      {
-        iResult = ptIo->fn_writeSectors(ptIo, ++ulFatStartSector, 1, puBootSec->ab);
-        if ( !iResult )
-        {
-          break;
-        }
-      };
-    }
+    iResult = writeRegion(ptIo, ulFatStartSector + ulFat * ulFatSizeInSectors, ulFatSizeInSectors,
+                          uHeader.ab, ulHeaderLen, pbBuffer, ulBufferSectors);
   }
 
   return iResult;
@@ -140,60 +196,108 @@ static int initFat(PARTITION *ptPartition, FAT_BOOTSECTOR_U* puBootSec)
 
 /*****************************************************************************/
 /*! Initialize root directory for partition
- *   \param ptPartition        Partition to initialize 
- *   \param ulTotalDirEntries  Maximum number of directory entries
+ *   \param ptPartition     Partition to initialize 
+ *   \param ulDirSectors    Number of sectors of the root directory
+ *   \param pbBuffer        zeroed buffer
+ *   \param ulBufferSectors size of pbBuffer in sectors
  *   \return !=0 on success                                                  */ 
 /*****************************************************************************/
-static int initRootDir(PARTITION* ptPartition, FAT_BOOTSECTOR_U* puBootSec, unsigned long ulTotalDirEntries)
+static int initRootDir(PARTITION* ptPartition, unsigned long ulDirSectors, uint8_t *pbBuffer, unsigned long ulBufferSectors)
 {
-  int iResult;
-  const IO_INTERFACE *ptIo;
-  FS_TYPE tFatType;
   unsigned long ulDirStartSector;
-  unsigned long ulDirEntriesPerSector;
-  unsigned long ulDirEntryCnt;
-  unsigned long ulBytesPerSector;
-
+  fat_direntry_t tLabel;
 
-  ptIo = ptPartition->disc;
-  tFatType = ptPartition->filesysType;
   ulDirStartSector = ptPartition->rootDirCluster * ptPartition->sectorsPerCluster + ptPartition->rootDirStart;
-  ulBytesPerSector = ptPartition->bytesPerSector;
-  ulDirEntriesPerSector = ulBytesPerSector / sizeof(fat_direntry_t);
-
-  /* init the dir sector */
-  memset(puBootSec->ab, 0, ulBytesPerSector);
 
   /* construct root dir entry */
-  memcpy(puBootSec->atDir[0].name, "TESTIMAGE01", 11);
+  memset(&tLabel, 0, sizeof(tLabel));
+  memcpy(tLabel.name, "TESTIMAGE01", 11);
 
   /* set attributes */
-  puBootSec->atDir[0].attr = FatDirAttr_VolumeID;
+  tLabel.attr = FatDirAttr_VolumeID;
 
-  /* write first root dir block */
-  iResult = ptIo->fn_writeSectors(ptIo, ulDirStartSector, 1, puBootSec->ab);
-  if ( iResult )
+  /* the root directory has at least one sector */
+  if ( ulDirSectors == 0 )
   {
-    /* clear the dir buffer */
-    memset(puBootSec->ab, 0, ulBytesPerSector);
-    /* processed one complete dir sector */
-    ulDirEntryCnt = ulDirEntriesPerSector;
+    ulDirSectors = 1;
+  }
 
-    /* some other dir sectors left? */
-    while ( ulDirEntryCnt < ulTotalDirEntries )
-    {
-      iResult = ptIo->fn_writeSectors(ptIo, ++ulDirStartSector, 1, puBootSec->ab);
-      if ( !iResult )
-      {
-        break;
-      }
-      ulDirEntryCnt += ulDirEntriesPerSector;
-    };
+  return writeRegion(ptPartition->disc, ulDirStartSector, ulDirSectors,
+                     (const uint8_t*) &tLabel, sizeof(tLabel), pbBuffer, ulBufferSectors);
+}
+
+/*****************************************************************************/
+/*! Write the FAT32 FSInfo sector and its backup.
+ *  The free cluster count and the next free cluster are left unknown,
+ *  so they never have to be updated.
+ *   \param ptIo            I/O Interface to use
+ *   \param ulSector        sector of the FSInfo
+ *   \param ulBackupSector  sector of the backup copy
+ *   \param pbBuffer        zeroed buffer of at least one sector
+ *   \return !=0 on success                                                  */
+/*****************************************************************************/
+static int writeFsInfo(const IO_INTERFACE *ptIo, unsigned long ulSector, unsigned long ulBackupSector, uint8_t *pbBuffer)
+{
+  int iResult;
+
+  u32_to_u8array(pbBuffer, FSINFO_LEADSIG, 0x41615252);
+  u32_to_u8array(pbBuffer, FSINFO_STRUCSIG, 0x61417272);
+  u32_to_u8array(pbBuffer, FSINFO_FREECOUNT, 0xffffffff);
+  u32_to_u8array(pbBuffer, FSINFO_NXTFREE, 0xffffffff);
+  u32_to_u8array(pbBuffer, FSINFO_TRAILSIG, 0xaa550000);
+
+  iResult = _FAT_disc_writeSectors(ptIo, ulSector, 1, pbBuffer);
+  if ( iResult )
+  {
+    iResult = _FAT_disc_writeSectors(ptIo, ulBackupSector, 1, pbBuffer);
   }
 
+  memset(pbBuffer, 0, FSINFO_TRAILSIG + 4);
   return iResult;
 }
 
+/*****************************************************************************/
+/*! Get the size of one FAT. This is the smallest FAT which covers the
+ *  remaining sectors, assuming one cluster per sector.
+ *   \param ulFatControlledSectors sectors for the FATs and the data
+ *   \param uiFatElementSize       bits per FAT entry
+ *   \param uiBytesPerSec          bytes per sector
+ *   \param ulNumFats              number of FAT copies
+ *   \return number of sectors of one FAT                                    */
+/*****************************************************************************/
+static unsigned long getFatSizeSectors(unsigned long ulFatControlledSectors, unsigned int uiFatElementSize,
+                                       unsigned int uiBytesPerSec, unsigned long ulNumFats)
+{
+  unsigned long long ullBitsPerSector;
+  unsigned long long ullSectors;
+
+  ullBitsPerSector = 8ULL * uiBytesPerSec;
+
+  /* each data sector needs uiFatElementSize bits in every FAT, start near the solution */
+  ullSectors = (unsigned long long) ulFatControlledSectors * ullBitsPerSector /
+               (ullBitsPerSector + (unsigned long long) ulNumFats * uiFatElementSize);
+  if ( ullSectors < 1 )
+  {
+    ullSectors = 1;
+  }
+
+  /* find the first number of data sectors which fills the partition together with its FATs */
+#define FAT_SIZE_SECTORS(ullDataSectors) (((ullDataSectors) * uiFatElementSize + ullBitsPerSector - 1) / ullBitsPerSector)
+#define FAT_FILLS_PARTITION(ullDataSectors) (ulNumFats * FAT_SIZE_SECTORS(ullDataSectors) + (ullDataSectors) >= ulFatControlledSectors)
+  while ( ullSectors > 1 && FAT_FILLS_PARTITION(ullSectors - 1) )
+  {
+    --ullSectors;
+  }
+  while ( !FAT_FILLS_PARTITION(ullSectors) )
+  {
+    ++ullSectors;
+  }
+
+  return (unsigned long) FAT_SIZE_SECTORS(ullSectors);
+#undef FAT_FILLS_PARTITION
+#undef FAT_SIZE_SECTORS
+}
+
 /*****************************************************************************/
 /*! Calculates the sector size which should be used for the device.
  *  NOTE: Automatically inserts the value into the ptIo structure
@@ -277,9 +381,9 @@ int formatFat(IO_INTERFACE *ptIo)
 {
   unsigned int uiBytesPerSec;
   FS_TYPE tFatType;
-  unsigned long ulPartitionSize;
+  unsigned long long ullPartitionSize;
   unsigned long ulPartitionSectors;
-  unsigned long ulNormedPartitionSize;
+  unsigned long long ullNormedPartitionSize;
   unsigned long ulFatControlledSectors;
   unsigned long ulReservedSectors;
   unsigned long ulRootDirEntries;
@@ -291,9 +395,11 @@ int formatFat(IO_INTERFACE *ptIo)
   unsigned long ulMinFatClusters;
   unsigned long ulFatSizeSectors;
   unsigned long ulClusterCnt;
-  unsigned long ulSectorCnt;
-  unsigned long ulFatBitCount;
+  unsigned long ulFatsSectors;
+  unsigned long ulDirSectors;
+  unsigned long ulBufferSectors;
   unsigned int uiFatElementSize;
+  uint8_t *pbBuffer;
   fat16_bootsec_t fatId;
   int iResult;
   unsigned long ulFirstRootDirSector;
@@ -312,22 +418,27 @@ int formatFat(IO_INTERFACE *ptIo)
   }
 
   /* get the total size of the partition in bytes */
-  ulPartitionSize = ptIo->ulDiskSize;
-  /* get the number of sectors of the partition */
-  ulPartitionSectors = ulPartitionSize / uiBytesPerSec;
+  ullPartitionSize = ptIo->ullDiskSize;
+  /* get the number of sectors of the partition, the boot sector has 32 bits for it */
+  if ( ullPartitionSize / uiBytesPerSec > 0xFFFFFFFFUL )
+  {
+    /* error, too many sectors */
+    return (1 == 0);
+  }
+  ulPartitionSectors = (unsigned long)(ullPartitionSize / uiBytesPerSec);
 
   /* MS FAT specification describes which FAT Type should be used for 
      different partition sizes, but this is normed to 512 bytes.
      So we use normalized Partitionsize by dividing it by (BytesPerSec / 512) */
-  ulNormedPartitionSize = ulPartitionSize / (uiBytesPerSec / 512);
+  ullNormedPartitionSize = ullPartitionSize / (uiBytesPerSec / 512);
   
   /* get the usual fat type for the size */
-  if ( ulNormedPartitionSize <= 4300800 )
+  if ( ullNormedPartitionSize <= 4300800 )
   {
     /* up to 4.1MB is FAT12 */
     tFatType = FS_FAT12;
   }
-  else if ( ulNormedPartitionSize <= 34099200 )
+  else if ( ullNormedPartitionSize <= 34099200 )
   {
     /* up to 32.5MB is FAT16 */
     tFatType = FS_FAT16;
@@ -379,10 +490,26 @@ int formatFat(IO_INTERFACE *ptIo)
   /* get the number of sectors used for the root directory */
   ulRootDirSectors = (ulRootDirEntries * 32 + uiBytesPerSec - 1) / uiBytesPerSec;
 
+  /* the partition must hold the reserved sectors, the root directory and at least one fat sector per copy */
+  if ( ulPartitionSectors <= ulReservedSectors + ulRootDirSectors + FORMAT_NUMBER_OF_FATS )
+  {
+    /* the partition is too small */
+    return (1 == 0);
+  }
+
   /* get the number of fat controlled sectors and the fat itself */
   ulFatControlledSectors = ulPartitionSectors -      /* all sectors in this partition */
                            ulReservedSectors;      /* number of reserved sectors */
 
+  /* get the size of one fat, this does not depend on the cluster size */
+  ulFatSizeSectors = getFatSizeSectors(ulFatControlledSectors, uiFatElementSize, uiBytesPerSec, FORMAT_NUMBER_OF_FATS);
+  ulFatsSectors = FORMAT_NUMBER_OF_FATS * ulFatSizeSectors;
+  if ( ulFatsSectors + ulRootDirSectors >= ulFatControlledSectors )
+  {
+    /* no room for any cluster */
+    return (1 == 0);
+  }
+
   /* get the clustersize for the complete sectors */
   /* NOTE: this might be one sector too much, as the fat will not be counted in */
   ulClusterCnt = 1;
@@ -396,24 +523,10 @@ int formatFat(IO_INTERFACE *ptIo)
       /* the cluster grew too big, this volume can not be formatted */
       return (1 == 0);
     }
-    /* get number of fat sectors */
-    ulSectorCnt = 0;
-    ulFatBitCount = 0;
-    do
-    {
-        /* process one more sector */
-        ++ulSectorCnt;
-        /* this sector takes up one more fat element */
-        ulFatBitCount += uiFatElementSize;
-        /* round up the number of fat bits to the sector boundary */
-        ulFatSizeSectors  = ulFatBitCount + 8 * uiBytesPerSec - 1;
-        ulFatSizeSectors /= 8 * uiBytesPerSec;
-    } while( (ulFatSizeSectors+ulSectorCnt)<ulFatControlledSectors );
-
     /* get number of clusters for this clustersize */
     ulNumberOfClusters  = ulFatControlledSectors;
     /* substract the fat sectors */
-    ulNumberOfClusters -= ulFatSizeSectors;
+    ulNumberOfClusters -= ulFatsSectors;
     /* substract directory from fat controlled sectors for fat12 and fat16 */
     if( tFatType!=FS_FAT32 )
     {
@@ -453,8 +566,8 @@ int formatFat(IO_INTERFACE *ptIo)
   uBootSec.tFat.BPB_SecPerClus = ulSectorsPerCluster;
   /* set number of reserved sectors */
   uBootSec.tFat.BPB_RsvdSecCnt = ulReservedSectors;
-  /* set number of fats to 1 */
-  uBootSec.tFat.BPB_NumFATs = 1;
+  /* set number of fats */
+  uBootSec.tFat.BPB_NumFATs = FORMAT_NUMBER_OF_FATS;
   /* set number of entries in the root directory */
   uBootSec.tFat.BPB_RootEntCnt = ulRootDirEntries;
   /* set media type to 'fixed' */
@@ -479,7 +592,7 @@ int formatFat(IO_INTERFACE *ptIo)
       memcpy(fatId.BS_FilSysType, "FAT16   ", 8);
       break;
     case FS_FAT32:
-      memcpy(fatId.BS_FilSysType, "FAT     ", 8);
+      memcpy(fatId.BS_FilSysType, "FAT32   ", 8);
       break;
     default:
       break;
@@ -490,9 +603,18 @@ int formatFat(IO_INTERFACE *ptIo)
   {
     case FS_FAT12:
     case FS_FAT16:
-      uBootSec.tFat.BPB_TotSec16 = ulPartitionSectors;
+      /* the 16 bit count is only used if the number fits */
+      if ( ulPartitionSectors < 0x10000 )
+      {
+        uBootSec.tFat.BPB_TotSec16 = ulPartitionSectors;
+        uBootSec.tFat.BPB_TotSec32 = 0;
+      }
+      else
+      {
+        uBootSec.tFat.BPB_TotSec16 = 0;
+        uBootSec.tFat.BPB_TotSec32 = ulPartitionSectors;
+      }
       uBootSec.tFat.BPB_FATSz16 = ulFatSizeSectors;
-      uBootSec.tFat.BPB_TotSec32 = 0;
       /* copy the id structure */
       memcpy(&uBootSec.tFat.BS_Spec1632.fat16, &fatId, sizeof(fat16_bootsec_t));
       break;
@@ -502,13 +624,13 @@ int formatFat(IO_INTERFACE *ptIo)
       uBootSec.tFat.BPB_FATSz16 = 0;
       uBootSec.tFat.BPB_TotSec32 = ulPartitionSectors;
       uBootSec.tFat.BS_Spec1632.fat32.BPB_FATSz32 = ulFatSizeSectors;
-      /* set only first fat active */
-      uBootSec.tFat.BS_Spec1632.fat32.BPB_ExtFlags = 0x80;
+      /* mirror all fats */
+      uBootSec.tFat.BS_Spec1632.fat32.BPB_ExtFlags = 0;
       uBootSec.tFat.BS_Spec1632.fat32.BPB_FSVer = 0;
-      /* set root directory cluster */
-      uBootSec.tFat.BS_Spec1632.fat32.BPB_RootClus =
-        uBootSec.tFat.BS_Spec1632.fat32.BPB_FSInfo = 1;
-      uBootSec.tFat.BS_Spec1632.fat32.BPB_BkBootSec = 6;
+      /* the root directory starts at the first cluster */
+      uBootSec.tFat.BS_Spec1632.fat32.BPB_RootClus = 2;
+      uBootSec.tFat.BS_Spec1632.fat32.BPB_FSInfo = FORMAT_FAT32_FSINFO_SECTOR;
+      uBootSec.tFat.BS_Spec1632.fat32.BPB_BkBootSec = FORMAT_FAT32_BACKUP_SECTOR;
       /* copy the id structure */
       memcpy(&uBootSec.tFat.BS_Spec1632.fat32.tFat16Part, &fatId, sizeof(fat16_bootsec_t));
       break;
@@ -521,11 +643,53 @@ int formatFat(IO_INTERFACE *ptIo)
   uBootSec.ab[510] = 0x55;
   uBootSec.ab[511] = 0xaa;
 
+  /* get the size of the root directory */
+  if ( tFatType==FS_FAT32 )
+  {
+    /* the fat32 root directory is one cluster */
+    ulDirSectors = ulSectorsPerCluster;
+  }
+  else
+  {
+    ulDirSectors = ulRootDirSectors;
+  }
+
+  /* get a zeroed buffer for the biggest region, but not more than FORMAT_WRITE_BYTES */
+  ulBufferSectors = (ulFatSizeSectors > ulDirSectors) ? ulFatSizeSectors : ulDirSectors;
+  if ( ptIo->fn_fillSectors!=NULL )
+  {
+    /* only the first sector of a region is written */
+    ulBufferSectors = 1;
+  }
+  else if ( ulBufferSectors > FORMAT_WRITE_BYTES / uiBytesPerSec )
+  {
+    ulBufferSectors = FORMAT_WRITE_BYTES / uiBytesPerSec;
+  }
+  if ( ulBufferSectors == 0 )
+  {
+    ulBufferSectors = 1;
+  }
+  pbBuffer = (uint8_t*) _FAT_mem_callocate(ptIo, ulBufferSectors, uiBytesPerSec);
+  if ( pbBuffer==NULL )
+  {
+    /* out of memory */
+    return (1 == 0);
+  }
+
   /* write data to the first sector in the image */
-  iResult = ptIo->fn_writeSectors(ptIo, 0, 1, uBootSec.ab);
+  iResult = _FAT_disc_writeSectors(ptIo, 0, 1, uBootSec.ab);
+  if ( iResult && tFatType==FS_FAT32 )
+  {
+    /* fat32 keeps a copy of the boot sector and the fsinfo */
+    iResult = _FAT_disc_writeSectors(ptIo, FORMAT_FAT32_BACKUP_SECTOR, 1, uBootSec.ab);
+    if ( iResult )
+    {
+      iResult = writeFsInfo(ptIo, FORMAT_FAT32_FSINFO_SECTOR, FORMAT_FAT32_BACKUP_SECTOR + FORMAT_FAT32_FSINFO_SECTOR, pbBuffer);
+    }
+  }
   if ( iResult )
   {
-    ulFirstRootDirSector = ulReservedSectors + ulFatSizeSectors;
+    ulFirstRootDirSector = ulReservedSectors + ulFatsSectors;
 
     /* abuse the partition structure to pass all the values */
     tPartition.disc = ptIo;
@@ -536,16 +700,19 @@ int formatFat(IO_INTERFACE *ptIo)
     tPartition.rootDirCluster = ulFirstRootDirSector / ulSectorsPerCluster;
     tPartition.rootDirStart = ulFirstRootDirSector % ulSectorsPerCluster;
     tPartition.sectorsPerCluster = ulSectorsPerCluster;
-    tPartition.totalSize = ulPartitionSize;
+    tPartition.totalSize = ullPartitionSize;
     tPartition.fat.fatStart = ulReservedSectors;
     tPartition.fat.sectorsPerFat = ulFatSizeSectors;
-    iResult = initFat(&tPartition, &uBootSec);
+    tPartition.fat.numberOfFats = FORMAT_NUMBER_OF_FATS;
+    iResult = initFat(&tPartition, FORMAT_NUMBER_OF_FATS, pbBuffer, ulBufferSectors);
     if ( iResult )
     {
-      iResult = initRootDir(&tPartition, &uBootSec, ulRootDirEntries);
+      iResult = initRootDir(&tPartition, ulDirSectors, pbBuffer, ulBufferSectors);
     }
   }
 
+  _FAT_mem_free(pbBuffer);
+
   return iResult;
 }
 
@@ -100,6 +100,13 @@ PACKED_PST fat_direntry_t;
 #define FatDirAttr_Archive    0x20
 #define FatDirAttr_LongName   0x0f
 
+/* byte offsets in the fat32 fsinfo sector */
+#define FSINFO_LEADSIG        0
+#define FSINFO_STRUCSIG       484
+#define FSINFO_FREECOUNT      488
+#define FSINFO_NXTFREE        492
+#define FSINFO_TRAILSIG       508
+
 /*-----------------------------------*/
 
 unsigned long CalculateSectorSize(IO_INTERFACE *ptIo);
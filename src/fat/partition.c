@@ -45,6 +45,7 @@
 #include "fat/bit_ops.h"
 #include "fat/file_allocation_table.h"
 #include "fat/directory.h"
+#include "fat/stats.h"
 #include "compiler.h"
 
 #include <string.h>
@@ -102,30 +103,21 @@ enum BPB {
 	BPB_bootSig_AA = 0x1FF
 };
 
-#define MAXIMUM_CACHE_ENTRIES       3
- 
-static PARTITION* _FAT_partition_constructor ( const IO_INTERFACE* disc) {
+/* cacheSize is the number of sectors kept in the cache, 0 accesses the disc directly */
+static PARTITION* _FAT_partition_constructor ( const IO_INTERFACE* disc, u32 cacheSize) {
 	u32 ulSectorSize = disc->ulBlockSize;
-	PARTITION* partition = (PARTITION*) malloc(sizeof(PARTITION));
-	CACHE* ptCache = (CACHE*) malloc(sizeof(CACHE));
-	//CACHE_ENTRY* patCacheEntries = (CACHE_ENTRY*) malloc(sizeof(CACHE_ENTRY) * MAXIMUM_CACHE_ENTRIES);
-	//u8* pabCachePages = (u8*) malloc(ulSectorSize * MAXIMUM_CACHE_ENTRIES);
-
-	if (partition == NULL || ptCache == NULL /* || patCacheEntries == NULL || pabCachePages == NULL*/) {
-		free(partition);
-		free(ptCache);
-		//free(patCacheEntries);
-		//free(pabCachePages);
+	PARTITION* partition = (PARTITION*) _FAT_mem_allocate(disc, sizeof(PARTITION));
+	CACHE* ptCache = (CACHE*) _FAT_mem_allocate(disc, sizeof(CACHE));
+
+	if (partition == NULL || ptCache == NULL || _FAT_cache_constructor(ptCache, disc, cacheSize, ulSectorSize) == NULL) {
+		_FAT_mem_free(partition);
+		_FAT_mem_free(ptCache);
 		return NULL;
 	}
 
-	//ptCache->cacheEntries = patCacheEntries;
-	//ptCache->numberOfPages = MAXIMUM_CACHE_ENTRIES;
-	//ptCache->pages = pabCachePages;
-	ptCache->pageSize = ulSectorSize;
-	ptCache->pvUser = NULL;
+	memset(partition, 0, sizeof(PARTITION));
 
-	partition->cache = _FAT_cache_constructor(ptCache, disc);
+	partition->cache = ptCache;
 	partition->disc = (IO_INTERFACE*) disc;
 	return partition;
 
@@ -135,10 +127,11 @@ static PARTITION* _FAT_partition_constructor ( const IO_INTERFACE* disc) {
 static void _FAT_partition_destructor (PARTITION* ptPartition) 
 {
 	if (ptPartition!=NULL) {
-		//free(ptPartition->cache->cacheEntries);
-		//free(ptPartition->cache->pages);
-		free(ptPartition->cache);
-		free(ptPartition);
+		_FAT_directory_freeIndex(ptPartition);
+		_FAT_fat_free(ptPartition);
+		_FAT_cache_destructor(ptPartition->cache);
+		_FAT_mem_free(ptPartition->cache);
+		_FAT_mem_free(ptPartition);
 	}
 }
 
@@ -249,14 +242,15 @@ static bool _FAT_partition_mount ( PARTITION* partition) {
 	partition->bytesPerCluster = partition->bytesPerSector * partition->sectorsPerCluster;
 	partition->fat.fatStart = bootSector + u8array_to_u16(sectorBuffer, BPB_reservedSectors); 
 
-	partition->rootDirStart = partition->fat.fatStart + (sectorBuffer[BPB_numFATs] * partition->fat.sectorsPerFat);
+	partition->fat.numberOfFats = sectorBuffer[BPB_numFATs];
+	partition->rootDirStart = partition->fat.fatStart + (partition->fat.numberOfFats * partition->fat.sectorsPerFat);
 	
 	ulRootDirSectorSize = u8array_to_u16(sectorBuffer, BPB_rootEntries) * DIR_ENTRY_DATA_SIZE;
 	ulRootDirSectorSize = (ulRootDirSectorSize + partition->bytesPerSector - 1) / partition->bytesPerSector;
 	
 	partition->dataStart = partition->rootDirStart + ulRootDirSectorSize;
 
-	partition->totalSize = (partition->numberOfSectors - partition->dataStart) * partition->bytesPerSector;
+	partition->totalSize = (u64) (partition->numberOfSectors - partition->dataStart) * partition->bytesPerSector;
 
 	// Store info about FAT
 	partition->fat.lastCluster = (partition->numberOfSectors - partition->dataStart) / partition->sectorsPerCluster;
@@ -275,10 +269,11 @@ static bool _FAT_partition_mount ( PARTITION* partition) {
 	} else {
 		// Set up for the FAT32 way
 		partition->rootDirCluster = u8array_to_u32(sectorBuffer, BPB_FAT32_rootClus); 
-		// Check if FAT mirroring is enabled
-		if (!(sectorBuffer[BPB_FAT32_extFlags] & 0x80)) {
-			// Use the active FAT
+		// Check if FAT mirroring is disabled
+		if (sectorBuffer[BPB_FAT32_extFlags] & 0x80) {
+			// Use only the active FAT
 			partition->fat.fatStart = partition->fat.fatStart + ( partition->fat.sectorsPerFat * (sectorBuffer[BPB_FAT32_extFlags] & 0x0F));
+			partition->fat.numberOfFats = 1;
 		}
 	}
 
@@ -290,6 +285,11 @@ static bool _FAT_partition_mount ( PARTITION* partition) {
 	
 	// There are currently no open files on this partition
 	partition->openFileCount = 0;
+
+	// Read the FAT into memory
+	if (!_FAT_fat_load(partition)) {
+		return false;
+	}
   
 	return true;
 }
@@ -298,7 +298,7 @@ static bool _FAT_partition_mount ( PARTITION* partition) {
 
 PARTITION* _FAT_partition_mountCustomInterface(const IO_INTERFACE* device, u32 cacheSize) {
 
-	PARTITION* ptPartition = _FAT_partition_constructor (device);
+	PARTITION* ptPartition = _FAT_partition_constructor (device, cacheSize);
 	
 	if (ptPartition != NULL) {
 		if (!_FAT_partition_mount(ptPartition)) {
@@ -322,6 +322,8 @@ bool _FAT_partition_unmount(PARTITION* ptPartition)
 		return false;
 	}
 
+	_FAT_fat_flush (ptPartition);
+	_FAT_cache_flush (ptPartition->cache);
 	_FAT_disc_shutdown (ptPartition->disc); 
 	_FAT_partition_destructor (ptPartition);
 	
@@ -48,8 +48,19 @@ typedef enum {FS_UNKNOWN, FS_FAT12, FS_FAT16, FS_FAT32} FS_TYPE;
 typedef struct {
 	u32 fatStart;
 	u32 sectorsPerFat;
+	u32 numberOfFats;		// Copies written on a flush, starting at fatStart
 	u32 lastCluster;
 	u32 firstFree;
+	// The FAT is kept in memory while the partition is mounted
+	u8* raw;				// FAT sectors as read from the disc
+	u32* table;				// Decoded entries, this is the authoritative copy
+	u32 numberOfEntries;
+	u32 entryMask;			// Valid bits of an entry
+	u32 eofMark;			// Entries >= eofMark end a chain
+	u32 dirtyFirst;			// Range of entries changed since the last flush,
+	u32 dirtyLast;			// dirtyFirst > dirtyLast if there are none
+	u32* freeMap;			// One bit per cluster, set if the cluster is free
+	u32 freeCount;
 } FAT;
 
 typedef struct {
@@ -58,7 +69,7 @@ typedef struct {
 	// Info about the partition
 	bool readOnly;		// If this is set, then do not try writing to the disc
 	FS_TYPE filesysType;
-	u32 totalSize;
+	u64 totalSize;		// bytes in the data area, may exceed 4GB
 	u32 rootDirStart;
 	u32 rootDirCluster;
 	u32 numberOfSectors;
@@ -71,10 +82,12 @@ typedef struct {
 	u32 cwdCluster;			// Current working directory cluser
 	u32 openFileCount;
   bool fMounted;
+	struct DIR_INDEX_STRUCT* dirIndex;	// Name lookup indexes of the directories, see directory.c
 } PARTITION;
 
 /*
 Mount a partition on a custom device
+cacheSize is the number of sectors to cache, 0 accesses the device directly
 */
 PARTITION* _FAT_partition_mountCustomInterface(const IO_INTERFACE* device, u32 cacheSize);
 
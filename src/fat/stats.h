@@ -0,0 +1,58 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdlib.h>
+
+#include "fat/common.h"
+#include "fat/disk_io.h"
+
+/*
+Counters of a partition, reached through the ptStats member of its
+IO_INTERFACE. They are only collected if the library is built with
+FAT_STATS_ENABLED, otherwise FAT_STATS_ADD compiles to nothing and the
+_FAT_mem functions are plain malloc, calloc, realloc and free.
+*/
+typedef struct FAT_STATS_STRUCT {
+	u64 readCalls;			// fn_readSectors calls and the bytes read
+	u64 readBytes;
+	u64 writeCalls;			// fn_writeSectors calls and the bytes written
+	u64 writeBytes;
+	u64 mapCalls;			// fn_mapSectors calls, memory images are accessed this way
+	u64 partialReads;		// _FAT_cache_readPartialSector
+	u64 partialWrites;		// _FAT_cache_writePartialSector and _FAT_cache_eraseWritePartialSector
+	u64 nextClusterLookups;	// _FAT_fat_nextCluster
+	u64 fatWrites;			// FAT entries changed
+	u64 freeClusterProbes;	// free map words scanned by _FAT_fat_linkFreeCluster
+	u64 dirEntriesScanned;	// entries read by _FAT_directory_getNextEntry
+	u64 heapCurrent;		// bytes allocated through _FAT_mem_allocate
+	u64 heapPeak;
+} FAT_STATS;
+
+#ifdef FAT_STATS_ENABLED
+
+#define FAT_STATS_ADD(ptIo, member, value) \
+	do { if ((ptIo)->ptStats != NULL) { (ptIo)->ptStats->member += (value); } } while (0)
+
+/*
+The allocations remember the counters they were taken from, so
+_FAT_mem_reallocate and _FAT_mem_free need no IO_INTERFACE.
+The counters must outlive the memory, and _FAT_mem_reallocate
+does not take NULL.
+*/
+void* _FAT_mem_allocate (const IO_INTERFACE* ptIo, size_t size);
+void* _FAT_mem_callocate (const IO_INTERFACE* ptIo, size_t count, size_t size);
+void* _FAT_mem_reallocate (void* buffer, size_t size);
+void _FAT_mem_free (void* buffer);
+
+#else
+
+#define FAT_STATS_ADD(ptIo, member, value) do { } while (0)
+
+#define _FAT_mem_allocate(ptIo, size) malloc(size)
+#define _FAT_mem_callocate(ptIo, count, size) calloc((count), (size))
+#define _FAT_mem_reallocate(buffer, size) realloc((buffer), (size))
+#define _FAT_mem_free(buffer) free(buffer)
+
+#endif
+
+#endif // _STATS_H
@@ -1,8 +1,10 @@
 
+#include <stdlib.h>
 #include <string.h>
 #include "fat/common.h"
 #include "fat/cache.h"
 #include "fat/file_allocation_table.h"
+#include "fat/stats.h"
 
 /*
 Read numSectors sectors from a disc, starting at sector. 
@@ -12,6 +14,8 @@ buffer is a pointer to the memory to fill
 */
 bool _FAT_disc_readSectors (const IO_INTERFACE *ptIo, u32 sector, u32 numSectors, void* buffer) 
 {
+	FAT_STATS_ADD(ptIo, readCalls, 1);
+	FAT_STATS_ADD(ptIo, readBytes, (u64) numSectors * ptIo->ulBlockSize);
 	return ptIo->fn_readSectors(ptIo, sector, numSectors, buffer);
 }
 
@@ -23,9 +27,142 @@ buffer is a pointer to the memory to read from
 */
 bool _FAT_disc_writeSectors (const IO_INTERFACE *ptIo, u32 sector, u32 numSectors, const void* buffer)
 {
+	FAT_STATS_ADD(ptIo, writeCalls, 1);
+	FAT_STATS_ADD(ptIo, writeBytes, (u64) numSectors * ptIo->ulBlockSize);
 	return ptIo->fn_writeSectors(ptIo, sector, numSectors, buffer);
 }
 
+/*
+Get a pointer to numSectors sectors in memory, starting at sector.
+Returns NULL if the disc can not be accessed directly, then
+_FAT_disc_readSectors and _FAT_disc_writeSectors must be used.
+*/
+void* _FAT_disc_mapSectors (const IO_INTERFACE *ptIo, u32 sector, u32 numSectors)
+{
+	if (ptIo->fn_mapSectors == NULL) {
+		return NULL;
+	}
+	FAT_STATS_ADD(ptIo, mapCalls, 1);
+	return ptIo->fn_mapSectors(ptIo, sector, numSectors);
+}
+
+/*
+Set all bytes of numSectors sectors to value, starting at sector.
+Discs without fn_fillSectors get the sectors written from a buffer.
+*/
+bool _FAT_disc_fillSectors (const IO_INTERFACE *ptIo, u32 sector, u32 numSectors, u8 value)
+{
+	u8 abBuffer[EXT_CACHE_PAGE_SIZE * 4];
+	u32 sectorsPerBuffer;
+	u32 run;
+
+	if (ptIo->fn_fillSectors != NULL) {
+		return ptIo->fn_fillSectors(ptIo, sector, numSectors, value);
+	}
+
+	sectorsPerBuffer = sizeof(abBuffer) / ptIo->ulBlockSize;
+	if (sectorsPerBuffer == 0) {
+		return false;
+	}
+	memset(abBuffer, value, sizeof(abBuffer));
+	while (numSectors > 0) {
+		run = numSectors < sectorsPerBuffer ? numSectors : sectorsPerBuffer;
+		if (!_FAT_disc_writeSectors(ptIo, sector, run, abBuffer)) {
+			return false;
+		}
+		sector += run;
+		numSectors -= run;
+	}
+	return true;
+}
+
+#ifdef FAT_STATS_ENABLED
+/*
+Each allocation starts with a header holding its size and counters.
+The header keeps the alignment of malloc for the data behind it.
+*/
+typedef union {
+	struct {
+		FAT_STATS* stats;
+		size_t size;
+	} info;
+	u64 align[2];
+} MEM_HEADER;
+
+static void* _FAT_mem_account (MEM_HEADER* header, FAT_STATS* stats, size_t size) {
+	header->info.stats = stats;
+	header->info.size = size;
+	if (stats != NULL) {
+		stats->heapCurrent += size;
+		if (stats->heapCurrent > stats->heapPeak) {
+			stats->heapPeak = stats->heapCurrent;
+		}
+	}
+	return header + 1;
+}
+
+static void _FAT_mem_release (MEM_HEADER* header) {
+	FAT_STATS* stats = header->info.stats;
+
+	if (stats != NULL) {
+		// The counters may have been reset after the allocation
+		stats->heapCurrent -= (stats->heapCurrent > header->info.size) ? header->info.size : stats->heapCurrent;
+	}
+}
+
+void* _FAT_mem_allocate (const IO_INTERFACE* ptIo, size_t size) {
+	MEM_HEADER* header;
+
+	if (size > (size_t) -1 - sizeof(MEM_HEADER)) {
+		return NULL;
+	}
+	header = (MEM_HEADER*) malloc(sizeof(MEM_HEADER) + size);
+	if (header == NULL) {
+		return NULL;
+	}
+	return _FAT_mem_account(header, ptIo->ptStats, size);
+}
+
+void* _FAT_mem_callocate (const IO_INTERFACE* ptIo, size_t count, size_t size) {
+	void* buffer;
+
+	if (size != 0 && count > ((size_t) -1 - sizeof(MEM_HEADER)) / size) {
+		return NULL;
+	}
+	buffer = _FAT_mem_allocate(ptIo, count * size);
+	if (buffer != NULL) {
+		memset(buffer, 0, count * size);
+	}
+	return buffer;
+}
+
+void* _FAT_mem_reallocate (void* buffer, size_t size) {
+	MEM_HEADER* header;
+	MEM_HEADER* newHeader;
+
+	if (buffer == NULL || size > (size_t) -1 - sizeof(MEM_HEADER)) {
+		return NULL;
+	}
+	header = (MEM_HEADER*) buffer - 1;
+	newHeader = (MEM_HEADER*) realloc(header, sizeof(MEM_HEADER) + size);
+	if (newHeader == NULL) {
+		return NULL;
+	}
+	_FAT_mem_release(newHeader);
+	return _FAT_mem_account(newHeader, newHeader->info.stats, size);
+}
+
+void _FAT_mem_free (void* buffer) {
+	MEM_HEADER* header;
+
+	if (buffer != NULL) {
+		header = (MEM_HEADER*) buffer - 1;
+		_FAT_mem_release(header);
+		free(header);
+	}
+}
+#endif
+
 /*
 Initialise the disc to a state ready for data reading or writing
 */
@@ -0,0 +1,689 @@
+/*
+	fat_bench: times the fatfs operations on a synthetic file tree and prints
+	the results as JSON, so the numbers of two releases can be compared.
+
+	The tree is made of --files files, spread over directories holding
+	--fanout files each. The file sizes are drawn from a fixed pseudo random
+	sequence, so the same options always produce the same tree.
+*/
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+#include "fatfs.h"
+#include "version.h"
+
+
+#if defined(FATBENCH_COUNT_ALLOCATIONS)
+/* The linker redirects all calls of malloc, calloc and realloc in the
+   benchmark, fatfs and the libraries to these functions, see CMakeLists.txt. */
+static unsigned long long s_ullAllocations = 0;
+
+extern "C" {
+void *__real_malloc(size_t sizSize);
+void *__real_calloc(size_t sizNum, size_t sizSize);
+void *__real_realloc(void *pvData, size_t sizSize);
+
+void *__wrap_malloc(size_t sizSize){
+	++s_ullAllocations;
+	return __real_malloc(sizSize);
+}
+
+void *__wrap_calloc(size_t sizNum, size_t sizSize){
+	++s_ullAllocations;
+	return __real_calloc(sizNum, sizSize);
+}
+
+void *__wrap_realloc(void *pvData, size_t sizSize){
+	++s_ullAllocations;
+	return __real_realloc(pvData, sizSize);
+}
+}
+
+/* new uses the counted malloc */
+void* operator new(size_t sizSize){
+	void *pvData = malloc(sizSize!=0 ? sizSize : 1);
+	if (pvData==NULL) throw std::bad_alloc();
+	return pvData;
+}
+
+void operator delete(void *pvData) noexcept {
+	free(pvData);
+}
+
+void operator delete(void *pvData, size_t) noexcept {
+	free(pvData);
+}
+#endif
+
+
+typedef struct
+{
+	const char *pszName;
+	size_t sizSectorSize;
+	size_t sizNumSectors;
+	size_t sizImageSize;		// 0 = sizSectorSize * sizNumSectors
+	size_t sizOffset;			// start of the FAT partition in the image
+} BENCH_GEOMETRY_T;
+
+static const BENCH_GEOMETRY_T atGeometries[] =
+{
+	{"fat12", 512,   8000, 0, 0},
+	{"fat16", 512,  65536, 0, 0},
+	{"fat32", 512, 262144, 0, 0},
+	/* the NSC flash layout of test/make_nsc_img.lua */
+	{"nsc",   528, 8192-125, 528*8192, 528*125}
+};
+
+typedef enum
+{
+	DIST_UNIFORM,	// all sizes are equally likely
+	DIST_LOG		// the logarithm of the size is uniform, many small and few large files
+} BENCH_DIST_T;
+
+typedef struct
+{
+	BENCH_GEOMETRY_T tGeometry;
+	unsigned long ulFiles;
+	unsigned long ulFanout;		// files per directory, 0 = all files in the root directory
+	size_t sizMinSize;
+	size_t sizMaxSize;
+	BENCH_DIST_T tDist;
+	unsigned long long ullSeed;
+	unsigned long ulRepeat;		// number of runs for create, mount and dir
+	const char *pszOutput;		// NULL = stdout
+} BENCH_CONFIG_T;
+
+typedef struct
+{
+	const char *pszName;
+	unsigned long long ullOps;
+	unsigned long long ullBytes;		// 0 if the operation moves no file data
+	unsigned long long ullNs;
+	unsigned long long ullAllocations;
+} BENCH_RESULT_T;
+
+typedef struct
+{
+	std::chrono::steady_clock::time_point tStart;
+	unsigned long long ullAllocations;
+} BENCH_TIMER_T;
+
+/* one entry of the synthetic tree */
+typedef struct
+{
+	std::string strPath;
+	size_t sizSize;
+	size_t sizDataOffset;		// the contents are taken from the data buffer at this offset
+} BENCH_FILE_T;
+
+
+static unsigned long long getAllocations(){
+#if defined(FATBENCH_COUNT_ALLOCATIONS)
+	return s_ullAllocations;
+#else
+	return 0;
+#endif
+}
+
+static void startTimer(BENCH_TIMER_T *ptTimer){
+	ptTimer->ullAllocations = getAllocations();
+	ptTimer->tStart = std::chrono::steady_clock::now();
+}
+
+static void stopTimer(const BENCH_TIMER_T *ptTimer, BENCH_RESULT_T *ptResult){
+	std::chrono::steady_clock::time_point tEnd = std::chrono::steady_clock::now();
+	ptResult->ullNs += (unsigned long long) std::chrono::duration_cast<std::chrono::nanoseconds>(tEnd - ptTimer->tStart).count();
+	ptResult->ullAllocations += getAllocations() - ptTimer->ullAllocations;
+}
+
+/* xorshift64*, the same sequence on all hosts unlike rand() */
+static unsigned long long nextRandom(unsigned long long *pullState){
+	unsigned long long ullX = *pullState;
+	ullX ^= ullX >> 12;
+	ullX ^= ullX << 25;
+	ullX ^= ullX >> 27;
+	*pullState = ullX;
+	return ullX * 0x2545F4914F6CDD1DULL;
+}
+
+static size_t randomSize(const BENCH_CONFIG_T *ptConfig, unsigned long long *pullState){
+	unsigned long long ullRange = ptConfig->sizMaxSize - ptConfig->sizMinSize;
+	unsigned long long ullRandom = nextRandom(pullState);
+	double dLow;
+	double dHigh;
+	double dFraction;
+	size_t sizSize;
+
+	if (ptConfig->tDist==DIST_LOG) {
+		dLow = log((double) ptConfig->sizMinSize + 1.0);
+		dHigh = log((double) ptConfig->sizMaxSize + 1.0);
+		dFraction = (double) (ullRandom >> 11) / (double) (1ULL << 53);
+		sizSize = (size_t) (exp(dLow + (dHigh - dLow) * dFraction) - 1.0);
+		if (sizSize < ptConfig->sizMinSize) sizSize = ptConfig->sizMinSize;
+		if (sizSize > ptConfig->sizMaxSize) sizSize = ptConfig->sizMaxSize;
+	} else {
+		sizSize = ptConfig->sizMinSize + (size_t) (ullRandom % (ullRange + 1));
+	}
+	return sizSize;
+}
+
+/* returns the FAT type and cluster size from the boot sector, 0 if it is not valid */
+static unsigned int getFatType(const unsigned char *pucBoot, size_t *psizClusterSize){
+	unsigned long ulBytesPerSector = pucBoot[11] | (pucBoot[12] << 8);
+	unsigned long ulSectorsPerCluster = pucBoot[13];
+	unsigned long ulReserved = pucBoot[14] | (pucBoot[15] << 8);
+	unsigned long ulFats = pucBoot[16];
+	unsigned long ulRootEntries = pucBoot[17] | (pucBoot[18] << 8);
+	unsigned long ulTotal = pucBoot[19] | (pucBoot[20] << 8);
+	unsigned long ulFatSize = pucBoot[22] | (pucBoot[23] << 8);
+	unsigned long ulData;
+	unsigned long ulClusters;
+
+	if (ulTotal==0) {
+		ulTotal = pucBoot[32] | (pucBoot[33] << 8) | (pucBoot[34] << 16) | ((unsigned long) pucBoot[35] << 24);
+	}
+	if (ulFatSize==0) {
+		ulFatSize = pucBoot[36] | (pucBoot[37] << 8) | (pucBoot[38] << 16) | ((unsigned long) pucBoot[39] << 24);
+	}
+	if (ulBytesPerSector==0 || ulSectorsPerCluster==0) {
+		return 0;
+	}
+	ulData = ulReserved + ulFats * ulFatSize + (ulRootEntries * 32 + ulBytesPerSector - 1) / ulBytesPerSector;
+	if (ulData >= ulTotal) {
+		return 0;
+	}
+	ulClusters = (ulTotal - ulData) / ulSectorsPerCluster;
+	*psizClusterSize = ulBytesPerSector * ulSectorsPerCluster;
+	return (ulClusters < 4085) ? 12 : ((ulClusters < 65525) ? 16 : 32);
+}
+
+
+static bool s_fFailed = false;
+
+static void benchError(void *, const char* strFormat, ...){
+	va_list argp;
+
+	s_fFailed = true;
+	va_start(argp, strFormat);
+	vfprintf(stderr, strFormat, argp);
+	va_end(argp);
+	fprintf(stderr, "\n");
+}
+
+/* the messages of writefile, dir etc. are not printed */
+static void benchMessage(void *, const char*, ...){
+}
+
+static fatfs* newFS(){
+	fatfs *pFS = new fatfs();
+	pFS->setHandlers(benchError, benchMessage, NULL);
+	return pFS;
+}
+
+
+/* the benchmark steps, see runBenchmark */
+enum {
+	BENCH_CREATE,
+	BENCH_MKDIR,
+	BENCH_WRITEFILE,
+	BENCH_REWRITEFILE,
+	BENCH_MOUNT,
+	BENCH_READFILE,
+	BENCH_FILEEXISTS,
+	BENCH_DIR,
+	BENCH_DELETEFILE,
+	BENCH_STEPS
+};
+
+static const char *apszStepNames[BENCH_STEPS] =
+{
+	"create",
+	"mkdir",
+	"writefile",
+	"rewritefile",
+	"mount",
+	"readfile",
+	"fileexists",
+	"dir",
+	"deletefile"
+};
+
+/*
+	Runs all steps, stops at the first error.
+	returns: 0=ok, >0=error
+*/
+static int runBenchmark(const BENCH_CONFIG_T *ptConfig, BENCH_RESULT_T *ptResults, unsigned int *puiFatType, size_t *psizClusterSize){
+	const BENCH_GEOMETRY_T *ptGeometry = &ptConfig->tGeometry;
+	std::vector<BENCH_FILE_T> atFiles;
+	std::vector<std::string> astrDirs;
+	std::vector<char> acData;
+	BENCH_TIMER_T tTimer;
+	BENCH_RESULT_T *ptResult;
+	unsigned long long ullState;
+	unsigned long ulIdx;
+	unsigned long ulRun;
+	fatfs *pFS;
+	fatfs *pMountFS;
+	char *pcImage;
+	char *pcData;
+	size_t sizImage;
+	size_t sizLen;
+	char acName[64];
+
+	for (ulIdx=0; ulIdx<BENCH_STEPS; ulIdx++) {
+		memset(&ptResults[ulIdx], 0, sizeof(BENCH_RESULT_T));
+		ptResults[ulIdx].pszName = apszStepNames[ulIdx];
+	}
+
+	/* plan the tree, the directory names fit into 8.3 and need no long name entries */
+	ullState = ptConfig->ullSeed!=0 ? ptConfig->ullSeed : 1;
+	acData.resize(ptConfig->sizMaxSize + 4096);
+	for (ulIdx=0; ulIdx<acData.size(); ulIdx++) {
+		acData[ulIdx] = (char) nextRandom(&ullState);
+	}
+	atFiles.resize(ptConfig->ulFiles);
+	for (ulIdx=0; ulIdx<ptConfig->ulFiles; ulIdx++) {
+		if (ptConfig->ulFanout!=0 && ulIdx % ptConfig->ulFanout==0) {
+			sprintf(acName, "/D%05lu", ulIdx / ptConfig->ulFanout);
+			astrDirs.push_back(acName);
+		}
+		sprintf(acName, "/file_%06lu.bin", ulIdx);
+		atFiles[ulIdx].strPath = (ptConfig->ulFanout!=0 ? astrDirs.back() : std::string()) + acName;
+		atFiles[ulIdx].sizSize = randomSize(ptConfig, &ullState);
+		atFiles[ulIdx].sizDataOffset = (size_t) (nextRandom(&ullState) % 4096);
+	}
+
+	/* create */
+	pFS = NULL;
+	ptResult = &ptResults[BENCH_CREATE];
+	for (ulRun=0; ulRun<ptConfig->ulRepeat; ulRun++) {
+		delete pFS;
+		pFS = newFS();
+		startTimer(&tTimer);
+		if (!pFS->create(ptGeometry->sizSectorSize, ptGeometry->sizNumSectors, ptGeometry->sizImageSize, ptGeometry->sizOffset)) {
+			fprintf(stderr, "create failed\n");
+			delete pFS;
+			return 1;
+		}
+		stopTimer(&tTimer, ptResult);
+		++ptResult->ullOps;
+	}
+
+	/* mkdir */
+	ptResult = &ptResults[BENCH_MKDIR];
+	startTimer(&tTimer);
+	for (ulIdx=0; ulIdx<astrDirs.size() && !s_fFailed; ulIdx++) {
+		pFS->mkdir(&astrDirs[ulIdx][0]);
+	}
+	stopTimer(&tTimer, ptResult);
+	ptResult->ullOps = astrDirs.size();
+	if (s_fFailed) {
+		fprintf(stderr, "The directories do not fit into the root directory, use a larger fanout.\n");
+		delete pFS;
+		return 1;
+	}
+
+	/* writefile, then write all files again to the existing files */
+	for (ulRun=BENCH_WRITEFILE; ulRun<=BENCH_REWRITEFILE && !s_fFailed; ulRun++) {
+		ptResult = &ptResults[ulRun];
+		startTimer(&tTimer);
+		for (ulIdx=0; ulIdx<atFiles.size() && !s_fFailed; ulIdx++) {
+			pFS->writefile(&acData[atFiles[ulIdx].sizDataOffset], atFiles[ulIdx].sizSize, &atFiles[ulIdx].strPath[0]);
+			ptResult->ullBytes += atFiles[ulIdx].sizSize;
+		}
+		stopTimer(&tTimer, ptResult);
+		ptResult->ullOps = atFiles.size();
+	}
+	if (s_fFailed) {
+		fprintf(stderr, "The tree does not fit into the image, use fewer or smaller files or a larger geometry.\n");
+		delete pFS;
+		return 1;
+	}
+
+	/* mount a copy of the image */
+	pcImage = pFS->getimage(&sizImage);
+	*puiFatType = getFatType((const unsigned char*) pcImage + ptGeometry->sizOffset, psizClusterSize);
+	pMountFS = NULL;
+	ptResult = &ptResults[BENCH_MOUNT];
+	for (ulRun=0; ulRun<ptConfig->ulRepeat; ulRun++) {
+		delete pMountFS;
+		pMountFS = newFS();
+		startTimer(&tTimer);
+		if (!pMountFS->mount(pcImage, sizImage, ptGeometry->sizOffset)) {
+			fprintf(stderr, "mount failed\n");
+			delete pMountFS;
+			delete pFS;
+			return 1;
+		}
+		stopTimer(&tTimer, ptResult);
+		++ptResult->ullOps;
+	}
+	delete pFS;
+	pFS = pMountFS;
+
+	/* readfile */
+	ptResult = &ptResults[BENCH_READFILE];
+	startTimer(&tTimer);
+	for (ulIdx=0; ulIdx<atFiles.size() && !s_fFailed; ulIdx++) {
+		pcData = pFS->readfile(&atFiles[ulIdx].strPath[0], &sizLen);
+		if (pcData!=NULL && sizLen==atFiles[ulIdx].sizSize) {
+			ptResult->ullBytes += sizLen;
+		} else {
+			fprintf(stderr, "readfile %s returned the wrong data\n", atFiles[ulIdx].strPath.c_str());
+			s_fFailed = true;
+		}
+		free(pcData);
+	}
+	stopTimer(&tTimer, ptResult);
+	ptResult->ullOps = atFiles.size();
+
+	/* fileexists, every file and a missing file in the same directory */
+	std::vector<std::string> astrMissing(atFiles.size());
+	for (ulIdx=0; ulIdx<atFiles.size(); ulIdx++) {
+		astrMissing[ulIdx] = atFiles[ulIdx].strPath + ".missing";
+	}
+	ptResult = &ptResults[BENCH_FILEEXISTS];
+	startTimer(&tTimer);
+	for (ulIdx=0; ulIdx<atFiles.size() && !s_fFailed; ulIdx++) {
+		if (!pFS->fileexists(&atFiles[ulIdx].strPath[0]) || pFS->fileexists(&astrMissing[ulIdx][0])) {
+			fprintf(stderr, "fileexists %s returned the wrong result\n", atFiles[ulIdx].strPath.c_str());
+			s_fFailed = true;
+		}
+	}
+	stopTimer(&tTimer, ptResult);
+	ptResult->ullOps = 2 * atFiles.size();
+
+	/* dir, the whole tree */
+	ptResult = &ptResults[BENCH_DIR];
+	for (ulRun=0; ulRun<ptConfig->ulRepeat && !s_fFailed; ulRun++) {
+		char acRoot[2] = {'/', '\0'};
+		startTimer(&tTimer);
+		pFS->dir(acRoot, true);
+		stopTimer(&tTimer, ptResult);
+		++ptResult->ullOps;
+	}
+
+	/* deletefile */
+	ptResult = &ptResults[BENCH_DELETEFILE];
+	startTimer(&tTimer);
+	for (ulIdx=0; ulIdx<atFiles.size() && !s_fFailed; ulIdx++) {
+		pFS->deletefile(&atFiles[ulIdx].strPath[0]);
+	}
+	stopTimer(&tTimer, ptResult);
+	ptResult->ullOps = atFiles.size();
+
+	delete pFS;
+	return s_fFailed ? 1 : 0;
+}
+
+
+/* the output format changes only if the version is incremented */
+#define FAT_BENCH_FORMAT_VERSION 1
+
+static void printResults(FILE *ptOut, const BENCH_CONFIG_T *ptConfig, const BENCH_RESULT_T *ptResults, unsigned int uiFatType, size_t sizClusterSize){
+	const BENCH_RESULT_T *ptResult;
+	unsigned int uiIdx;
+
+	fprintf(ptOut, "{\n");
+	fprintf(ptOut, "  \"format\": %d,\n", FAT_BENCH_FORMAT_VERSION);
+	fprintf(ptOut, "  \"version\": \"%s\",\n", FAT_TOOL_VERSION_STRING);
+	fprintf(ptOut, "  \"config\": {\"geometry\": \"%s\", \"sector_size\": %lu, \"sectors\": %lu, \"image_size\": %lu, \"offset\": %lu, "
+		"\"fat_type\": %u, \"cluster_size\": %lu, \"files\": %lu, \"fanout\": %lu, \"min_size\": %lu, \"max_size\": %lu, "
+		"\"distribution\": \"%s\", \"seed\": %llu, \"repeat\": %lu, \"allocations_counted\": %s},\n",
+		ptConfig->tGeometry.pszName,
+		(unsigned long) ptConfig->tGeometry.sizSectorSize,
+		(unsigned long) ptConfig->tGeometry.sizNumSectors,
+		(unsigned long) (ptConfig->tGeometry.sizImageSize!=0 ? ptConfig->tGeometry.sizImageSize : ptConfig->tGeometry.sizSectorSize * ptConfig->tGeometry.sizNumSectors),
+		(unsigned long) ptConfig->tGeometry.sizOffset,
+		uiFatType,
+		(unsigned long) sizClusterSize,
+		ptConfig->ulFiles,
+		ptConfig->ulFanout,
+		(unsigned long) ptConfig->sizMinSize,
+		(unsigned long) ptConfig->sizMaxSize,
+		ptConfig->tDist==DIST_LOG ? "log" : "uniform",
+		ptConfig->ullSeed,
+		ptConfig->ulRepeat,
+#if defined(FATBENCH_COUNT_ALLOCATIONS)
+		"true"
+#else
+		"false"
+#endif
+		);
+	fprintf(ptOut, "  \"results\": [\n");
+	for (uiIdx=0; uiIdx<BENCH_STEPS; uiIdx++) {
+		ptResult = &ptResults[uiIdx];
+		fprintf(ptOut, "    {\"name\": \"%s\", \"ops\": %llu, \"bytes\": %llu, \"ns\": %llu, \"ns_per_op\": ",
+			ptResult->pszName, ptResult->ullOps, ptResult->ullBytes, ptResult->ullNs);
+		if (ptResult->ullOps!=0) {
+			fprintf(ptOut, "%.1f", (double) ptResult->ullNs / (double) ptResult->ullOps);
+		} else {
+			fprintf(ptOut, "null");
+		}
+		/* MB/s with 1 MB = 1000000 bytes */
+		fprintf(ptOut, ", \"mb_per_s\": ");
+		if (ptResult->ullBytes!=0 && ptResult->ullNs!=0) {
+			fprintf(ptOut, "%.2f", (double) ptResult->ullBytes * 1000.0 / (double) ptResult->ullNs);
+		} else {
+			fprintf(ptOut, "null");
+		}
+		fprintf(ptOut, ", \"allocations\": ");
+#if defined(FATBENCH_COUNT_ALLOCATIONS)
+		fprintf(ptOut, "%llu", ptResult->ullAllocations);
+#else
+		fprintf(ptOut, "null");
+#endif
+		fprintf(ptOut, "}%s\n", uiIdx+1<BENCH_STEPS ? "," : "");
+	}
+	fprintf(ptOut, "  ]\n");
+	fprintf(ptOut, "}\n");
+}
+
+
+static void print_usage(){
+	unsigned int uiIdx;
+
+	printf(
+		"FAT Bench V" FAT_TOOL_VERSION_STRING "\n"
+		"Times the fatfs operations on a synthetic file tree, prints JSON\n"
+		"Usage: fat_bench [options]\n"
+		"\n"
+		"--geometry name             predefined geometry, see below, default fat16\n"
+		"--geometry blocksize:num_blocks[:imagesize:FAT_offset]\n"
+		"                            like -create of fat_tool\n"
+		"--files n                   number of files, default 1000\n"
+		"--fanout n                  files per directory, 0 = all in the root\n"
+		"                            directory, default 100\n"
+		"--size min[:max]            file size range in bytes, default 0:16384\n"
+		"--dist uniform|log          size distribution, log has many small and few\n"
+		"                            large files, default uniform\n"
+		"--seed n                    seed of the tree, default 1\n"
+		"--repeat n                  runs of create, mount and dir, default 5\n"
+		"--output file               write the JSON to file instead of stdout\n"
+		"\n"
+		"Geometries:\n"
+		);
+	for (uiIdx=0; uiIdx<sizeof(atGeometries)/sizeof(atGeometries[0]); uiIdx++) {
+		printf("  %-8s %lu byte sectors, %lu sectors, image size %lu, FAT offset %lu\n",
+			atGeometries[uiIdx].pszName,
+			(unsigned long) atGeometries[uiIdx].sizSectorSize,
+			(unsigned long) atGeometries[uiIdx].sizNumSectors,
+			(unsigned long) (atGeometries[uiIdx].sizImageSize!=0 ? atGeometries[uiIdx].sizImageSize : atGeometries[uiIdx].sizSectorSize * atGeometries[uiIdx].sizNumSectors),
+			(unsigned long) atGeometries[uiIdx].sizOffset);
+	}
+}
+
+/*
+	Parses a decimal or 0x hex number, *ppszArg is moved behind it.
+	returns: 1=ok, 0=error
+*/
+static int parseNumber(const char **ppszArg, unsigned long long *pullVal){
+	const char *pszArg = *ppszArg;
+	char *pszEnd;
+	int iBase = 10;
+
+	if (pszArg[0]=='0' && (pszArg[1]=='x' || pszArg[1]=='X')) {
+		iBase = 16;
+		pszArg += 2;
+	}
+	if (!(iBase==16 ? isxdigit((unsigned char) pszArg[0]) : isdigit((unsigned char) pszArg[0]))) {
+		return 0;
+	}
+	errno = 0;
+	*pullVal = strtoull(pszArg, &pszEnd, iBase);
+	if (errno==ERANGE || *pullVal > (size_t) -1) {
+		return 0;
+	}
+	*ppszArg = pszEnd;
+	return 1;
+}
+
+/* parses numbers separated by ':', returns the number of values or 0 on errors */
+static unsigned int parseNumbers(const char *pszArg, unsigned long long *pullVals, unsigned int uiMax){
+	unsigned int uiCnt = 0;
+
+	while (uiCnt<uiMax) {
+		if (!parseNumber(&pszArg, &pullVals[uiCnt])) return 0;
+		++uiCnt;
+		if (*pszArg=='\0') return uiCnt;
+		if (*pszArg!=':') return 0;
+		++pszArg;
+	}
+	return 0;
+}
+
+/* returns: 0=ok, >0=error */
+static int parseArgs(int argc, char** argv, BENCH_CONFIG_T *ptConfig){
+	unsigned long long aullVals[4];
+	unsigned int uiCnt;
+	unsigned int uiIdx;
+	const char *pszOpt;
+	const char *pszVal;
+	int iArg;
+
+	ptConfig->tGeometry = atGeometries[1];
+	ptConfig->ulFiles = 1000;
+	ptConfig->ulFanout = 100;
+	ptConfig->sizMinSize = 0;
+	ptConfig->sizMaxSize = 16384;
+	ptConfig->tDist = DIST_UNIFORM;
+	ptConfig->ullSeed = 1;
+	ptConfig->ulRepeat = 5;
+	ptConfig->pszOutput = NULL;
+
+	for (iArg=1; iArg<argc; iArg+=2) {
+		pszOpt = argv[iArg];
+		if (strcmp(pszOpt, "--help")==0 || strcmp(pszOpt, "-help")==0) {
+			print_usage();
+			return 2;
+		}
+		if (iArg+1>=argc) {
+			printf("%s needs a value\n", pszOpt);
+			return 1;
+		}
+		pszVal = argv[iArg+1];
+
+		if (strcmp(pszOpt, "--geometry")==0) {
+			for (uiIdx=0; uiIdx<sizeof(atGeometries)/sizeof(atGeometries[0]); uiIdx++) {
+				if (strcmp(pszVal, atGeometries[uiIdx].pszName)==0) break;
+			}
+			if (uiIdx<sizeof(atGeometries)/sizeof(atGeometries[0])) {
+				ptConfig->tGeometry = atGeometries[uiIdx];
+			} else {
+				uiCnt = parseNumbers(pszVal, aullVals, 4);
+				if (uiCnt!=2 && uiCnt!=4) {
+					printf("Unknown geometry %s\n", pszVal);
+					return 1;
+				}
+				ptConfig->tGeometry.pszName = "custom";
+				ptConfig->tGeometry.sizSectorSize = (size_t) aullVals[0];
+				ptConfig->tGeometry.sizNumSectors = (size_t) aullVals[1];
+				ptConfig->tGeometry.sizImageSize = uiCnt==4 ? (size_t) aullVals[2] : 0;
+				ptConfig->tGeometry.sizOffset = uiCnt==4 ? (size_t) aullVals[3] : 0;
+			}
+		} else if (strcmp(pszOpt, "--size")==0) {
+			uiCnt = parseNumbers(pszVal, aullVals, 2);
+			if (uiCnt==0 || (uiCnt==2 && aullVals[1]<aullVals[0])) {
+				printf("Can't parse %s as a size range\n", pszVal);
+				return 1;
+			}
+			ptConfig->sizMinSize = (size_t) aullVals[0];
+			ptConfig->sizMaxSize = (size_t) aullVals[uiCnt-1];
+		} else if (strcmp(pszOpt, "--dist")==0) {
+			if (strcmp(pszVal, "uniform")==0) {
+				ptConfig->tDist = DIST_UNIFORM;
+			} else if (strcmp(pszVal, "log")==0) {
+				ptConfig->tDist = DIST_LOG;
+			} else {
+				printf("Unknown distribution %s\n", pszVal);
+				return 1;
+			}
+		} else if (strcmp(pszOpt, "--output")==0) {
+			ptConfig->pszOutput = pszVal;
+		} else if (strcmp(pszOpt, "--files")==0 || strcmp(pszOpt, "--fanout")==0 ||
+			strcmp(pszOpt, "--seed")==0 || strcmp(pszOpt, "--repeat")==0) {
+			if (parseNumbers(pszVal, aullVals, 1)!=1 || aullVals[0] > (unsigned long) -1) {
+				printf("Can't parse %s as an integer\n", pszVal);
+				return 1;
+			}
+			if (strcmp(pszOpt, "--files")==0) {
+				ptConfig->ulFiles = (unsigned long) aullVals[0];
+			} else if (strcmp(pszOpt, "--fanout")==0) {
+				ptConfig->ulFanout = (unsigned long) aullVals[0];
+			} else if (strcmp(pszOpt, "--seed")==0) {
+				ptConfig->ullSeed = aullVals[0];
+			} else {
+				ptConfig->ulRepeat = (unsigned long) aullVals[0];
+			}
+		} else {
+			printf("Unknown option %s\n", pszOpt);
+			return 1;
+		}
+	}
+
+	if (ptConfig->ulRepeat==0) {
+		ptConfig->ulRepeat = 1;
+	}
+	return 0;
+}
+
+int main(int argc, char** argv){
+	BENCH_CONFIG_T tConfig;
+	BENCH_RESULT_T atResults[BENCH_STEPS];
+	unsigned int uiFatType;
+	size_t sizClusterSize;
+	FILE *ptOut;
+	int iResult;
+
+	iResult = parseArgs(argc, argv, &tConfig);
+	if (iResult!=0) {
+		return iResult==2 ? 0 : 1;
+	}
+
+	uiFatType = 0;
+	sizClusterSize = 0;
+	iResult = runBenchmark(&tConfig, atResults, &uiFatType, &sizClusterSize);
+	if (iResult!=0) {
+		return iResult;
+	}
+
+	if (tConfig.pszOutput!=NULL) {
+		ptOut = fopen(tConfig.pszOutput, "w");
+		if (ptOut==NULL) {
+			printf("Could not open file %s\n", tConfig.pszOutput);
+			return 1;
+		}
+		printResults(ptOut, &tConfig, atResults, uiFatType, sizClusterSize);
+		fclose(ptOut);
+	} else {
+		printResults(stdout, &tConfig, atResults, uiFatType, sizClusterSize);
+	}
+	return 0;
+}
@@ -4,39 +4,59 @@
 #include <stdio.h>
 #include <malloc.h>
 #include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <sys/stat.h>
 #include "fat_tool.h"
 #include "fatfs.h"
+#include "manifest.h"
 #include "version.h"
 
+FILE* g_ptStatus = stdout;
+
+/* message and error handler of the fatfs instances */
+void printStatus(void *pvUser, const char* strFmt, ...){
+	va_list argp;
+	va_start(argp, strFmt);
+	vfprintf(g_ptStatus, strFmt, argp);
+	fprintf(g_ptStatus, "\n");
+	va_end(argp);
+}
+
 /* read file to newly allocated buffer */
-char* readFile(char* pszFilename, long *plsize) {
+char* readFile(char* pszFilename, size_t *psizSize) {
 	char *pabBuffer = NULL;
 	FILE* fd;
 	size_t iBytesRead;
-	long lsize;
+	size_t lsize;
 	int iResult;
 	struct stat tStatBuf;
 
 	iResult = stat(pszFilename, &tStatBuf);
 	if( iResult!=0 )
 	{
-		printf("Failed to stat file %s: %s\n", pszFilename, strerror(errno));
+		fprintf(g_ptStatus, "Failed to stat file %s: %s\n", pszFilename, strerror(errno));
 		pabBuffer = NULL;
 	}
 #ifdef __GNUC__
 	else if( S_ISREG(tStatBuf.st_mode)==0 )
 	{
-		printf("The path %s does not point to a regular file!\n", pszFilename);
+		fprintf(g_ptStatus, "The path %s does not point to a regular file!\n", pszFilename);
 		pabBuffer = NULL;
 	} 
 #endif
+	else if( (unsigned long long) tStatBuf.st_size > (size_t) -1 )
+	{
+		fprintf(g_ptStatus, "The file %s does not fit into memory\n", pszFilename);
+		pabBuffer = NULL;
+	}
 	else
 	{
-		lsize = tStatBuf.st_size;
+		lsize = (size_t) tStatBuf.st_size;
 
 		fd = fopen(pszFilename, "rb");
 		if (fd==NULL){
-			printf("Could not open file %s\n", pszFilename);
+			fprintf(g_ptStatus, "Could not open file %s\n", pszFilename);
 		} else {
 /*
 			lsize = _filelength(_fileno(fd));
@@ -44,18 +64,18 @@ char* readFile(char* pszFilename, long *plsize) {
 
 			pabBuffer = (char*)malloc(lsize);
 			if (pabBuffer==NULL) {
-				printf("could not allocate buffer for file\n");
+				fprintf(g_ptStatus, "could not allocate buffer for file\n");
 			} else {
 				iBytesRead = fread(pabBuffer, 1, lsize, fd);
-				printf("File size: %ld bytes, %ld bytes read\n", lsize, iBytesRead);
+				fprintf(g_ptStatus, "File size: %lu bytes, %lu bytes read\n", (unsigned long) lsize, (unsigned long) iBytesRead);
 
 				if (iBytesRead != lsize) {
-					printf("error reading file\n");
+					fprintf(g_ptStatus, "error reading file\n");
 					free(pabBuffer);
 					pabBuffer = NULL;
 				}
 			}
-			*plsize = lsize;
+			*psizSize = lsize;
 			fclose(fd);
 		}
 	}
@@ -70,7 +90,7 @@ int writeFile(char* pabBuffer, size_t sizBufferSize, char* pszFilename){
 
 	fd = fopen(pszFilename, "wb");
 	if (fd==NULL){
-		printf("Could not open file %s\n", pszFilename);
+		fprintf(g_ptStatus, "Could not open file %s\n", pszFilename);
 	} else {
 		iBytesWritten = fwrite(pabBuffer, 1, sizBufferSize, fd);
 		if (iBytesWritten == sizBufferSize){
@@ -81,31 +101,136 @@ int writeFile(char* pabBuffer, size_t sizBufferSize, char* pszFilename){
 	return iRes;
 }
 
+/* writes a piece of a file read from the file system, pvUser is the FILE* */
+bool writeFileSpan(void *pvUser, const char *pcData, size_t sizData){
+	return fwrite(pcData, 1, sizData, (FILE*) pvUser) == sizData;
+}
+
 /*
 	in: pszArg
 	out: pulVal
 	returns: 1=ok, 0=error
 */
+int readULLArg(char* pszArg, unsigned long long* pullVal){
+	char *pszEnd;
+	int iBase = 10;
+
+	if (pszArg[0]=='0' && (pszArg[1]=='x' || pszArg[1]=='X')) {
+		iBase = 16;
+		pszArg += 2;
+	}
+	/* strtoull accepts a sign and white space, the arguments are plain numbers */
+	if (!(iBase==16 ? isxdigit((unsigned char) pszArg[0]) : isdigit((unsigned char) pszArg[0]))) {
+		fprintf(g_ptStatus, "Can't parse %s as an integer\n", pszArg);
+		return 0;
+	}
+	errno = 0;
+	*pullVal = strtoull(pszArg, &pszEnd, iBase);
+	if (*pszEnd!='\0' || errno==ERANGE) {
+		fprintf(g_ptStatus, "Can't parse %s as an integer\n", pszArg);
+		return 0;
+	}
+	return 1;
+}
+
 int readULArg(char* pszArg, unsigned long* pulVal){
-	if (1==sscanf(pszArg, "0x%lx", pulVal)){
-		return 1;
-	} else if (1==sscanf(pszArg, "%ld", pulVal)){
-		return 1;
-	} else {
-		printf("Can't parse %s as an integer\n", pszArg);
+	unsigned long long ullVal;
+	if (0==readULLArg(pszArg, &ullVal)) return 0;
+	if (ullVal > (unsigned long) -1) {
+		fprintf(g_ptStatus, "%s is out of range\n", pszArg);
 		return 0;
 	}
+	*pulVal = (unsigned long) ullVal;
+	return 1;
 }
 
 int readSize(char* pszArg, size_t *psize){
-	if (1==sscanf(pszArg, "0x%lx", psize)){
-		return 1;
-	} else if (1==sscanf(pszArg, "%ld", psize)){
-		return 1;
-	} else {
-		printf("Can't parse %s as an integer\n", pszArg);
+	unsigned long long ullVal;
+	if (0==readULLArg(pszArg, &ullVal)) return 0;
+	if (ullVal > (size_t) -1) {
+		fprintf(g_ptStatus, "%s is out of range\n", pszArg);
 		return 0;
 	}
+	*psize = (size_t) ullVal;
+	return 1;
+}
+
+/* returns true if both names refer to the same existing file */
+bool isSameFile(const char* pszFilename1, const char* pszFilename2){
+	struct stat tStatBuf1;
+	struct stat tStatBuf2;
+
+	if (stat(pszFilename1, &tStatBuf1)!=0 || stat(pszFilename2, &tStatBuf2)!=0) {
+		return false;
+	}
+#ifdef _WIN32
+	/* st_ino is always 0 on Windows */
+	return 0==strcmp(pszFilename1, pszFilename2);
+#else
+	return tStatBuf1.st_dev==tStatBuf2.st_dev && tStatBuf1.st_ino==tStatBuf2.st_ino;
+#endif
+}
+
+/*
+	Checks if one of the commands following a -mount saves the image
+	back to the mounted file. Stops at the next -create or -mount.
+*/
+bool isImageSavedInPlace(int argcnt, char** argv, int iArg, const char* pszImage){
+	while (iArg < argcnt) {
+		if (strcmp("-create", argv[iArg])==0 || strcmp("-mount", argv[iArg])==0 ||
+			strcmp("-createpath", argv[iArg])==0 || strcmp("-mountpath", argv[iArg])==0) {
+			break;
+		} else if (strcmp("-saveimage", argv[iArg])==0 && iArg+1 < argcnt &&
+			isSameFile(argv[iArg+1], pszImage)) {
+			return true;
+		}
+		iArg++;
+	}
+	return false;
+}
+
+/*
+	Checks if a -dir command writes JSON or CSV records to stdout.
+	The other output must not be mixed into them then.
+*/
+bool isDirRecordsOnStdout(int argcnt, char** argv){
+	bool fRecords = false;
+	bool fOutputFile = false;
+	int iArg;
+
+	for (iArg=1; iArg<argcnt; iArg++) {
+		if (strcmp("-dir", argv[iArg])==0) {
+			if (fRecords && !fOutputFile) break;
+			fRecords = false;
+			fOutputFile = false;
+		} else if (strcmp("--json", argv[iArg])==0 || strcmp("--csv", argv[iArg])==0) {
+			fRecords = true;
+		} else if (strcmp("--output", argv[iArg])==0) {
+			fOutputFile = true;
+		}
+	}
+	return fRecords && !fOutputFile;
+}
+
+/* prints the counters of the image, see fatfs::getStats */
+void printStats(fatfs *pFS){
+	FAT_STATS tStats;
+
+	if (!pFS->getStats(&tStats)) {
+		fprintf(g_ptStatus, "Statistics are not available, fat_tool was built without FAT_STATS_ENABLED\n");
+		return;
+	}
+	fprintf(g_ptStatus, "Statistics since the image was created or mounted:\n");
+	fprintf(g_ptStatus, "Sector reads:              %llu calls, %llu bytes\n", (unsigned long long) tStats.readCalls, (unsigned long long) tStats.readBytes);
+	fprintf(g_ptStatus, "Sector writes:             %llu calls, %llu bytes\n", (unsigned long long) tStats.writeCalls, (unsigned long long) tStats.writeBytes);
+	fprintf(g_ptStatus, "Sector maps:               %llu calls\n", (unsigned long long) tStats.mapCalls);
+	fprintf(g_ptStatus, "Partial sector reads:      %llu\n", (unsigned long long) tStats.partialReads);
+	fprintf(g_ptStatus, "Partial sector writes:     %llu\n", (unsigned long long) tStats.partialWrites);
+	fprintf(g_ptStatus, "FAT lookups:               %llu\n", (unsigned long long) tStats.nextClusterLookups);
+	fprintf(g_ptStatus, "FAT entries written:       %llu\n", (unsigned long long) tStats.fatWrites);
+	fprintf(g_ptStatus, "Free cluster probes:       %llu\n", (unsigned long long) tStats.freeClusterProbes);
+	fprintf(g_ptStatus, "Directory entries scanned: %llu\n", (unsigned long long) tStats.dirEntriesScanned);
+	fprintf(g_ptStatus, "Heap peak:                 %llu bytes, %llu bytes in use\n", (unsigned long long) tStats.heapPeak, (unsigned long long) tStats.heapCurrent);
 }
 
 void print_usage(){
@@ -122,21 +247,40 @@ void print_usage(){
 		"  Create an image with a FAT file system.\n"
 		"  default imagesize = blocksize * num_blocks\n"
 		"  default FAT_offset = 0\n"
-		"-mount file [FAT_offset]    load and mount image\n"
-		"-saveimage file             write image to file\n"
+		"-mount file [FAT_offset]    map and mount image\n"
+		"-createpath file blocksize num_blocks [imagesize FAT_offset]\n"
+		"-mountpath file [FAT_offset]\n"
+		"                            create or mount an image which is not loaded\n"
+		"                            into memory, all changes go directly to file\n"
+		"-saveimage file [--trim] [--sparse]\n"
+		"                            write image to file\n"
+		"                            if file is the mounted image, it is updated in place\n"
+		"                            --trim: leave out the erased end of the image\n"
+		"                            --sparse: blocks of zeros become holes in the file\n"
 		"-writeraw file offset       write binary data into image at offset\n"
 		"-readraw offset len file    read binary data from image and save to file\n"
 		"\n"
 		"-mkdir path                 create directory\n"
-		"-dir [path] [-r]            list directory\n"    
+		"-dir [path] [-r] [--json|--csv] [--output file]\n"
+		"                            list directory\n"
+		"                            --json, --csv: one record per entry with the\n"
+		"                            full path, for scripts\n"
+		"                            --output: write the records to file\n"
+		"                            instead of stdout\n"
 		"-cd path                    set current directory\n"
 		"\n"
 		"-writefile file destfile    copy file into file system\n"
 		"-readfile file destfile     read file from file system\n"
 		"-exists file                check if file exists\n"
 		"-delete file                delete file\n" //del
+		"-manifest file [threads]    write all files listed in file, one per line:\n"
+		"                            hostfile destfile  or  destdir/\n"
+		"                            the files are read by threads threads,\n"
+		"                            default: number of CPUs, at least 4\n"
+		"-stats                      print the disc accesses and FAT operations\n"
+		"                            since the image was created or mounted\n"
 		"\n"
-		"The first command must be create or mount.\n"
+		"The first command must be create, mount, createpath or mountpath.\n"
 		"File names may include a path. Path separatator is /.\n"
 
 		);
@@ -154,15 +298,20 @@ int execute_commands(int argcnt, char** argv){
 	size_t sizImageSize;
 	size_t sizOffset;
 	size_t sizLen;
-	long lFileSize;
+	size_t sizFileSize;
 	unsigned long ulSize;
 	char *pszFilename;
 	char *pszDestname; 
+	char *pszMountedImage;
 	char *pabBuffer;
+	FILE *fd;
 
 	int iResult;
 	bool fOk;
 	bool fRecurse;
+	fatfs::Dirformats tDirFormat;
+	bool fTrim;
+	bool fSparse;
 
 	int iArg;
 	int iRemArgs;
@@ -170,6 +319,11 @@ int execute_commands(int argcnt, char** argv){
 
 	iArg = 1;  // skip exe filename
 	pFS = NULL;
+	pszMountedImage = NULL;
+
+	if (isDirRecordsOnStdout(argcnt, argv)) {
+		g_ptStatus = stderr;
+	}
 
 	while (iArg < argcnt) 
 	{
@@ -195,8 +349,10 @@ int execute_commands(int argcnt, char** argv){
 				iArg += 3;
 			}
 			
+			pszMountedImage = NULL;
 			if (pFS!= NULL) delete pFS;
 			pFS = new fatfs();
+			if (pFS != NULL) pFS->setHandlers(printStatus, printStatus, NULL);
 			if (pFS != NULL && !pFS->create(sizSectorSize, sizNumBlocks, sizImageSize, sizOffset)) {
 				delete(pFS);
 				pFS = NULL;
@@ -220,40 +376,106 @@ int execute_commands(int argcnt, char** argv){
 				iArg += 2;
 			}
 			
-			pabBuffer = readFile(pszFilename, &lFileSize);
-			if (pabBuffer == NULL) {
+			/* The image is mapped, not read. If it is saved back to the same
+			   file later, the changes are written through and the save is only
+			   a sync. Otherwise the mapping is private and the file is not modified. */
+			fOk = isImageSavedInPlace(argcnt, argv, iArg, pszFilename);
+			pszMountedImage = fOk ? pszFilename : NULL;
+
+			if (pFS!= NULL) delete pFS;
+			pFS = new fatfs();
+			if (pFS != NULL) pFS->setHandlers(printStatus, printStatus, NULL);
+			if (pFS != NULL && !pFS->mountFile(pszFilename, sizOffset, !fOk)) {
+				delete(pFS);
+				pFS = NULL;
 				return 1;
+			}
+		}
+
+		/* -createpath filename blocksize num_blocks [imagesize offset] */
+		else if (strcmp("-createpath", argv[iArg])==0 && iRemArgs>=3)
+		{
+			pszFilename = argv[iArg+1];
+			if (0==readSize(argv[iArg+2], &sizSectorSize)) return 1;
+			if (0==readSize(argv[iArg+3], &sizNumBlocks)) return 1;
+			if (iRemArgs >= 5 && argv[iArg+4][0]!='-') {
+				if (0==readSize(argv[iArg+4], &sizImageSize)) return 1;
+				if (0==readSize(argv[iArg+5], &sizOffset)) return 1;
+				iArg += 6;
 			} else {
-				if (pFS!= NULL) delete pFS;
-				pFS = new fatfs();
-				if (pFS != NULL && !pFS->mount(pabBuffer, lFileSize, sizOffset)) {
-					free(pabBuffer);
-					delete(pFS);
-					pFS = NULL;
-					return 1;
-				}
-				free(pabBuffer);
+				sizImageSize = 0;
+				sizOffset = 0;
+				iArg += 4;
+			}
+
+			/* the image file is always up to date, saving it in place is a sync */
+			pszMountedImage = pszFilename;
+			if (pFS!= NULL) delete pFS;
+			pFS = new fatfs();
+			if (pFS != NULL) pFS->setHandlers(printStatus, printStatus, NULL);
+			if (pFS != NULL && !pFS->createPath(pszFilename, sizSectorSize, sizNumBlocks, sizImageSize, sizOffset)) {
+				delete(pFS);
+				pFS = NULL;
+				return 1;
+			}
+		}
+
+		/* -mountpath filename [offset]*/
+		else if (strcmp("-mountpath", argv[iArg])==0 && iRemArgs>=1)
+		{
+			pszFilename = argv[iArg+1];
+			if (iRemArgs >= 2 && argv[iArg+2][0]!='-') {
+				if (0==readSize(argv[iArg+2], &sizOffset)) return 1;
+				iArg += 3;
+			} else {
+				sizOffset = 0;
+				iArg += 2;
+			}
+
+			pszMountedImage = pszFilename;
+			if (pFS!= NULL) delete pFS;
+			pFS = new fatfs();
+			if (pFS != NULL) pFS->setHandlers(printStatus, printStatus, NULL);
+			if (pFS != NULL && !pFS->mountPath(pszFilename, sizOffset, false)) {
+				delete(pFS);
+				pFS = NULL;
+				return 1;
 			}
 		}
 
 		else if (pFS == NULL) {
-			printf("The first command must be create or mount.\n");
+			fprintf(g_ptStatus, "The first command must be create, mount, createpath or mountpath.\n");
 			return 1;
 		}
 
-		/* -saveimage filename */
+		/* -saveimage filename [--trim] [--sparse] */
 		else if (strcmp("-saveimage", argv[iArg])==0 && iRemArgs>=1)
 		{
 			pszFilename = argv[iArg+1];
 			iArg += 2;
+
+			fTrim = false;
+			fSparse = false;
+			while (iArg < argcnt) {
+				if (strcmp("--trim", argv[iArg])==0) {
+					fTrim = true;
+				} else if (strcmp("--sparse", argv[iArg])==0) {
+					fSparse = true;
+				} else {
+					break;
+				}
+				iArg++;
+			}
+
+			if (pszMountedImage != NULL && isSameFile(pszFilename, pszMountedImage)) {
+				fOk = pFS->sync();
+				if (!fOk) return 1;
+				continue;
+			}
 			
-			pabBuffer = pFS->getimage(&ulSize);
-			if (pabBuffer == NULL) {
-				printf("Failed to get image!\n");
+			if (!pFS->saveimage(pszFilename, fTrim, fSparse)) {
+				fprintf(g_ptStatus, "Failed to save image!\n");
 				return 1;
-			} else {
-				iResult = writeFile(pabBuffer, (long) ulSize, pszFilename);
-				if (iResult == 1) return 1;
 			}
 		}
 
@@ -264,9 +486,9 @@ int execute_commands(int argcnt, char** argv){
 			if (0==readSize(argv[iArg+2], &sizOffset)) return 1;
 			iArg += 3;
 
-			pabBuffer = readFile(pszFilename, &lFileSize);
+			pabBuffer = readFile(pszFilename, &sizFileSize);
 			if (pabBuffer == NULL) return 1;
-			fOk = pFS->writeraw(pabBuffer, lFileSize, sizOffset);
+			fOk = pFS->writeraw(pabBuffer, sizFileSize, sizOffset);
 			free(pabBuffer);
 			if (!fOk) return 1;
 		}
@@ -307,7 +529,7 @@ int execute_commands(int argcnt, char** argv){
 			if (!fOk) return 1;
 		}
 
-		/* -dir [dirname] [-r] */ 
+		/* -dir [dirname] [-r] [--json|--csv] [--output file] */
 		else if(strcmp("-dir", argv[iArg])==0)
 		{
 			if (iRemArgs >= 1 && argv[iArg+1][0]!='-') {
@@ -318,16 +540,43 @@ int execute_commands(int argcnt, char** argv){
 				pszFilename = aucDefaultDir;
 			}
 
-			if (iRemArgs >= 1 && 0==strcmp("-r", argv[iArg+1])) {
-				fRecurse = true;
+			fRecurse = false;
+			tDirFormat = fatfs::DIR_TEXT;
+			pszDestname = NULL;
+			while (iRemArgs >= 1) {
+				if (0==strcmp("-r", argv[iArg+1])) {
+					fRecurse = true;
+				} else if (0==strcmp("--json", argv[iArg+1])) {
+					tDirFormat = fatfs::DIR_JSON;
+				} else if (0==strcmp("--csv", argv[iArg+1])) {
+					tDirFormat = fatfs::DIR_CSV;
+				} else if (0==strcmp("--output", argv[iArg+1]) && iRemArgs >= 2) {
+					pszDestname = argv[iArg+2];
+					iArg ++;
+					iRemArgs --;
+				} else {
+					break;
+				}
 				iArg ++;
-			} else {
-				fRecurse = false;
+				iRemArgs --;
 			}
 
 			iArg++;
 
-			fOk = pFS->dir(pszFilename, fRecurse);
+			if (pszDestname == NULL) {
+				fOk = pFS->dir(pszFilename, fRecurse, tDirFormat);
+			} else if (tDirFormat == fatfs::DIR_TEXT) {
+				fprintf(g_ptStatus, "-dir: --output needs --json or --csv\n");
+				return 1;
+			} else {
+				fd = fopen(pszDestname, "w");
+				if (fd == NULL) {
+					fprintf(g_ptStatus, "Could not open file %s\n", pszDestname);
+					return 1;
+				}
+				fOk = pFS->dir(pszFilename, fRecurse, tDirFormat, fd);
+				fOk = (fclose(fd) == 0) && fOk;
+			}
 			if (!fOk) return 1;
 		}
 
@@ -339,9 +588,9 @@ int execute_commands(int argcnt, char** argv){
 			pszDestname = argv[iArg+2];
 			iArg += 3;
 
-			pabBuffer = readFile(pszFilename, &lFileSize);
+			pabBuffer = readFile(pszFilename, &sizFileSize);
 			if (pabBuffer == NULL) return 1;
-			fOk = pFS->writefile(pabBuffer, (size_t) lFileSize, pszDestname);
+			fOk = pFS->writefile(pabBuffer, sizFileSize, pszDestname);
 			free(pabBuffer);
 			if (!fOk) return 1;		
 		}
@@ -353,13 +602,19 @@ int execute_commands(int argcnt, char** argv){
 			pszDestname = argv[iArg+2];
 			iArg += 3;
 
-			pabBuffer = pFS->readfile(pszFilename, &sizLen);
-			if (pabBuffer == NULL) {
+			/* the file is streamed, there is no copy of the whole file in memory */
+			fd = fopen(pszDestname, "wb");
+			if (fd==NULL){
+				fprintf(g_ptStatus, "Could not open file %s\n", pszDestname);
+				return 1;
+			}
+			fOk = pFS->readfile(pszFilename, writeFileSpan, fd);
+			if (fclose(fd)!=0) {
+				fOk = false;
+			}
+			if (!fOk) {
+				remove(pszDestname);
 				return 1;
-			} else {
-				iResult = writeFile(pabBuffer, (long) sizLen, pszDestname);
-				free(pabBuffer);
-				if (iResult == 1) return 1;
 			}
 		}
 
@@ -371,9 +626,9 @@ int execute_commands(int argcnt, char** argv){
 
 			fOk = pFS->fileexists(pszFilename);
 			if (fOk) {
-				printf("File %s exists\n", pszFilename);
+				fprintf(g_ptStatus, "File %s exists\n", pszFilename);
 			} else {
-				printf("File %s does not exist\n", pszFilename);
+				fprintf(g_ptStatus, "File %s does not exist\n", pszFilename);
 			}
 		}
 
@@ -386,9 +641,37 @@ int execute_commands(int argcnt, char** argv){
 			pFS->deletefile(pszFilename);
 		}
 
+		/* -manifest filename [threads] */
+		else if(strcmp("-manifest", argv[iArg])==0 && iRemArgs>=1)
+		{
+			pszFilename = argv[iArg+1];
+			if (iRemArgs >= 2 && argv[iArg+2][0]!='-') {
+				if (0==readULArg(argv[iArg+2], &ulSize)) return 1;
+				iArg += 3;
+			} else {
+				ulSize = 0;
+				iArg += 2;
+			}
+
+			iResult = executeManifest(pFS, pszFilename, (unsigned int) ulSize);
+			if (iResult != 0) return 1;
+		}
+
+		/* -stats */
+		else if(strcmp("-stats", argv[iArg])==0)
+		{
+			iArg += 1;
+
+			if (pFS == NULL) {
+				fprintf(g_ptStatus, "-stats: no image\n");
+				return 1;
+			}
+			printStats(pFS);
+		}
+
 		else 
 		{
-			printf("unknown command: %s\n", argv[iArg]);
+			fprintf(g_ptStatus, "unknown command: %s\n", argv[iArg]);
 			print_usage();
 			return 1;
 		}
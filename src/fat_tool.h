@@ -1,5 +1,12 @@
 
+#include <stdio.h>
 #include "fat/partition.h"
 
 extern PARTITION*                g_ptRamDiskPartition;
 extern PARTITION*                g_ptDefaultPartition;
+
+/* messages and errors, stderr if the -dir records go to stdout */
+extern FILE*                     g_ptStatus;
+
+/* read file to newly allocated buffer */
+char* readFile(char* pszFilename, size_t *psizSize);
@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <malloc.h>
 #include <string.h>
+#include <limits.h>
+#include <algorithm>
 
 extern "C" {
 #       include "fat/bit_ops.h"
@@ -22,13 +24,44 @@ extern "C" {
 	size_t					m_sizDiskMemSize;
 */
 
+/* number of sectors cached for an image file (see mountPath) */
+#define FATFS_FILE_CACHE_SECTORS 256
+/* buffer size for copying an image file in saveimage */
+#define FATFS_SAVE_BUFFER_SIZE 0x100000
+/* saveimage leaves a hole in the output file for each block of zeros */
+#define FATFS_SPARSE_BLOCK_SIZE 0x1000
+
+/*
+	Size of a partition in bytes, computed in 64 bits.
+	Fails if the product overflows or the sector count does not fit
+	into the 32 bit fields of the boot sector.
+*/
+static bool getPartitionSize(size_t sizSectorSize, size_t sizNumSectors, unsigned long long *pullSize){
+	u64 ullSize;
+
+	if ((unsigned long long) sizNumSectors > 0xffffffffULL) return false;
+	if (!u64_mulChecked(sizSectorSize, sizNumSectors, &ullSize)) return false;
+	*pullSize = ullSize;
+	return true;
+}
+
 
 fatfs::fatfs(){
 	m_fReady = false;
 	m_ptRamDiskPartition = NULL;
 	m_pvDiskMem = NULL;
 	m_sizDiskMemSize = 0;
+	m_fMapped = false;
+	memset(&m_tMmapDisk, 0, sizeof(m_tMmapDisk));
+	m_fFile = false;
+	memset(&m_tFileDisk, 0, sizeof(m_tFileDisk));
+	m_sizOffset = 0;
+	m_pcRawBuffer = NULL;
+	m_sizHighWater = 0;
+	m_fHighWaterValid = false;
+	memset(&m_tRamDisk, 0, sizeof(m_tRamDisk));
 	setHandlers(&fatfs::error, &fatfs::printMessage, NULL);
+	resetStats();
 }
 
 void fatfs::setHandlers(FN_FATFS_ERROR_HANDLER pfnErrorHandler, FN_FATFS_VPRINTF pfn_vprintf, void* pvUser){
@@ -44,6 +77,11 @@ void fatfs::setDiscIOErrorHandlers(){
 	m_tIoIfRamdisk.pvErrUser = m_pvUser;
 }
 
+void fatfs::resetStats(){
+	memset(&m_tStats, 0, sizeof(m_tStats));
+	m_tIoIfRamdisk.ptStats = &m_tStats;
+}
+
 void fatfs::error(void *pvUser, const char* strFmt, ...){
 	va_list argp;	
 	va_start(argp, strFmt);
@@ -62,16 +100,28 @@ void fatfs::printMessage(void *pvUser, const char* strFmt, ...){
 
 bool fatfs::create(size_t sizSectorSize, size_t sizNumSectors, size_t sizTotalSize, size_t sizOffset){
 	int iResult;
-	if (sizTotalSize == 0) sizTotalSize = sizSectorSize * sizNumSectors;
+	unsigned long long ullPartitionSize;
+
+	if (!getPartitionSize(sizSectorSize, sizNumSectors, &ullPartitionSize)) {
+		FAILHARD("fatfs create: Illegal sector size/sector count");
+		return false;
+	}
+	if (sizTotalSize == 0) {
+		if (ullPartitionSize > (size_t) -1) {
+			FAILHARD("fatfs create: The image does not fit into the address space");
+			return false;
+		}
+		sizTotalSize = (size_t) ullPartitionSize;
+	}
 
 	if (sizOffset > sizTotalSize  ||
-		sizSectorSize * sizNumSectors > sizTotalSize||
-		sizOffset + sizSectorSize * sizNumSectors > sizTotalSize ) {
+		ullPartitionSize > sizTotalSize - sizOffset) {
 		FAILHARD("fatfs create: Illegal size/offset parameters");
 		return false;
 	}
 
-	m_pvDiskMem = malloc(sizTotalSize);
+	/* zeroed memory is not touched until it is used */
+	m_pvDiskMem = calloc(sizTotalSize > 0 ? sizTotalSize : 1, 1);
 	if (m_pvDiskMem == NULL){
 		FAILHARD("fatfs create: Could not allocate memory for image");
 		return false;
@@ -80,21 +130,30 @@ bool fatfs::create(size_t sizSectorSize, size_t sizNumSectors, size_t sizTotalSi
 	m_sizDiskMemSize = sizTotalSize;
 
 	// init memory to $ff - should this be a parameter?
-	memset(m_pvDiskMem, 0xff, m_sizDiskMemSize);
+	// The partition is erased lazily, only the parts around it are filled now.
+	memset(m_pvDiskMem, 0xff, sizOffset);
+	memset((char*)m_pvDiskMem + sizOffset + ullPartitionSize, 0xff, sizTotalSize - sizOffset - (size_t) ullPartitionSize);
+	if (!ramdisk_init(&m_tRamDisk, (char*)m_pvDiskMem + sizOffset, (unsigned long) sizSectorSize, (unsigned long) sizNumSectors, 0xff)) {
+		free (m_pvDiskMem); m_pvDiskMem = NULL;
+		FAILHARD("fatfs create: Could not allocate memory for image");
+		return false;
+	}
 
 	/* set the ramdisk IO interface */
-	m_tIoIfRamdisk = g_tIoIfRamDisk;
+	m_tIoIfRamdisk = g_tIoIfLazyRamDisk;
 	m_tIoIfRamdisk.ulBlockSize        = (unsigned long) sizSectorSize;
-	m_tIoIfRamdisk.pvUser             = (void*)((char*)m_pvDiskMem + sizOffset);
-	m_tIoIfRamdisk.ulStartOffset      = 0;
-	m_tIoIfRamdisk.ulDiskSize         = (unsigned long) (sizSectorSize * sizNumSectors);
+	m_tIoIfRamdisk.pvUser             = (void*) &m_tRamDisk;
+	m_tIoIfRamdisk.ullStartOffset     = 0;
+	m_tIoIfRamdisk.ullDiskSize        = ullPartitionSize;
 	setDiscIOErrorHandlers(); // set error handlers (they were overwritten by the struct assignement)
+	resetStats();
 	_FAT_disc_startup(&m_tIoIfRamdisk); // does nothing
 
 	/* format and mount file system */
 	iResult = formatFat(&m_tIoIfRamdisk); 
 	if (iResult==0){
 		free (m_pvDiskMem); m_pvDiskMem = NULL;
+		ramdisk_free(&m_tRamDisk);
 		FAILHARD("fatfs create: formatFat failed");
 		return false;
 	}
@@ -103,11 +162,14 @@ bool fatfs::create(size_t sizSectorSize, size_t sizNumSectors, size_t sizTotalSi
 	m_ptRamDiskPartition = _FAT_partition_mountCustomInterface(&m_tIoIfRamdisk, 0);
 	if (m_ptRamDiskPartition == NULL){
 		free (m_pvDiskMem); m_pvDiskMem = NULL;
+		ramdisk_free(&m_tRamDisk);
 		FAILHARD("fatfs create: Could not mount partition");
 		return false;
 	} else {
-		MESSAGE("Partition created. %d sectors  %d bytes/sector  offset: 0x%x  image size: 0x%x",
-			sizNumSectors, sizSectorSize, sizOffset, sizTotalSize);
+		MESSAGE("Partition created. %lu sectors  %lu bytes/sector  offset: 0x%llx  image size: 0x%llx",
+			(unsigned long) sizNumSectors, (unsigned long) sizSectorSize, (unsigned long long) sizOffset, (unsigned long long) sizTotalSize);
+		m_sizOffset = sizOffset;
+		setFormattedHighWater();
 		m_fReady = true;
 		return true;
 	}
@@ -118,6 +180,7 @@ bool fatfs::create(size_t sizSectorSize, size_t sizNumSectors, size_t sizTotalSi
 bool fatfs::mount(const char* pabData, size_t sizTotalSize, size_t sizOffset){
 	size_t sizSectorSize;
 	size_t sizNumSectors;
+	unsigned long long ullPartitionSize;
 
 	if (sizOffset > sizTotalSize){
 		FAILHARD("fatfs mount: Illegal offset>size");
@@ -133,8 +196,10 @@ bool fatfs::mount(const char* pabData, size_t sizTotalSize, size_t sizOffset){
 
 	if (sizSectorSize >= sizTotalSize - sizOffset||
 		sizNumSectors >= sizTotalSize - sizOffset||
-		sizSectorSize * sizNumSectors > sizTotalSize - sizOffset) {
+		!getPartitionSize(sizSectorSize, sizNumSectors, &ullPartitionSize) ||
+		ullPartitionSize > sizTotalSize - sizOffset) {
 		FAILSOFT("fatfs mount: invalid sector size/sector count");
+		return false;
 	}
 
 	m_pvDiskMem = malloc(sizTotalSize);
@@ -149,9 +214,10 @@ bool fatfs::mount(const char* pabData, size_t sizTotalSize, size_t sizOffset){
 	m_tIoIfRamdisk = g_tIoIfRamDisk;
 	m_tIoIfRamdisk.ulBlockSize        = (unsigned long) sizSectorSize;
 	m_tIoIfRamdisk.pvUser             = (void*)((char*)m_pvDiskMem + sizOffset);
-	m_tIoIfRamdisk.ulStartOffset      = 0;
-	m_tIoIfRamdisk.ulDiskSize         = (unsigned long) (sizSectorSize * sizNumSectors);
+	m_tIoIfRamdisk.ullStartOffset     = 0;
+	m_tIoIfRamdisk.ullDiskSize        = ullPartitionSize;
 	setDiscIOErrorHandlers();// set error handlers (they were overwritten by the struct assignement)
+	resetStats();
 	_FAT_disc_startup(&m_tIoIfRamdisk); // does nothing
 
 	/* try to mount the new image */
@@ -161,15 +227,443 @@ bool fatfs::mount(const char* pabData, size_t sizTotalSize, size_t sizOffset){
 		FAILSOFT("fatfs mount: Could not mount partition");
 		return false;
 	} else {
-		MESSAGE("Partition mounted. %d sectors  %d bytes/sector  offset: 0x%x  image size: 0x%x",
-			sizNumSectors, sizSectorSize, sizOffset, sizTotalSize);
+		MESSAGE("Partition mounted. %lu sectors  %lu bytes/sector  offset: 0x%llx  image size: 0x%llx",
+			(unsigned long) sizNumSectors, (unsigned long) sizSectorSize, (unsigned long long) sizOffset, (unsigned long long) sizTotalSize);
+		m_sizOffset = sizOffset;
+		m_fReady = true;
+		return true;
+	}
+}
+
+bool fatfs::mountFile(const char* pszFilename, size_t sizOffset, bool fReadOnly){
+	size_t sizSectorSize;
+	size_t sizNumSectors;
+	size_t sizTotalSize;
+	unsigned long long ullPartitionSize;
+
+	if (!mmapdisk_open(&m_tMmapDisk, pszFilename, !fReadOnly)) {
+		FAILSOFT("fatfs mountfile: Could not map file %s", pszFilename);
+		return false;
+	}
+	sizTotalSize = m_tMmapDisk.sizData;
+
+	if (sizOffset > sizTotalSize){
+		mmapdisk_close(&m_tMmapDisk);
+		FAILHARD("fatfs mountfile: Illegal offset>size");
+		return false;
+	}
+
+	if (!_FAT_partition_recognize(m_tMmapDisk.pvData, sizTotalSize, sizOffset, &sizSectorSize, &sizNumSectors)) {
+		mmapdisk_close(&m_tMmapDisk);
+		FAILSOFT("fatfs mountfile: FAT boot sector not found or invalid");
+		return false;
+	}
+
+	if (sizSectorSize >= sizTotalSize - sizOffset||
+		sizNumSectors >= sizTotalSize - sizOffset||
+		!getPartitionSize(sizSectorSize, sizNumSectors, &ullPartitionSize) ||
+		ullPartitionSize > sizTotalSize - sizOffset) {
+		mmapdisk_close(&m_tMmapDisk);
+		FAILSOFT("fatfs mountfile: invalid sector size/sector count");
+		return false;
+	}
+
+	m_pvDiskMem = m_tMmapDisk.pvData;
+	m_sizDiskMemSize = sizTotalSize;
+	m_fMapped = true;
+
+	/* set the IO interface, the sector access is the same as for the ramdisk */
+	m_tIoIfRamdisk = g_tIoIfMmapDisk;
+	m_tIoIfRamdisk.ulBlockSize        = (unsigned long) sizSectorSize;
+	m_tIoIfRamdisk.pvUser             = (void*)((char*)m_pvDiskMem + sizOffset);
+	m_tIoIfRamdisk.ullStartOffset     = 0;
+	m_tIoIfRamdisk.ullDiskSize        = ullPartitionSize;
+	setDiscIOErrorHandlers();// set error handlers (they were overwritten by the struct assignement)
+	resetStats();
+	_FAT_disc_startup(&m_tIoIfRamdisk); // does nothing
+
+	/* try to mount the image */
+	m_ptRamDiskPartition = _FAT_partition_mountCustomInterface(&m_tIoIfRamdisk, 0);
+	if (m_ptRamDiskPartition == NULL){
+		mmapdisk_close(&m_tMmapDisk);
+		m_pvDiskMem = NULL;
+		m_fMapped = false;
+		FAILSOFT("fatfs mountfile: Could not mount partition");
+		return false;
+	} else {
+		MESSAGE("Partition mounted from %s. %lu sectors  %lu bytes/sector  offset: 0x%llx  image size: 0x%llx",
+			pszFilename, (unsigned long) sizNumSectors, (unsigned long) sizSectorSize, (unsigned long long) sizOffset, (unsigned long long) sizTotalSize);
+		m_sizOffset = sizOffset;
 		m_fReady = true;
 		return true;
 	}
 }
 
+/* 
+	set up the IO interface for m_tFileDisk and mount the partition,
+	closes the file if this fails
+*/
+bool fatfs::mountFileDisk(const char* pszCaller, size_t sizSectorSize, size_t sizNumSectors, size_t sizOffset){
+	m_tIoIfRamdisk = g_tIoIfFileDisk;
+	if (!m_tFileDisk.fWritable) {
+		m_tIoIfRamdisk.features = FEATURE_MEDIUM_CANREAD;
+	}
+	m_tIoIfRamdisk.ulBlockSize        = (unsigned long) sizSectorSize;
+	m_tIoIfRamdisk.pvUser             = (void*) &m_tFileDisk;
+	m_tIoIfRamdisk.ullStartOffset     = sizOffset;
+	m_tIoIfRamdisk.ullDiskSize        = (unsigned long long) sizSectorSize * sizNumSectors;
+	setDiscIOErrorHandlers();// set error handlers (they were overwritten by the struct assignement)
+	resetStats();
+	_FAT_disc_startup(&m_tIoIfRamdisk);
+
+	m_ptRamDiskPartition = _FAT_partition_mountCustomInterface(&m_tIoIfRamdisk, FATFS_FILE_CACHE_SECTORS);
+	if (m_ptRamDiskPartition == NULL){
+		filedisk_close(&m_tFileDisk);
+		FAILSOFT("%s: Could not mount partition", pszCaller);
+		return false;
+	}
+
+	m_sizDiskMemSize = (size_t) m_tFileDisk.ullSize;
+	m_sizOffset = sizOffset;
+	m_fFile = true;
+	m_fReady = true;
+	return true;
+}
+
+bool fatfs::createPath(const char* pszFilename, size_t sizSectorSize, size_t sizNumSectors, size_t sizTotalSize, size_t sizOffset){
+	int iResult;
+	unsigned long long ullPartitionSize;
+
+	if (!getPartitionSize(sizSectorSize, sizNumSectors, &ullPartitionSize)) {
+		FAILHARD("fatfs createpath: Illegal sector size/sector count");
+		return false;
+	}
+	if (sizTotalSize == 0) {
+		if (ullPartitionSize > (size_t) -1) {
+			FAILHARD("fatfs createpath: The image does not fit into the address space");
+			return false;
+		}
+		sizTotalSize = (size_t) ullPartitionSize;
+	}
+
+	if (sizOffset > sizTotalSize  ||
+		ullPartitionSize > sizTotalSize - sizOffset) {
+		FAILHARD("fatfs createpath: Illegal size/offset parameters");
+		return false;
+	}
+
+	if (!filedisk_create(&m_tFileDisk, pszFilename, sizTotalSize)) {
+		FAILHARD("fatfs createpath: Could not create image file %s", pszFilename);
+		return false;
+	}
+
+	/* format through the file disk interface, then mount */
+	m_tIoIfRamdisk = g_tIoIfFileDisk;
+	m_tIoIfRamdisk.ulBlockSize        = (unsigned long) sizSectorSize;
+	m_tIoIfRamdisk.pvUser             = (void*) &m_tFileDisk;
+	m_tIoIfRamdisk.ullStartOffset     = sizOffset;
+	m_tIoIfRamdisk.ullDiskSize        = (unsigned long long) sizSectorSize * sizNumSectors;
+	setDiscIOErrorHandlers();
+	resetStats();
+	iResult = formatFat(&m_tIoIfRamdisk); 
+	if (iResult==0){
+		filedisk_close(&m_tFileDisk);
+		FAILHARD("fatfs createpath: formatFat failed");
+		return false;
+	}
+
+	if (!mountFileDisk("fatfs createpath", sizSectorSize, sizNumSectors, sizOffset)) {
+		return false;
+	}
+	setFormattedHighWater();
+	MESSAGE("Partition created in %s. %lu sectors  %lu bytes/sector  offset: 0x%llx  image size: 0x%llx",
+		pszFilename, (unsigned long) sizNumSectors, (unsigned long) sizSectorSize, (unsigned long long) sizOffset, (unsigned long long) sizTotalSize);
+	return true;
+}
+
+bool fatfs::mountPath(const char* pszFilename, size_t sizOffset, bool fReadOnly){
+	unsigned char abBootSector[512];
+	size_t sizBootSector;
+	size_t sizSectorSize;
+	size_t sizNumSectors;
+	size_t sizTotalSize;
+	unsigned long long ullPartitionSize;
+
+	if (!filedisk_open(&m_tFileDisk, pszFilename, !fReadOnly)) {
+		FAILSOFT("fatfs mountpath: Could not open file %s", pszFilename);
+		return false;
+	}
+	sizTotalSize = (size_t) m_tFileDisk.ullSize;
+
+	if (sizOffset > sizTotalSize){
+		filedisk_close(&m_tFileDisk);
+		FAILHARD("fatfs mountpath: Illegal offset>size");
+		return false;
+	}
+
+	/* only the boot sector is needed to recognize the file system */
+	sizBootSector = sizTotalSize - sizOffset < sizeof(abBootSector) ? sizTotalSize - sizOffset : sizeof(abBootSector);
+	if (!filedisk_read(&m_tFileDisk, sizOffset, abBootSector, sizBootSector) ||
+		!_FAT_partition_recognize(abBootSector, sizBootSector, 0, &sizSectorSize, &sizNumSectors)) {
+		filedisk_close(&m_tFileDisk);
+		FAILSOFT("fatfs mountpath: FAT boot sector not found or invalid");
+		return false;
+	}
+
+	if (sizSectorSize >= sizTotalSize - sizOffset||
+		sizNumSectors >= sizTotalSize - sizOffset||
+		!getPartitionSize(sizSectorSize, sizNumSectors, &ullPartitionSize) ||
+		ullPartitionSize > sizTotalSize - sizOffset) {
+		filedisk_close(&m_tFileDisk);
+		FAILSOFT("fatfs mountpath: invalid sector size/sector count");
+		return false;
+	}
+
+	if (!mountFileDisk("fatfs mountpath", sizSectorSize, sizNumSectors, sizOffset)) {
+		return false;
+	}
+	MESSAGE("Partition mounted from %s. %lu sectors  %lu bytes/sector  offset: 0x%llx  image size: 0x%llx",
+		pszFilename, (unsigned long) sizNumSectors, (unsigned long) sizSectorSize, (unsigned long long) sizOffset, (unsigned long long) sizTotalSize);
+	return true;
+}
+
+/*
+	Only the system area was written by formatFat, everything behind it
+	is still erased. With FAT32 the root directory is in the data area.
+*/
+void fatfs::setFormattedHighWater(){
+	size_t sizSectors = m_ptRamDiskPartition->dataStart;
+	if (m_ptRamDiskPartition->filesysType == FS_FAT32) {
+		sizSectors = _FAT_fat_clusterToSector(m_ptRamDiskPartition, m_ptRamDiskPartition->rootDirCluster)
+			+ m_ptRamDiskPartition->sectorsPerCluster;
+	}
+	m_sizHighWater = m_sizOffset + sizSectors * m_ptRamDiskPartition->bytesPerSector;
+	m_fHighWaterValid = true;
+}
+
+/*
+	Returns sizLen bytes of the image at sizPos, directly from memory or
+	read into pcBuffer. Returns NULL if the image file can't be read.
+*/
+const char* fatfs::getImageData(size_t sizPos, size_t sizLen, char *pcBuffer){
+	size_t sizPartStart;
+	size_t sizPartEnd;
+	size_t sizStart;
+	size_t sizEnd;
+
+	if (m_fFile) {
+		return filedisk_read(&m_tFileDisk, sizPos, pcBuffer, sizLen) ? pcBuffer : NULL;
+	}
+	if (m_tRamDisk.pbValid == NULL) {
+		return (const char*) m_pvDiskMem + sizPos;
+	}
+
+	/* the erased sectors of the partition are not in memory */
+	memcpy(pcBuffer, (const char*) m_pvDiskMem + sizPos, sizLen);
+	sizPartStart = m_sizOffset;
+	sizPartEnd = m_sizOffset + (size_t) m_tIoIfRamdisk.ullDiskSize;
+	sizStart = sizPos > sizPartStart ? sizPos : sizPartStart;
+	sizEnd = sizPos + sizLen < sizPartEnd ? sizPos + sizLen : sizPartEnd;
+	if (sizStart < sizEnd) {
+		ramdisk_read(&m_tRamDisk, sizStart - sizPartStart, pcBuffer + (sizStart - sizPos), sizEnd - sizStart);
+	}
+	return pcBuffer;
+}
+
+/*
+	Erases the sectors of a lazily erased image in the range, so the memory
+	can be accessed directly.
+*/
+void fatfs::materialize(size_t sizPos, size_t sizLen){
+	size_t sizSectorSize;
+	size_t sizFirst;
+	size_t sizEnd;
+
+	if (m_tRamDisk.pbValid == NULL || sizLen == 0) return;
+	sizSectorSize = m_tRamDisk.ulSectorSize;
+	sizEnd = sizPos + sizLen;
+	if (sizEnd <= m_sizOffset) return;
+	sizFirst = sizPos > m_sizOffset ? (sizPos - m_sizOffset) / sizSectorSize : 0;
+	sizEnd = (sizEnd - m_sizOffset + sizSectorSize - 1) / sizSectorSize;
+	if (sizEnd > m_tRamDisk.ulSectors) sizEnd = m_tRamDisk.ulSectors;
+	if (sizFirst < sizEnd) {
+		ramdisk_materialize(&m_tRamDisk, (unsigned long) sizFirst, (unsigned long) (sizEnd - sizFirst));
+	}
+}
+
+static bool isFilled(const char *pcData, size_t sizLen, char cFill){
+	return sizLen == 0 || (pcData[0] == cFill && memcmp(pcData, pcData + 1, sizLen - 1) == 0);
+}
+
+/*
+	Finds the end of the used part of the image. For an image built here,
+	this is the highest byte written. A mounted image is scanned backwards
+	for erased (0xff) sectors, like truncate_image.lua does.
+	pcBuffer must hold FATFS_SAVE_BUFFER_SIZE bytes.
+*/
+bool fatfs::getImageEnd(size_t *psizEnd, char *pcBuffer){
+	size_t sizEnd;
+	size_t sizChunk;
+	size_t sizBlock;
+	size_t sizSectorSize = m_ptRamDiskPartition->bytesPerSector;
+	const char *pcData;
+
+	if (m_fHighWaterValid) {
+		sizEnd = m_sizOffset + (size_t) m_ptRamDiskPartition->cache->highWater * sizSectorSize;
+		if (sizEnd < m_sizHighWater) sizEnd = m_sizHighWater;
+		*psizEnd = sizEnd < m_sizDiskMemSize ? sizEnd : m_sizDiskMemSize;
+		return true;
+	}
+
+	sizEnd = m_sizDiskMemSize;
+	while (sizEnd > 0) {
+		sizChunk = sizEnd < FATFS_SAVE_BUFFER_SIZE ? sizEnd : FATFS_SAVE_BUFFER_SIZE;
+		pcData = getImageData(sizEnd - sizChunk, sizChunk, pcBuffer);
+		if (pcData == NULL) return false;
+		while (sizChunk > 0) {
+			sizBlock = sizChunk < sizSectorSize ? sizChunk : sizSectorSize;
+			if (!isFilled(pcData + sizChunk - sizBlock, sizBlock, (char) 0xff)) {
+				*psizEnd = sizEnd;
+				return true;
+			}
+			sizChunk -= sizBlock;
+			sizEnd -= sizBlock;
+		}
+	}
+	*psizEnd = 0;
+	return true;
+}
+
+static bool seekFile(FILE *fd, unsigned long long ullOffset){
+#ifdef _WIN32
+	return _fseeki64(fd, (__int64) ullOffset, SEEK_SET) == 0;
+#else
+	return fseeko(fd, (off_t) ullOffset, SEEK_SET) == 0;
+#endif
+}
+
+/* write the FAT and the cached sectors into the image */
+bool fatfs::flush(){
+	if (m_ptRamDiskPartition == NULL) return true;
+	return _FAT_fat_flush(m_ptRamDiskPartition) && _FAT_cache_flush(m_ptRamDiskPartition->cache);
+}
+
+bool fatfs::sync(){
+	if (!checkReady()) return false;
+	if (!flush()) {
+		FAILHARD("sync: could not flush the cache");
+		return false;
+	}
+	if (m_fMapped && !mmapdisk_sync(&m_tMmapDisk)) {
+		FAILHARD("sync: could not write the image file");
+		return false;
+	}
+	if (m_fFile && !filedisk_sync(&m_tFileDisk)) {
+		FAILHARD("sync: could not write the image file");
+		return false;
+	}
+	return true;
+}
+
+bool fatfs::saveimage(const char* pszFilename, bool fTrim, bool fSparse){
+	FILE *fd;
+	char *pcBuffer;
+	const char *pcData;
+	unsigned long long ullData;
+	size_t sizEnd;
+	size_t sizPos;
+	size_t sizChunk;
+	size_t sizBlockPos;
+	size_t sizBlock;
+	size_t sizFilePos;
+	bool fOk;
+
+	if (!checkReady()) return false;
+	if (!flush()) {
+		FAILHARD("saveimage: could not flush the cache");
+		return false;
+	}
+
+	/* an image file or a lazily erased image is copied piece by piece */
+	pcBuffer = NULL;
+	if (m_fFile || m_tRamDisk.pbValid != NULL) {
+		pcBuffer = (char*) malloc(FATFS_SAVE_BUFFER_SIZE);
+		if (pcBuffer == NULL) {
+			FAILHARD("saveimage: could not allocate the copy buffer");
+			return false;
+		}
+	}
+
+	sizEnd = m_sizDiskMemSize;
+	if (fTrim) {
+		if (!getImageEnd(&sizEnd, pcBuffer)) {
+			free(pcBuffer);
+			FAILHARD("saveimage: could not read the image file");
+			return false;
+		}
+		if (sizEnd < m_sizDiskMemSize) {
+			MESSAGE("saveimage: image trimmed to 0x%llx bytes", (unsigned long long) sizEnd);
+		}
+	}
+
+	fd = fopen(pszFilename, "wb");
+	if (fd == NULL) {
+		free(pcBuffer);
+		FAILHARD("saveimage: could not open %s", pszFilename);
+		return false;
+	}
+
+	fOk = true;
+	sizFilePos = 0;
+	for (sizPos = 0; fOk && sizPos < sizEnd; sizPos += sizChunk) {
+		if (fSparse && m_fFile) {
+			/* holes in the image file are not read, they stay holes */
+			ullData = filedisk_nextData(&m_tFileDisk, sizPos);
+			if (ullData > sizPos) {
+				sizChunk = (size_t) (ullData < sizEnd ? ullData - sizPos : sizEnd - sizPos);
+				continue;
+			}
+		}
+
+		sizChunk = sizEnd - sizPos < FATFS_SAVE_BUFFER_SIZE ? sizEnd - sizPos : FATFS_SAVE_BUFFER_SIZE;
+		pcData = getImageData(sizPos, sizChunk, pcBuffer);
+		if (pcData == NULL) {
+			fOk = false;
+		} else if (!fSparse) {
+			fOk = fwrite(pcData, 1, sizChunk, fd) == sizChunk;
+			sizFilePos += sizChunk;
+		} else {
+			/* skip the blocks of zeros, a hole reads as zeros.
+			   Erased (0xff) blocks can't be holes, --trim removes them at the end. */
+			for (sizBlockPos = 0; fOk && sizBlockPos < sizChunk; sizBlockPos += sizBlock) {
+				sizBlock = sizChunk - sizBlockPos < FATFS_SPARSE_BLOCK_SIZE ? sizChunk - sizBlockPos : FATFS_SPARSE_BLOCK_SIZE;
+				if (isFilled(pcData + sizBlockPos, sizBlock, 0)) continue;
+				if (sizFilePos != sizPos + sizBlockPos) {
+					fOk = seekFile(fd, sizPos + sizBlockPos);
+				}
+				fOk = fOk && fwrite(pcData + sizBlockPos, 1, sizBlock, fd) == sizBlock;
+				sizFilePos = sizPos + sizBlockPos + sizBlock;
+			}
+		}
+	}
+
+	/* the file ends with a hole, writing the last zero byte sets the size */
+	if (fOk && sizFilePos < sizEnd) {
+		fOk = seekFile(fd, sizEnd - 1) && fputc(0, fd) != EOF;
+	}
+	free(pcBuffer);
+
+	fOk = (fclose(fd) == 0) && fOk;
+	if (!fOk) {
+		remove(pszFilename);
+		FAILHARD("saveimage: could not write %s", pszFilename);
+	}
+	return fOk;
+}
+
 void fatfs::destroy(void){
 	m_fReady = false;
+	m_atOpenFiles.clear();
 	if (m_ptRamDiskPartition!= NULL) {
 		bool fOk = _FAT_partition_unmount(m_ptRamDiskPartition);
 		if (!fOk) {
@@ -180,6 +674,23 @@ void fatfs::destroy(void){
 		//MESSAGE("partition unmounted");
 	}
 
+	if (m_fMapped) {
+		mmapdisk_close(&m_tMmapDisk);
+		m_pvDiskMem = NULL;
+		m_fMapped = false;
+	}
+
+	if (m_fFile) {
+		filedisk_close(&m_tFileDisk);
+		m_fFile = false;
+	}
+
+	free(m_pcRawBuffer);
+	m_pcRawBuffer = NULL;
+	m_sizHighWater = 0;
+	m_fHighWaterValid = false;
+	ramdisk_free(&m_tRamDisk);
+
 	if (m_pvDiskMem!=NULL) {
 		//MESSAGE("free 0x%08p", m_pvDiskMem);
 		free(m_pvDiskMem);
@@ -201,8 +712,21 @@ bool fatfs::checkReady() {
 }	
 
 
-char* fatfs::getimage(unsigned long *pulSize){
-	if (pulSize != NULL) *pulSize = (unsigned long) m_sizDiskMemSize;
+bool fatfs::isinmemory(){
+	return m_pvDiskMem != NULL;
+}
+
+char* fatfs::getimage(size_t *psizSize){
+	if (m_fFile) {
+		FAILHARD("getimage: the image is not in memory, use saveimage");
+		return NULL;
+	}
+	if (!flush()) {
+		FAILHARD("getimage: could not flush the cache");
+		return NULL;
+	}
+	materialize(0, m_sizDiskMemSize);
+	if (psizSize != NULL) *psizSize = m_sizDiskMemSize;
 	return (char*) m_pvDiskMem;
 }
 
@@ -218,8 +742,38 @@ bool fatfs::writeraw(const char* pabData, size_t sizFileLen, size_t sizOffset){
 		return false;
 	}
 
-	memcpy((void*) ((char*)m_pvDiskMem + sizOffset), pabData, sizFileLen);
-	MESSAGE("writeraw: wrote %d bytes at offset %d", sizFileLen, sizOffset);
+	if (!flush()) {
+		FAILHARD("writeraw: could not flush the cache");
+		return false;
+	}
+
+	if (sizOffset + sizFileLen > m_sizHighWater) {
+		m_sizHighWater = sizOffset + sizFileLen;
+	}
+	if (!m_fFile) {
+		materialize(sizOffset, sizFileLen);
+		memcpy((void*) ((char*)m_pvDiskMem + sizOffset), pabData, sizFileLen);
+	} else if (!filedisk_write(&m_tFileDisk, sizOffset, pabData, sizFileLen)) {
+		FAILHARD("writeraw: could not write the image file");
+		return false;
+	}
+
+	/* the FAT is kept in memory, read it again if it was overwritten */
+	size_t sizSectorSize = m_ptRamDiskPartition->bytesPerSector;
+	size_t sizFatStart = m_sizOffset + m_ptRamDiskPartition->fat.fatStart * sizSectorSize;
+	size_t sizFatEnd = sizFatStart + m_ptRamDiskPartition->fat.sectorsPerFat * sizSectorSize;
+	if (sizOffset < sizFatEnd && sizOffset + sizFileLen > sizFatStart) {
+		if (!_FAT_fat_load(m_ptRamDiskPartition)) {
+			FAILHARD("writeraw: could not reload the FAT");
+			return false;
+		}
+	}
+
+	/* directory contents may have changed, the lookup indexes are rebuilt on demand */
+	_FAT_directory_freeIndex(m_ptRamDiskPartition);
+	_FAT_cache_invalidate(m_ptRamDiskPartition->cache);
+
+	MESSAGE("writeraw: wrote %lu bytes at offset %llu", (unsigned long) sizFileLen, (unsigned long long) sizOffset);
 	return true;
 }
 
@@ -229,8 +783,25 @@ char* fatfs::readraw(size_t sizOffset, size_t sizLen){
 		FAILHARD("readraw: offset/length exceed disk size");
 		return NULL;
 	}
+	if (!flush()) {
+		FAILHARD("readraw: could not flush the cache");
+		return NULL;
+	}
+
+	if (m_fFile) {
+		/* the data is kept until the next readraw */
+		free(m_pcRawBuffer);
+		m_pcRawBuffer = (char*) malloc(sizLen > 0 ? sizLen : 1);
+		if (m_pcRawBuffer == NULL || !filedisk_read(&m_tFileDisk, sizOffset, m_pcRawBuffer, sizLen)) {
+			FAILHARD("readraw: could not read the image file");
+			return NULL;
+		}
+		MESSAGE("readraw: read %lu bytes at offset %llu", (unsigned long) sizLen, (unsigned long long) sizOffset);
+		return m_pcRawBuffer;
+	}
 	
-	MESSAGE("readraw: read %d bytes at offset %d", sizLen, sizOffset);
+	materialize(sizOffset, sizLen);
+	MESSAGE("readraw: read %lu bytes at offset %llu", (unsigned long) sizLen, (unsigned long long) sizOffset);
 	return ((char*)m_pvDiskMem) + sizOffset;
 }
 
@@ -247,6 +818,18 @@ bool fatfs::mkdir(char* pszPath){
 	}	
 }
 
+bool fatfs::reservedir(char* pszPath, unsigned long ulEntries){
+	u32 ulDirCluster;
+
+	if (!checkReady()) return false;
+	if (!get_dir_start_cluster(pszPath, &ulDirCluster)) return false;
+	if (!_FAT_directory_reserveEntries(m_ptRamDiskPartition, ulDirCluster, (u32) ulEntries)) {
+		FAILHARD("reservedir %s: could not reserve %lu entries", pszPath, ulEntries);
+		return false;
+	}
+	return true;
+}
+
 bool fatfs::cd(char* pszPath){
 	bool fOk;
 	if (!checkReady()) return false;
@@ -260,13 +843,32 @@ bool fatfs::cd(char* pszPath){
 bool fatfs::writefile(const char *pcData, size_t sizData, char* pszPath){
 	FILE_STRUCT tFile;	
 	int iResult;
+	bool fExists;
 
 	if (!checkReady()) return false;
-	iResult = FileCreate(m_ptRamDiskPartition, pszPath, &tFile);
-	if (iResult==0) {
-		FAILHARD("writefile %s: FileCreate failed", pszPath);
+	if (sizData > FILE_MAX_SIZE) {
+		FAILHARD("writefile %s: file too large for FAT", pszPath);
 		return false;
 	}
+	if (!checkNotOpen("writefile", pszPath)) return false;
+	fExists = FileOpenForRead(m_ptRamDiskPartition, pszPath, &tFile)!=0;
+	if (fExists) {
+		/* the file exists, keep its directory entry and overwrite its clusters,
+		   only the end of the chain grows or shrinks.
+		   If the missing clusters can not be appended in one piece,
+		   FileWrite allocates them one by one */
+		FileReserve(&tFile, (unsigned long) sizData);
+	} else {
+		iResult = FileCreate(m_ptRamDiskPartition, pszPath, &tFile);
+		if (iResult==0) {
+			FAILHARD("writefile %s: FileCreate failed", pszPath);
+			return false;
+		}
+
+		/* reserve one contiguous run of clusters for the whole file,
+		   if there is none, FileWrite allocates the clusters one by one */
+		FilePreallocate(&tFile, (unsigned long) sizData);
+	}
 
 	size_t sizBytesWritten = FileWrite(&tFile, pcData, (unsigned long) sizData);
 	if (sizBytesWritten != sizData) {
@@ -276,6 +878,14 @@ bool fatfs::writefile(const char *pcData, size_t sizData, char* pszPath){
 		return false;
 	}
 
+	/* free the clusters of the old contents behind the new end */
+	if (fExists && FileTruncate(&tFile, (unsigned long) sizData)==0) {
+		FileClose(&tFile);
+		deletefile(pszPath);
+		FAILHARD("writefile %s: FileTruncate failed", pszPath);
+		return false;
+	}
+
 	iResult = FileClose(&tFile);
 	if (iResult==0) {
 		FAILHARD("writefile %s: FileClose failed", pszPath);
@@ -303,6 +913,13 @@ char* fatfs::readfile(char* pszPath, size_t *psizLen){
 		return NULL;
 	}
 
+	/* FileRead returns the length as int */
+	if (tFile.ulFilesize > INT_MAX) {
+		FileClose(&tFile);
+		FAILHARD("readfile %s: file too large to read into memory, use the callback version", pszPath);
+		return NULL;
+	}
+
 	ulLen = tFile.ulFilesize;
 	pabData = malloc(tFile.ulFilesize);
 	if (pabData == NULL){
@@ -312,7 +929,7 @@ char* fatfs::readfile(char* pszPath, size_t *psizLen){
 	}
 
 	iResult = FileRead(&tFile, pabData, tFile.ulFilesize);
-	if (iResult != tFile.ulFilesize) {
+	if (iResult < 0 || (unsigned long) iResult != tFile.ulFilesize) {
 		FAILHARD("readfile %s: FileRead returned an error", pszPath);
 		free(pabData);
 		FileClose(&tFile);
@@ -330,6 +947,7 @@ char* fatfs::readfile(char* pszPath, size_t *psizLen){
 bool fatfs::deletefile(char* pszPath){
 	int iResult;
 	if (!checkReady()) return false;
+	if (!checkNotOpen("deletefile", pszPath)) return false;
 	iResult = FileDelete(m_ptRamDiskPartition, pszPath);
 
 	if (iResult==0) {
@@ -342,6 +960,187 @@ bool fatfs::deletefile(char* pszPath){
 
 }
 
+/* size of the zero buffer for truncate */
+#define FATFS_ZERO_BUFFER_SIZE 0x1000
+
+/* returns the index of the open file with the alias entry at ptPosition, m_atOpenFiles.size() if there is none */
+size_t fatfs::findOpenFile(const DIR_ENTRY_POSITION *ptPosition){
+	size_t sizIdx;
+
+	for (sizIdx=0; sizIdx<m_atOpenFiles.size(); sizIdx++) {
+		if (m_atOpenFiles[sizIdx].cluster == ptPosition->cluster &&
+			m_atOpenFiles[sizIdx].sector == ptPosition->sector &&
+			m_atOpenFiles[sizIdx].offset == ptPosition->offset) {
+			break;
+		}
+	}
+	return sizIdx;
+}
+
+/*
+	Fails if the file at pszPath has an open handle. The handle writes its
+	size and first cluster into the directory entry on close, which must
+	still be the entry of the file.
+*/
+bool fatfs::checkNotOpen(const char* pszCaller, const char* pszPath){
+	DIR_ENTRY tDirEntry;
+
+	if (m_atOpenFiles.empty()) return true;
+	if (!_FAT_directory_entryFromPath(m_ptRamDiskPartition, &tDirEntry, pszPath, NULL)) return true;
+	if (findOpenFile(&tDirEntry.dataEnd) == m_atOpenFiles.size()) return true;
+	FAILHARD("%s %s: the file has an open handle, close it first", pszCaller, pszPath);
+	return false;
+}
+
+bool fatfs::open(char* pszPath, Openmodes tMode, FATFS_FILE_T *ptFile){
+	int iResult;
+
+	memset(ptFile, 0, sizeof(FATFS_FILE_T));
+	if (!checkReady()) return false;
+	if (!checkNotOpen("open", pszPath)) return false;
+
+	iResult = FileOpenForRead(m_ptRamDiskPartition, pszPath, &ptFile->tFile);
+	if (iResult == 0) {
+		if (tMode != OPEN_CREATE || gettype(pszPath) != TYPE_NONE) {
+			FAILHARD("open %s: not found or not a file", pszPath);
+			return false;
+		}
+		iResult = FileCreate(m_ptRamDiskPartition, pszPath, &ptFile->tFile);
+		if (iResult == 0) {
+			FAILHARD("open %s: FileCreate failed", pszPath);
+			return false;
+		}
+	} else if (tMode == OPEN_CREATE) {
+		/* keep the directory entry, only drop the clusters */
+		iResult = FileTruncate(&ptFile->tFile, 0);
+		if (iResult == 0) {
+			FileClose(&ptFile->tFile);
+			FAILHARD("open %s: could not cut the file", pszPath);
+			return false;
+		}
+	}
+
+	ptFile->fOpen = true;
+	ptFile->fWrite = (tMode != OPEN_READ);
+	m_atOpenFiles.push_back(ptFile->tFile.tDirEntryEnd);
+	return true;
+}
+
+bool fatfs::seek(FATFS_FILE_T *ptFile, unsigned long ulPosition){
+	if (!ptFile->fOpen || !checkReady()) return false;
+	if (FileSeek(&ptFile->tFile, ulPosition) == 0) {
+		FAILHARD("seek: position %lu is behind the end of the file (%lu bytes)", ulPosition, ptFile->tFile.ulFilesize);
+		return false;
+	}
+	return true;
+}
+
+unsigned long fatfs::tell(FATFS_FILE_T *ptFile){
+	return ptFile->tFile.ulCurrentPosition;
+}
+
+unsigned long fatfs::size(FATFS_FILE_T *ptFile){
+	return ptFile->tFile.ulFilesize;
+}
+
+long long fatfs::read(FATFS_FILE_T *ptFile, char *pcBuffer, size_t sizLen){
+	int iResult;
+
+	if (!ptFile->fOpen || !checkReady()) return -1;
+
+	/* FileRead returns the length as int */
+	if (sizLen > INT_MAX) {
+		sizLen = INT_MAX;
+	}
+	iResult = FileRead(&ptFile->tFile, pcBuffer, (unsigned long) sizLen);
+	if (iResult < 0) {
+		FAILHARD("read: FileRead returned an error");
+		return -1;
+	}
+	return iResult;
+}
+
+bool fatfs::write(FATFS_FILE_T *ptFile, const char *pcData, size_t sizData){
+	unsigned long ulWritten;
+
+	if (!ptFile->fOpen || !checkReady()) return false;
+	if (!ptFile->fWrite) {
+		FAILHARD("write: the file is open for reading only");
+		return false;
+	}
+	if (sizData > FILE_MAX_SIZE - ptFile->tFile.ulCurrentPosition) {
+		FAILHARD("write: file too large for FAT");
+		return false;
+	}
+
+	ulWritten = FileWrite(&ptFile->tFile, pcData, (unsigned long) sizData);
+	if (ulWritten != sizData) {
+		FAILHARD("write: FileWrite failed after %lu of %lu bytes", ulWritten, (unsigned long) sizData);
+		return false;
+	}
+	return true;
+}
+
+bool fatfs::truncate(FATFS_FILE_T *ptFile, unsigned long ulSize){
+	static const char acZeros[FATFS_ZERO_BUFFER_SIZE] = {0};
+	unsigned long ulPosition;
+	unsigned long ulChunk;
+
+	if (!ptFile->fOpen || !checkReady()) return false;
+	if (!ptFile->fWrite) {
+		FAILHARD("truncate: the file is open for reading only");
+		return false;
+	}
+
+	if (ulSize <= ptFile->tFile.ulFilesize) {
+		if (FileTruncate(&ptFile->tFile, ulSize) == 0) {
+			FAILHARD("truncate: could not cut the file to %lu bytes", ulSize);
+			return false;
+		}
+		return true;
+	}
+
+	/* append zeros, the position does not change */
+	ulPosition = ptFile->tFile.ulCurrentPosition;
+	if (FileSeek(&ptFile->tFile, ptFile->tFile.ulFilesize) == 0) {
+		FAILHARD("truncate: the cluster chain is shorter than the file");
+		return false;
+	}
+	while (ptFile->tFile.ulFilesize < ulSize) {
+		ulChunk = ulSize - ptFile->tFile.ulFilesize;
+		if (ulChunk > FATFS_ZERO_BUFFER_SIZE) {
+			ulChunk = FATFS_ZERO_BUFFER_SIZE;
+		}
+		if (FileWrite(&ptFile->tFile, acZeros, ulChunk) != ulChunk) {
+			FAILHARD("truncate: could not extend the file to %lu bytes", ulSize);
+			return false;
+		}
+	}
+	return seek(ptFile, ulPosition);
+}
+
+bool fatfs::close(FATFS_FILE_T *ptFile){
+	int iResult;
+	size_t sizIdx;
+
+	if (!ptFile->fOpen) return false;
+	ptFile->fOpen = false;
+	sizIdx = findOpenFile(&ptFile->tFile.tDirEntryEnd);
+	if (sizIdx < m_atOpenFiles.size()) {
+		m_atOpenFiles.erase(m_atOpenFiles.begin() + sizIdx);
+	}
+	if (!checkReady()) {
+		FileFreeExtents(&ptFile->tFile);
+		return false;
+	}
+	iResult = FileClose(&ptFile->tFile);
+	if (iResult == 0) {
+		FAILHARD("close: FileClose failed, the file was deleted or replaced while it was open");
+		return false;
+	}
+	return true;
+}
+
 // int FileExists(PARTITION *ptPartition, const char *szFile);
 bool fatfs::fileexists(char* pszPath){
 	int iResult;
@@ -375,7 +1174,7 @@ bool fatfs::isfile(char* pszPath) {
 }
 
 
-long fatfs::getfilesize(char* pszPath) {
+long long fatfs::getfilesize(char* pszPath) {
 	DIR_ENTRY tDirEntry;
 
 	if (!checkReady()) return -1;
@@ -387,7 +1186,121 @@ long fatfs::getfilesize(char* pszPath) {
 		MESSAGE("getfilesize %s: is a directory ", pszPath);
 		return -1;
 	}
-	return (long) getfilesize(&tDirEntry);
+	return (long long) getfilesize(&tDirEntry);
+}
+
+
+/* size of the buffer for readfile if the image is not in memory */
+#define FATFS_READ_BUFFER_SIZE 0x10000
+
+typedef struct {
+	FN_FATFS_READ_CALLBACK pfnCallback;
+	void *pvCallbackUser;
+} FATFS_READ_CALLBACK_T;
+
+static int readfileSpan(void *pvUser, const void *pvData, unsigned long ulDataLen){
+	FATFS_READ_CALLBACK_T *ptCallback = (FATFS_READ_CALLBACK_T*) pvUser;
+	return ptCallback->pfnCallback(ptCallback->pvCallbackUser, (const char*) pvData, ulDataLen) ? 1 : 0;
+}
+
+bool fatfs::readfile(char* pszPath, FN_FATFS_READ_CALLBACK pfnCallback, void *pvCallbackUser){
+	FILE_STRUCT tFile;
+	FATFS_READ_CALLBACK_T tCallback;
+	void *pvBuffer;
+	unsigned long ulBufferSize;
+	int iResult;
+
+	if (!checkReady()) return false;
+	iResult = FileOpenForRead(m_ptRamDiskPartition, pszPath, &tFile);
+	if (iResult == 0){
+		FAILHARD("readfile %s: FileOpenForRead failed ", pszPath);
+		return false;
+	}
+
+	/* whole sectors are read into the buffer */
+	ulBufferSize = FATFS_READ_BUFFER_SIZE - FATFS_READ_BUFFER_SIZE % m_ptRamDiskPartition->bytesPerSector;
+	if (ulBufferSize == 0) {
+		ulBufferSize = m_ptRamDiskPartition->bytesPerSector;
+	}
+	pvBuffer = malloc(ulBufferSize);
+	if (pvBuffer == NULL){
+		FileClose(&tFile);
+		FAILHARD("readfile %s: Could not allocate the read buffer", pszPath);
+		return false;
+	}
+
+	tCallback.pfnCallback = pfnCallback;
+	tCallback.pvCallbackUser = pvCallbackUser;
+	iResult = FileReadSpans(&tFile, readfileSpan, &tCallback, pvBuffer, ulBufferSize);
+	free(pvBuffer);
+	FileClose(&tFile);
+	if (iResult == 0) {
+		FAILHARD("readfile %s: FileRead returned an error", pszPath);
+		return false;
+	}
+
+	MESSAGE("File %s read", pszPath);
+	return true;
+}
+
+bool fatfs::allocfile(size_t sizData, char* pszPath, char** ppcData){
+	FILE_STRUCT tFile;
+	int iResult;
+	unsigned long ulSector;
+	unsigned long ulSectors;
+	char* pcData;
+
+	*ppcData = NULL;
+	if (!checkReady()) return false;
+	if (sizData > FILE_MAX_SIZE) {
+		FAILHARD("allocfile %s: file too large for FAT", pszPath);
+		return false;
+	}
+	if (!checkNotOpen("allocfile", pszPath)) return false;
+	iResult = FileCreate(m_ptRamDiskPartition, pszPath, &tFile);
+	if (iResult==0) {
+		FAILHARD("allocfile %s: FileCreate failed", pszPath);
+		return false;
+	}
+
+	pcData = NULL;
+	if (FilePreallocate(&tFile, (unsigned long) sizData)) {
+		ulSectors = (unsigned long) ((sizData + m_ptRamDiskPartition->bytesPerSector - 1) / m_ptRamDiskPartition->bytesPerSector);
+		ulSector = _FAT_fat_clusterToSector(m_ptRamDiskPartition, tFile.ulStartCluster);
+		pcData = (char*) _FAT_cache_mapSectors(m_ptRamDiskPartition->cache, ulSector, ulSectors);
+		if (pcData != NULL) {
+			/* the caller copies the file contents into the sectors */
+			_FAT_cache_markWritten(m_ptRamDiskPartition->cache, ulSector, ulSectors);
+		}
+	}
+	if (pcData != NULL) {
+		tFile.ulFilesize = (unsigned long) sizData;
+	}
+
+	iResult = FileClose(&tFile);
+	if (iResult==0) {
+		FAILHARD("allocfile %s: FileClose failed", pszPath);
+		return false;
+	}
+
+	*ppcData = pcData;
+	return true;
+}
+
+unsigned long long fatfs::getfreespace() {
+	if (!checkReady()) return 0;
+	return GetFreeDiskSpace(m_ptRamDiskPartition);
+}
+
+
+bool fatfs::getStats(FAT_STATS *ptStats) {
+#ifdef FAT_STATS_ENABLED
+	*ptStats = m_tStats;
+	return true;
+#else
+	memset(ptStats, 0, sizeof(FAT_STATS));
+	return false;
+#endif
 }
 
 
@@ -418,61 +1331,248 @@ bool fatfs::getnextdirentry(DIR_ENTRY *ptDirEntry) {
 }
 
 
-bool fatfs::dir(char* pszPath, u32 dircluster, bool fRecursive){
+bool fatfs::listdir(u32 dircluster, FATFS_DIRLIST_T *ptList){
 	DIR_ENTRY tDirEntry;
+	FATFS_DIRENTRY_T tEntry;
+	size_t sizLen;
 
-	MESSAGE("Directory '%s'", pszPath);
+	ptList->atEntries.clear();
+	ptList->acNames.clear();
 
-	/* 1 list subdirs */
-	if (!getfirstdirentry(&tDirEntry, dircluster)){
-		FAILHARD("_FAT_directory_getFirstEntry failed");
-		return false;
+	/* a directory without any entry has no first entry */
+	if (!getfirstdirentry(&tDirEntry, dircluster)) {
+		return true;
 	}
 	do {
-		if (_FAT_directory_isDirectory(&tDirEntry)) {
-			MESSAGE("  DIR         %-15s", tDirEntry.filename);
-		}
+		sizLen = strlen(tDirEntry.filename) + 1;
+		tEntry.sizName     = ptList->acNames.size();
+		ptList->acNames.insert(ptList->acNames.end(), tDirEntry.filename, tDirEntry.filename + sizLen);
+		tEntry.ulSize      = u8array_to_u32(tDirEntry.entryData, DIR_ENTRY_fileSize);
+		tEntry.ulCluster   = _FAT_directory_entryGetCluster(tDirEntry.entryData);
+		tEntry.usCTime     = u8array_to_u16(tDirEntry.entryData, DIR_ENTRY_cTime);
+		tEntry.usCDate     = u8array_to_u16(tDirEntry.entryData, DIR_ENTRY_cDate);
+		tEntry.usMTime     = u8array_to_u16(tDirEntry.entryData, DIR_ENTRY_mTime);
+		tEntry.usMDate     = u8array_to_u16(tDirEntry.entryData, DIR_ENTRY_mDate);
+		tEntry.bAttributes = tDirEntry.entryData[DIR_ENTRY_attributes];
+		ptList->atEntries.push_back(tEntry);
 	} while (getnextdirentry(&tDirEntry));
 
-	/* 2 list the files */
-	if (!getfirstdirentry(&tDirEntry, dircluster)){
-		FAILHARD("_FAT_directory_getFirstEntry failed");
+	/* directories first, the order within both groups is kept */
+	std::stable_partition(ptList->atEntries.begin(), ptList->atEntries.end(),
+		[](const FATFS_DIRENTRY_T &tE) { return (tE.bAttributes & ATTRIB_DIR) != 0; });
+	return true;
+}
+
+
+/* FAT date and time as ISO 8601, false if the date is not set */
+static bool formatFatTime(char *pszBuf, size_t sizBuf, unsigned short usDate, unsigned short usTime){
+	if (usDate == 0) {
 		return false;
 	}
-	do {
-		if (!_FAT_directory_isDirectory(&tDirEntry)) {
-			MESSAGE("  %-10d  %-15s", getfilesize(&tDirEntry), tDirEntry.filename);
+	snprintf(pszBuf, sizBuf, "%04u-%02u-%02uT%02u:%02u:%02u",
+		1980U + (usDate >> 9), (usDate >> 5) & 0x0fU, usDate & 0x1fU,
+		usTime >> 11, (usTime >> 5) & 0x3fU, (usTime & 0x1fU) * 2);
+	return true;
+}
+
+static void appendJsonString(std::string &strOut, const char *pszText){
+	char acEscape[8];
+
+	strOut += '"';
+	for (; *pszText != 0; ++pszText) {
+		if (*pszText == '"' || *pszText == '\\') {
+			strOut += '\\';
+			strOut += *pszText;
+		} else if ((unsigned char) *pszText < 0x20) {
+			snprintf(acEscape, sizeof(acEscape), "\\u%04x", (unsigned char) *pszText);
+			strOut += acEscape;
+		} else {
+			strOut += *pszText;
 		}
-	} while (getnextdirentry(&tDirEntry));
+	}
+	strOut += '"';
+}
 
-	/* 3 recurse into subdirs */
-	if (fRecursive) {
-		if (!getfirstdirentry(&tDirEntry, dircluster)){
-			FAILHARD("_FAT_directory_getFirstEntry failed");
+static void appendCsvField(std::string &strOut, const char *pszText){
+	if (strpbrk(pszText, ",\"\r\n") == NULL) {
+		strOut += pszText;
+		return;
+	}
+	strOut += '"';
+	for (; *pszText != 0; ++pszText) {
+		if (*pszText == '"') {
+			strOut += '"';
+		}
+		strOut += *pszText;
+	}
+	strOut += '"';
+}
+
+/*
+	Prints a record for every entry of the directory and, if fRecursive is set,
+	of its subdirectories. A JSON record is held back in strPending until the
+	next one shows that it needs a comma.
+*/
+bool fatfs::printDirRecords(const std::string &strPath, u32 dircluster, bool fRecursive, Dirformats tFormat, FILE *ptRecords, std::string &strPending){
+	FATFS_DIRLIST_T tList;
+	std::string strEntryPath;
+	std::string strRecord;
+	char acCreated[24];
+	char acModified[24];
+	char acNumbers[64];
+	const char *pszName;
+	bool fIsDir;
+	bool fCreated;
+	bool fModified;
+
+	if (!listdir(dircluster, &tList)) {
+		return false;
+	}
+
+	for (const FATFS_DIRENTRY_T &tEntry : tList.atEntries) {
+		pszName = &tList.acNames[tEntry.sizName];
+		if (strcmp(pszName, ".") == 0 || strcmp(pszName, "..") == 0) {
+			continue;
+		}
+		fIsDir = (tEntry.bAttributes & ATTRIB_DIR) != 0;
+		strEntryPath = strPath;
+		if (strEntryPath.empty() || strEntryPath[strEntryPath.size() - 1] != '/') {
+			strEntryPath += '/';
+		}
+		strEntryPath += pszName;
+		fCreated = formatFatTime(acCreated, sizeof(acCreated), tEntry.usCDate, tEntry.usCTime);
+		fModified = formatFatTime(acModified, sizeof(acModified), tEntry.usMDate, tEntry.usMTime);
+
+		strRecord.clear();
+		if (tFormat == DIR_JSON) {
+			strRecord += "  {\"path\":";
+			appendJsonString(strRecord, strEntryPath.c_str());
+			snprintf(acNumbers, sizeof(acNumbers), ",\"type\":\"%s\",\"attributes\":%u,\"size\":%lu,\"cluster\":%lu",
+				fIsDir ? "dir" : "file", tEntry.bAttributes, tEntry.ulSize, tEntry.ulCluster);
+			strRecord += acNumbers;
+			strRecord += ",\"created\":";
+			strRecord += fCreated ? std::string("\"") + acCreated + "\"" : std::string("null");
+			strRecord += ",\"modified\":";
+			strRecord += fModified ? std::string("\"") + acModified + "\"" : std::string("null");
+			strRecord += "}";
+			if (!strPending.empty()) {
+				fprintf(ptRecords, "%s,\n", strPending.c_str());
+			}
+			strPending.swap(strRecord);
+		} else {
+			appendCsvField(strRecord, strEntryPath.c_str());
+			snprintf(acNumbers, sizeof(acNumbers), ",%s,%u,%lu,%lu,",
+				fIsDir ? "dir" : "file", tEntry.bAttributes, tEntry.ulSize, tEntry.ulCluster);
+			strRecord += acNumbers;
+			strRecord += fCreated ? acCreated : "";
+			strRecord += ",";
+			strRecord += fModified ? acModified : "";
+			fprintf(ptRecords, "%s\n", strRecord.c_str());
+		}
+
+		if (fRecursive && fIsDir && !printDirRecords(strEntryPath, tEntry.ulCluster, fRecursive, tFormat, ptRecords, strPending)) {
 			return false;
 		}
-		do {
-			if (_FAT_directory_isDirectory(&tDirEntry) && !_FAT_directory_isDot(&tDirEntry)) {
-				if (!dir(tDirEntry.filename, 
-						_FAT_directory_entryGetCluster (tDirEntry.entryData),
-						fRecursive)) 
-				{
+	}
+	return true;
+}
+
+bool fatfs::opendir(char* pszPath, FATFS_DIR_T *ptDir){
+	memset(ptDir, 0, sizeof(FATFS_DIR_T));
+	if (!checkReady()) return false;
+	if (pszPath == NULL || !get_dir_start_cluster(pszPath, &ptDir->ulCluster)) {
+		return false;
+	}
+	ptDir->fOpen = true;
+	return true;
+}
+
+bool fatfs::readdir(FATFS_DIR_T *ptDir){
+	bool fFound;
+
+	if (!ptDir->fOpen || !checkReady()) return false;
+	do {
+		if (ptDir->fStarted) {
+			fFound = getnextdirentry(&ptDir->tEntry);
+		} else {
+			fFound = getfirstdirentry(&ptDir->tEntry, ptDir->ulCluster);
+			ptDir->fStarted = true;
+		}
+	} while (fFound && _FAT_directory_isDot(&ptDir->tEntry));
+
+	if (!fFound) {
+		/* the end stays the end */
+		ptDir->fOpen = false;
+	}
+	return fFound;
+}
+
+void fatfs::closedir(FATFS_DIR_T *ptDir){
+	ptDir->fOpen = false;
+}
+
+bool fatfs::dir(char* pszPath, u32 dircluster, bool fRecursive, Dirformats tFormat, FILE *ptRecords){
+	FATFS_DIRLIST_T tList;
+	std::string strPending;
+	const char *pszName;
+	bool fOk;
+
+	if (tFormat == DIR_JSON || tFormat == DIR_CSV) {
+		if (tFormat == DIR_JSON) {
+			fputs("[\n", ptRecords);
+			fOk = printDirRecords(pszPath, dircluster, fRecursive, tFormat, ptRecords, strPending);
+			if (!strPending.empty()) {
+				fprintf(ptRecords, "%s\n", strPending.c_str());
+			}
+			fputs("]\n", ptRecords);
+		} else {
+			fputs("path,type,attributes,size,cluster,created,modified\n", ptRecords);
+			fOk = printDirRecords(pszPath, dircluster, fRecursive, tFormat, ptRecords, strPending);
+		}
+		if (fflush(ptRecords) != 0 || ferror(ptRecords)) {
+			FAILHARD("dir: could not write the records");
+			fOk = false;
+		}
+		return fOk;
+	}
+
+	MESSAGE("Directory '%s'", pszPath);
+
+	/* read the directory once, it holds the subdirectories first */
+	if (!listdir(dircluster, &tList)) {
+		return false;
+	}
+	for (const FATFS_DIRENTRY_T &tEntry : tList.atEntries) {
+		pszName = &tList.acNames[tEntry.sizName];
+		if (tEntry.bAttributes & ATTRIB_DIR) {
+			MESSAGE("  DIR         %-15s", pszName);
+		} else {
+			MESSAGE("  %-10lu  %-15s", tEntry.ulSize, pszName);
+		}
+	}
+
+	/* recurse into subdirs */
+	if (fRecursive) {
+		for (const FATFS_DIRENTRY_T &tEntry : tList.atEntries) {
+			pszName = &tList.acNames[tEntry.sizName];
+			if ((tEntry.bAttributes & ATTRIB_DIR) && strcmp(pszName, ".") != 0 && strcmp(pszName, "..") != 0) {
+				if (!dir((char*) pszName, tEntry.ulCluster, fRecursive, DIR_TEXT)) {
 					return false;
 				}
 			}
-		} while (getnextdirentry(&tDirEntry));
+		}
 	}
 	return true;
 }
 
-bool fatfs::dir(char* pszPath, bool fRecursive){
+bool fatfs::dir(char* pszPath, bool fRecursive, Dirformats tFormat, FILE *ptRecords){
 	u32 ulDirCluster;
 	if (!checkReady()) return false;
 	if (pszPath == NULL) {
 		return false;
 	}
 	if (get_dir_start_cluster(pszPath, &ulDirCluster)){
-		return dir(pszPath, ulDirCluster, fRecursive);
+		return dir(pszPath, ulDirCluster, fRecursive, tFormat, ptRecords);
 	} else {
 		return false;
 	}
@@ -5,10 +5,17 @@ extern "C" {
 #       include "fat/partition.h"
 #       include "fat/disk_io.h"
 #       include "fat/directory.h"
+#       include "fat/file_functions.h"
+#       include "fat/stats.h"
+#       include "ramdisk/interface.h"
+#       include "ramdisk/mmap.h"
+#       include "ramdisk/filedisk.h"
 }
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <string>
+#include <vector>
 
 /* GCC complains if you leave out the variable argument in a variadic macro completely.
  * The token paste operator '##' prevents the error.
@@ -31,6 +38,45 @@ extern "C" {
 typedef void (*FN_FATFS_ERROR_HANDLER)(void *pvUser, const char* strFormat, ...);
 typedef void (*FN_FATFS_VPRINTF)(void *pvUser, const char* strFormat, ...);
 
+/* receives one piece of a file, returns false to stop reading */
+typedef bool (*FN_FATFS_READ_CALLBACK)(void *pvUser, const char *pcData, size_t sizData);
+
+/* one entry of a directory listing, the name is stored in the name pool of the listing */
+typedef struct
+{
+	size_t sizName;			// offset of the zero terminated name in acNames
+	unsigned long ulSize;
+	unsigned long ulCluster;
+	unsigned short usCTime;	// FAT time and date stamps
+	unsigned short usCDate;
+	unsigned short usMTime;
+	unsigned short usMDate;
+	unsigned char bAttributes;
+} FATFS_DIRENTRY_T;
+
+typedef struct
+{
+	std::vector<FATFS_DIRENTRY_T> atEntries;	// directories first, then files, each in directory order
+	std::vector<char> acNames;
+} FATFS_DIRLIST_T;
+
+/* cursor over the entries of a directory, see opendir */
+typedef struct
+{
+	DIR_ENTRY tEntry;		// the current entry after readdir returned true
+	u32 ulCluster;			// first cluster of the directory
+	bool fOpen;
+	bool fStarted;			// tEntry holds a position in the directory
+} FATFS_DIR_T;
+
+/* handle of an open file, see open */
+typedef struct
+{
+	FILE_STRUCT tFile;
+	bool fOpen;
+	bool fWrite;			// opened with OPEN_WRITE or OPEN_CREATE
+} FATFS_FILE_T;
+
 class fatfs
 {
 public:
@@ -59,6 +105,47 @@ public:
 	*/
 	bool mount(const char* pabData, size_t sizDataLen, size_t sizOffset);
 
+	/*
+		Mounts a filesystem in an image file without copying it.
+		The file is mapped into memory and only the accessed pages are read.
+		fReadOnly == false: all changes are written to the file.
+		fReadOnly == true:  changes are kept in memory, the file is not modified.
+	*/
+	bool mountFile(const char* pszFilename, size_t sizOffset, bool fReadOnly);
+
+	/*
+		Creates an image file and formats a FAT file system in it like create().
+		The image is not kept in memory, the sectors are read and written in the
+		file as they are used. The unused parts of the image are zeros, not 0xff.
+	*/
+	bool createPath(const char* pszFilename, size_t sizSectorSize, size_t sizNumSectors, size_t sizTotalSize, size_t sizOffset);
+
+	/*
+		Mounts a filesystem in an image file without loading it into memory.
+		Only the sectors in use are read, recently used sectors are cached.
+		fReadOnly == false: all changes are written to the file.
+		fReadOnly == true:  the file system can not be modified.
+	*/
+	bool mountPath(const char* pszFilename, size_t sizOffset, bool fReadOnly);
+
+	/*
+		Writes all changes back to the mounted image file.
+		Returns true without doing anything if the image is not a shared mapping
+		or an image file.
+	*/
+	bool sync();
+
+	/*
+		Writes the whole image to a file.
+		Unlike getimage, this also works if the image is not in memory.
+		fTrim: cut off the erased part at the end. For an image created here
+		       this is everything behind the highest byte written, a mounted
+		       image is scanned for trailing 0xff sectors.
+		fSparse: blocks of zeros become holes in the file.
+		returns true if successful
+	*/
+	bool saveimage(const char* pszFilename, bool fTrim = false, bool fSparse = false);
+
 	/*
 		Check if m_PACKED_PST is true. If not, print a warning.
 		Returns the value of PACKED_PST.
@@ -76,9 +163,14 @@ public:
 	~fatfs();
 
 	/*
-		Returns the whole image
+		Returns true if the image is in memory, false if it is accessed in the file (see mountPath)
+	*/
+	bool isinmemory();
+
+	/*
+		Returns the whole image, or NULL if the image is not in memory (see mountPath)
 	*/
-	char* getimage(unsigned long *pulSize);
+	char* getimage(size_t *psizSize);
 
 	/*
 		Writes raw data into the image (for 2nd stage loader)
@@ -88,27 +180,109 @@ public:
 
 	/* 
 		Reads raw data from the image
+		If the image is not in memory, the data is valid until the next readraw.
 	*/
 	char* readraw(size_t sizOffset, size_t sizLen);
 
 	/*
 		Creates a file with the given name/path containing the given data
+		An existing file keeps its directory entry and its clusters are
+		overwritten in place, only the end of the cluster chain is extended
+		or freed.
 		returns true if successful
 	*/
 	bool writefile(const char* pabData, size_t sizFileLen, char* pszPath);
 
+	/*
+		Creates a file with the given name/path and size and allocates its clusters
+		in one piece, without writing any data.
+		*ppcData is set to the file's data in the image, the caller copies sizFileLen
+		bytes there. If the clusters can not be allocated in one piece or the image
+		is not in memory, *ppcData is NULL and the file is empty.
+		returns true if successful
+	*/
+	bool allocfile(size_t sizFileLen, char* pszPath, char** ppcData);
+
 	/*
 		If the file exists, the contents are read into a newly-allocated buffer and
 		its address and size are returned. Otherwise, returns NULL.
 	*/
 	char* readfile(char* pszPath, size_t *psizLen);
 
+	/*
+		Reads the file at the given path piece by piece and passes the pieces to
+		pfnCallback. If the image is in memory, the pieces point directly into the
+		image, otherwise they are read into a small buffer. No copy of the whole
+		file is made.
+		returns true if the whole file was passed to pfnCallback
+	*/
+	bool readfile(char* pszPath, FN_FATFS_READ_CALLBACK pfnCallback, void *pvCallbackUser);
+
 	/*
 		Delets a file at the given path
 		returns true if the file could be deleted, false if it does not exist or if an error occurred.
 	*/
 	bool deletefile(char* pszPath);
 
+	enum Openmodes {OPEN_READ, OPEN_WRITE, OPEN_CREATE};
+
+	/*
+		Opens the file at pszPath and sets the position to the start.
+		OPEN_READ:   the file must exist, it can only be read
+		OPEN_WRITE:  the file must exist, writes overwrite its clusters in place
+		             and append new clusters only behind the end
+		OPEN_CREATE: like OPEN_WRITE, an existing file is cut to 0 bytes,
+		             a missing file is created
+		ptFile is provided by the caller. Changes are written to the directory
+		entry and the image by close, which must be called before the image is
+		changed by create, mount or writeraw.
+		A file can only have one open handle. While it is open, writefile,
+		allocfile and deletefile refuse the file.
+		returns true if successful
+	*/
+	bool open(char* pszPath, Openmodes tMode, FATFS_FILE_T *ptFile);
+
+	/*
+		Moves the position to ulPosition, which must not be behind the end of the file.
+		The handle records the runs of adjacent clusters it passes, so each
+		link of the cluster chain is followed once and later seeks are a
+		binary search over the runs.
+		returns true if successful
+	*/
+	bool seek(FATFS_FILE_T *ptFile, unsigned long ulPosition);
+
+	/* returns the position */
+	unsigned long tell(FATFS_FILE_T *ptFile);
+
+	/* returns the file size including all writes so far */
+	unsigned long size(FATFS_FILE_T *ptFile);
+
+	/*
+		Reads up to sizLen bytes from the position into pcBuffer.
+		returns the number of bytes read, 0 at the end of the file, -1 on errors
+	*/
+	long long read(FATFS_FILE_T *ptFile, char *pcBuffer, size_t sizLen);
+
+	/*
+		Writes sizData bytes at the position and moves the position behind them.
+		returns true if all bytes were written
+	*/
+	bool write(FATFS_FILE_T *ptFile, const char *pcData, size_t sizData);
+
+	/*
+		Sets the file size. A smaller size frees the clusters behind the new end,
+		a larger size appends zeros.
+		returns true if successful
+	*/
+	bool truncate(FATFS_FILE_T *ptFile, unsigned long ulSize);
+
+	/*
+		Writes the size and first cluster to the directory entry if they changed
+		and flushes the FAT and the cache. The handle can not be used afterwards.
+		returns true if successful
+	*/
+	bool close(FATFS_FILE_T *ptFile);
+
 
 	enum Filetypes {TYPE_NONE, TYPE_FILE, TYPE_DIRECTORY};
 
@@ -138,31 +312,81 @@ public:
 	/* 
 		Get file size. Returns -1 if an error occurred.
 	*/
-	long getfilesize(char* pszPath);
+	long long getfilesize(char* pszPath);
 
 
+	/*
+		Returns the number of free bytes in the file system.
+	*/
+	unsigned long long getfreespace();
+
+	/*
+		Copies the counters of the disc accesses and FAT operations into
+		*ptStats. They start at 0 with each create and mount, so the
+		format done by create is included.
+		returns false if the library was built without FAT_STATS_ENABLED,
+		*ptStats is all zeros then
+	*/
+	bool getStats(FAT_STATS *ptStats);
+
     /*
 		Creates a directory at the given path
 		returns true if successful
 	*/
 	bool mkdir(char* pszPath);
 
+	/*
+		Makes room for ulEntries more entries in the directory at pszPath,
+		so its clusters are allocated in one piece before files are added.
+		returns true if successful
+	*/
+	bool reservedir(char* pszPath, unsigned long ulEntries);
+
 	/*
 		Sets path as the current directory.
 		Returns true if successful, false otherwise.
 	*/
 	bool cd(char* pszPath);
 
+	enum Dirformats {DIR_TEXT, DIR_JSON, DIR_CSV};
+
 	/*
 		prints a directory listing
+		DIR_JSON and DIR_CSV write one record per entry with the full path,
+		the attributes, the size, the first cluster and the time stamps to
+		ptRecords. They don't go through the message handler, so the stream
+		holds nothing but the records.
 	*/
-	bool dir(char* pszPath, bool fRecursive);
+	bool dir(char* pszPath, bool fRecursive, Dirformats tFormat = DIR_TEXT, FILE *ptRecords = stdout);
 
 	/*
 		prints the directory starting at a given cluster
 		pszPath is only printed
 	*/
-	bool dir(char* pszPath, u32 dircluster, bool fRecursive);
+	bool dir(char* pszPath, u32 dircluster, bool fRecursive, Dirformats tFormat = DIR_TEXT, FILE *ptRecords = stdout);
+
+	/*
+		reads all entries of the directory at dircluster in one pass
+		returns true if successful, an empty directory has no entries
+	*/
+	bool listdir(u32 dircluster, FATFS_DIRLIST_T *ptList);
+
+	/*
+		opens a cursor over the directory at pszPath, the path is resolved only here
+		ptDir is provided by the caller, it holds no other resources
+		the cursor must not be used after the image is changed by create, mount or writeraw
+		returns true if pszPath is a directory
+	*/
+	bool opendir(char* pszPath, FATFS_DIR_T *ptDir);
+
+	/*
+		moves the cursor to the next entry, . and .. are skipped
+		the entry is in ptDir->tEntry until the next call
+		returns false at the end of the directory
+	*/
+	bool readdir(FATFS_DIR_T *ptDir);
+
+	void closedir(FATFS_DIR_T *ptDir);
 
 	/*
 		Find first cluster of the directory at path.
@@ -199,10 +423,31 @@ private:
 	IO_INTERFACE			m_tIoIfRamdisk;
 	void*					m_pvDiskMem;
 	size_t					m_sizDiskMemSize;
+	bool					m_fMapped;
+	MMAPDISK_T				m_tMmapDisk;
+	bool					m_fFile;			// image is accessed in the file, m_pvDiskMem is NULL
+	FILEDISK_T				m_tFileDisk;
+	size_t					m_sizOffset;		// start of the partition in the image
+	char*					m_pcRawBuffer;		// readraw data if the image is not in memory
+	RAMDISK_T				m_tRamDisk;			// image made by create, the partition is erased lazily
+	size_t					m_sizHighWater;		// end of the data written by create/writeraw
+	bool					m_fHighWaterValid;	// the image was created here, nothing behind the high water mark was written
+	FAT_STATS				m_tStats;			// see getStats
+	std::vector<DIR_ENTRY_POSITION> m_atOpenFiles;	// alias entries of the files with an open handle
 
 	FN_FATFS_ERROR_HANDLER  m_pfnErrorHandler;
 	FN_FATFS_VPRINTF        m_pfnvprintf;
 	void*                   m_pvUser;
+	bool flush();
+	void setFormattedHighWater();
+	const char* getImageData(size_t sizPos, size_t sizLen, char *pcBuffer);
+	void materialize(size_t sizPos, size_t sizLen);
+	bool getImageEnd(size_t *psizEnd, char *pcBuffer);
+	bool mountFileDisk(const char* pszCaller, size_t sizSectorSize, size_t sizNumSectors, size_t sizOffset);
+	void resetStats();
+	size_t findOpenFile(const DIR_ENTRY_POSITION *ptPosition);
+	bool checkNotOpen(const char* pszCaller, const char* pszPath);
+	bool printDirRecords(const std::string &strPath, u32 dircluster, bool fRecursive, Dirformats tFormat, FILE *ptRecords, std::string &strPending);
 	static void error(void *pvUser, const char* strFmt, ...);
 	static void printMessage(void *pvUser, const char* strFmt, ...);
 
@@ -18,6 +18,64 @@ typedef struct
 } tBinaryDataFree;
 
 
+/***************************************************************************
+	Read callback
+	Appends a piece of a file to the Lua buffer
+***************************************************************************/
+bool fatfs_readfile_span(void* pvUser, const char* pcData, size_t sizData) {
+	luaL_addlstring((luaL_Buffer*)pvUser, pcData, sizData);
+	return true;
+}
+
+
+/***************************************************************************
+	Directory iterator
+	The closure returned by fs:direntries holds the cursor, the fatfs object,
+	which must stay alive, and the entry table that is filled for every step.
+***************************************************************************/
+typedef struct
+{
+	fatfs *pFS;
+	FATFS_DIR_T tDir;
+} tLuaDirCursor;
+
+static int fatfs_direntries_next(lua_State *L) {
+	tLuaDirCursor *ptCursor = (tLuaDirCursor*)lua_touserdata(L, lua_upvalueindex(1));
+	DIR_ENTRY *ptEntry = &ptCursor->tDir.tEntry;
+	bool fIsDir;
+
+	if (!ptCursor->pFS->readdir(&ptCursor->tDir)) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	fIsDir = _FAT_directory_isDirectory(ptEntry);
+	lua_pushvalue(L, lua_upvalueindex(3));
+	lua_pushstring(L, ptEntry->filename);
+	lua_setfield(L, -2, "name");
+	lua_pushboolean(L, fIsDir);
+	lua_setfield(L, -2, "isdir");
+	if (fIsDir) {
+		lua_pushnil(L);
+	} else {
+		lua_pushnumber(L, u8array_to_u32(ptEntry->entryData, DIR_ENTRY_fileSize));
+	}
+	lua_setfield(L, -2, "filesize");
+	lua_pushnumber(L, ptEntry->entryData[DIR_ENTRY_attributes]);
+	lua_setfield(L, -2, "attributes");
+	return 1;
+}
+
+
+/***************************************************************************
+	Stores a counter of fs:getstats in the table on top of the stack
+***************************************************************************/
+static void fatfs_setstat(lua_State *L, const char *pszName, u64 ullValue) {
+	lua_pushnumber(L, (lua_Number) ullValue);
+	lua_setfield(L, -2, pszName);
+}
+
+
 /***************************************************************************
 	Error Handler
 	Format the error message and push the formatted string on the Lua stack
@@ -109,7 +167,7 @@ void fatfs_snprintf(void* pvUser, const char* strFormat, ...) {
 /***************************************************************************
 	Return a number
 ***************************************************************************/
-%typemap(out) long
+%typemap(out) long long
 %{
 	if ($1>=0) {
 		lua_pushnumber(L, $1);
@@ -144,24 +202,55 @@ void fatfs_snprintf(void* pvUser, const char* strFormat, ...) {
 
 %feature("compactdefaultargs") create;
 %feature("compactdefaultargs") mount;
+%feature("compactdefaultargs") mountfile;
+%feature("compactdefaultargs") createpath;
+%feature("compactdefaultargs") mountpath;
 %feature("compactdefaultargs") fatfs::dir;
 %feature("compactdefaultargs") fatfs::cd;
 %feature("compactdefaultargs") fatfs::writefile;
+%feature("compactdefaultargs") fatfs::saveimage;
+%feature("compactdefaultargs") fatfs::open;
+%newobject fatfs::open;
+
+/* file handle returned by fs:open, its contents are not visible in Lua */
+%nodefaultctor FATFS_FILE_T;
+typedef struct {} FATFS_FILE_T;
+
+/* the handle may be collected after its fatfs object, only free its own memory */
+%extend FATFS_FILE_T {
+	~FATFS_FILE_T() {
+		FileFreeExtents(&self->tFile);
+		delete self;
+	}
+}
+
 class fatfs
 {
 public:
 	bool mkdir(char* pszPath);
+	bool reservedir(char* pszPath, unsigned long ulEntries);
 	bool cd(char* pszPath = "/" );//"\\");
-	bool dir(char* pszPath = ".", bool fRecursive = false);
+	enum Dirformats {DIR_TEXT, DIR_JSON, DIR_CSV};
+	bool dir(char* pszPath = ".", bool fRecursive = false, Dirformats tFormat = DIR_TEXT);
 	bool writefile(const char *pcData, size_t sizData, char* pszPath);
 	bool writeraw(const char *pcData, size_t sizData, size_t sizOffset);
 	bool deletefile(char* pszPath);
 	bool fileexists(char* pszPath);	
-	long getfilesize(char* pszPath);	
+	long long getfilesize(char* pszPath);	
+	unsigned long long getfreespace();
 	enum Filetypes {TYPE_NONE, TYPE_FILE, TYPE_DIRECTORY};
 	Filetypes gettype(char* pszPath);
 	bool isfile(char* pszPath);
 	bool isdir(char* pszPath);
+	bool sync();
+	bool saveimage(const char* pszFilename, bool fTrim = false, bool fSparse = false);
+	enum Openmodes {OPEN_READ, OPEN_WRITE, OPEN_CREATE};
+	bool seek(FATFS_FILE_T *ptFile, unsigned long ulPosition);
+	unsigned long tell(FATFS_FILE_T *ptFile);
+	unsigned long size(FATFS_FILE_T *ptFile);
+	bool write(FATFS_FILE_T *ptFile, const char *pcData, size_t sizData);
+	bool truncate(FATFS_FILE_T *ptFile, unsigned long ulSize);
+	bool close(FATFS_FILE_T *ptFile);
 };
 
 %extend fatfs {
@@ -191,12 +280,112 @@ public:
 		}
 	}
 	
-	tBinaryDataFree readfile(char* pszPath){
+	static fatfs* mountfile(lua_State *L, const char *pszFilename, size_t sizOffset = 0, bool fReadOnly = false){
+		fatfs* fs = new fatfs();
+		fs->setHandlers(fatfs_error_handler, fatfs_snprintf, L);
+		if (fs->mountFile(pszFilename, sizOffset, fReadOnly)) {
+			return fs;
+		} else {
+			delete fs;
+			return NULL;
+		}
+	}
+
+	static fatfs* createpath(lua_State *L, const char *pszFilename, size_t sizSectorSize, size_t sizNumSectors, size_t sizTotalSize = 0, size_t sizOffset = 0){
+		fatfs* fs = new fatfs();
+		fs->setHandlers(fatfs_error_handler, fatfs_snprintf, L);
+		if (fs->createPath(pszFilename, sizSectorSize, sizNumSectors, sizTotalSize, sizOffset)){
+			return fs;
+		} else {
+			delete fs;
+			return NULL;
+		}
+	}
+	static fatfs* mountpath(lua_State *L, const char *pszFilename, size_t sizOffset = 0, bool fReadOnly = false){
+		fatfs* fs = new fatfs();
+		fs->setHandlers(fatfs_error_handler, fatfs_snprintf, L);
+		if (fs->mountPath(pszFilename, sizOffset, fReadOnly)) {
+			return fs;
+		} else {
+			delete fs;
+			return NULL;
+		}
+	}
+	/*
+		The file is passed to Lua piece by piece,
+		there is no copy of the whole file in C.
+	*/
+	void readfile(lua_State *L, int *piNumResults, char* pszPath){
+		luaL_Buffer tBuffer;
+
+		*piNumResults = 0;
+		luaL_buffinit(L, &tBuffer);
+		if (self->readfile(pszPath, fatfs_readfile_span, &tBuffer)) {
+			luaL_pushresult(&tBuffer);
+			*piNumResults = 1;
+		}
+	}
+	
+	/*
+		The handle is freed by the garbage collector,
+		fs:close must be called before to update the directory entry.
+	*/
+	FATFS_FILE_T* open(char* pszPath, fatfs::Openmodes tMode = fatfs::OPEN_READ){
+		FATFS_FILE_T *ptFile = new FATFS_FILE_T;
+		if (self->open(pszPath, tMode, ptFile)) {
+			return ptFile;
+		} else {
+			delete ptFile;
+			return NULL;
+		}
+	}
+
+	/* returns nothing at the end of the file */
+	tBinaryDataFree read(FATFS_FILE_T *ptFile, size_t sizLen) {
 		tBinaryDataFree tData;
-		tData.pcData = self->readfile(pszPath, &tData.sizData);
+		long long llRead;
+
+		tData.sizData = 0;
+		tData.pcData = (char*)malloc(sizLen > 0 ? sizLen : 1);
+		if (tData.pcData != NULL) {
+			llRead = self->read(ptFile, tData.pcData, sizLen);
+			if (llRead > 0) {
+				tData.sizData = (size_t)llRead;
+			} else {
+				free(tData.pcData);
+				tData.pcData = NULL;
+			}
+		}
 		return tData;
 	}
-	
+
+	/*
+		Returns a table with the counters since the image was created or
+		mounted, nothing if the library was built without them.
+	*/
+	void getstats(lua_State *L, int *piNumResults){
+		FAT_STATS tStats;
+
+		*piNumResults = 0;
+		if (!self->getStats(&tStats)) return;
+
+		lua_newtable(L);
+		fatfs_setstat(L, "readcalls", tStats.readCalls);
+		fatfs_setstat(L, "readbytes", tStats.readBytes);
+		fatfs_setstat(L, "writecalls", tStats.writeCalls);
+		fatfs_setstat(L, "writebytes", tStats.writeBytes);
+		fatfs_setstat(L, "mapcalls", tStats.mapCalls);
+		fatfs_setstat(L, "partialreads", tStats.partialReads);
+		fatfs_setstat(L, "partialwrites", tStats.partialWrites);
+		fatfs_setstat(L, "fatlookups", tStats.nextClusterLookups);
+		fatfs_setstat(L, "fatwrites", tStats.fatWrites);
+		fatfs_setstat(L, "freeclusterprobes", tStats.freeClusterProbes);
+		fatfs_setstat(L, "direntriesscanned", tStats.dirEntriesScanned);
+		fatfs_setstat(L, "heapcurrent", tStats.heapCurrent);
+		fatfs_setstat(L, "heappeak", tStats.heapPeak);
+		*piNumResults = 1;
+	}
+
 	tBinaryData readraw(size_t sizOffset, size_t sizLen) {
 		tBinaryData tData;
 		tData.pcData = self->readraw(sizOffset, sizLen);
@@ -206,11 +395,35 @@ public:
 	
 	tBinaryData getimage(){
 		tBinaryData tData;	
-		tData.pcData = self->getimage((unsigned long*) &tData.sizData);
+		tData.pcData = self->getimage(&tData.sizData);
 		return tData;
 	}
 
 
+	/*
+		Returns an iterator for a generic for:
+		for entry in fs:direntries(path) do ... end
+		The same entry table is returned for every step.
+		A path which is not a directory raises an error, a for loop
+		can't handle a missing iterator.
+	*/
+	void direntries(lua_State *L, int *piNumResults, char* pszPath){
+		tLuaDirCursor *ptCursor;
+
+		*piNumResults = 0;
+		ptCursor = (tLuaDirCursor*)lua_newuserdata(L, sizeof(tLuaDirCursor));
+		ptCursor->pFS = self;
+		if (!self->opendir(pszPath, &ptCursor->tDir)) {
+			luaL_error(L, "direntries: %s is not a directory", pszPath);
+			return;
+		}
+		/* self is the first argument */
+		lua_pushvalue(L, 1);
+		lua_newtable(L);
+		lua_pushcclosure(L, fatfs_direntries_next, 3);
+		*piNumResults = 1;
+	}
+
 	/* 
 		L: in
 		piNumResults: out
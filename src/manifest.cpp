@@ -0,0 +1,472 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include "fat_tool.h"
+#include "manifest.h"
+
+/* upper limit for the number of threads copying file data */
+#define MANIFEST_MAX_THREADS 64
+
+
+typedef struct
+{
+	char *pszSource;       /* host file, NULL for a directory */
+	char *pszDest;         /* absolute path in the file system */
+	size_t sizParentLen;   /* length of the parent directory at the start of pszDest, 0 for the root */
+	size_t sizFile;        /* size of the host file */
+	char *pcData;          /* the file's clusters in the image, NULL if it was written with writefile */
+} MANIFEST_ENTRY_T;
+
+typedef struct
+{
+	MANIFEST_ENTRY_T *ptEntries;
+	size_t sizEntries;
+	size_t sizAllocated;
+} MANIFEST_T;
+
+
+/*
+	Splits the next token off the line. A token ends at white space
+	or is enclosed in double quotes.
+	returns the token or NULL if the line has no more tokens
+*/
+static char* nextToken(char **ppszLine){
+	char *pszPos;
+	char *pszToken;
+
+	pszPos = *ppszLine;
+	while (*pszPos==' ' || *pszPos=='\t' || *pszPos=='\r' || *pszPos=='\n') {
+		pszPos++;
+	}
+
+	if (*pszPos=='\0') {
+		pszToken = NULL;
+	} else if (*pszPos=='"') {
+		pszToken = ++pszPos;
+		while (*pszPos!='\0' && *pszPos!='"') {
+			pszPos++;
+		}
+	} else {
+		pszToken = pszPos;
+		while (*pszPos!='\0' && *pszPos!=' ' && *pszPos!='\t' && *pszPos!='\r' && *pszPos!='\n') {
+			pszPos++;
+		}
+	}
+
+	if (*pszPos!='\0') {
+		*pszPos++ = '\0';
+	}
+	*ppszLine = pszPos;
+	return pszToken;
+}
+
+
+/* returns true if the entry was added */
+static bool addEntry(MANIFEST_T *ptManifest, const char *pszSource, const char *pszDest, size_t sizFile){
+	MANIFEST_ENTRY_T *ptEntries;
+	MANIFEST_ENTRY_T *ptEntry;
+	char *pszSlash;
+	size_t sizLen;
+
+	if (ptManifest->sizEntries == ptManifest->sizAllocated) {
+		sizLen = (ptManifest->sizAllocated==0) ? 64 : ptManifest->sizAllocated * 2;
+		ptEntries = (MANIFEST_ENTRY_T*) realloc(ptManifest->ptEntries, sizLen * sizeof(MANIFEST_ENTRY_T));
+		if (ptEntries == NULL) {
+			fprintf(g_ptStatus, "could not allocate the manifest entries\n");
+			return false;
+		}
+		ptManifest->ptEntries = ptEntries;
+		ptManifest->sizAllocated = sizLen;
+	}
+
+	/* all paths start at the root directory and have exactly one leading '/' */
+	while (*pszDest=='/') {
+		pszDest++;
+	}
+	sizLen = strlen(pszDest);
+	while (sizLen>0 && pszDest[sizLen-1]=='/') {
+		sizLen--;
+	}
+	if (sizLen==0) {
+		fprintf(g_ptStatus, "The destination path is empty\n");
+		return false;
+	}
+
+	ptEntry = &ptManifest->ptEntries[ptManifest->sizEntries];
+	ptEntry->pszDest = (char*) malloc(sizLen + 2);
+	ptEntry->pszSource = (pszSource==NULL) ? NULL : strdup(pszSource);
+	if (ptEntry->pszDest==NULL || (pszSource!=NULL && ptEntry->pszSource==NULL)) {
+		fprintf(g_ptStatus, "could not allocate the manifest entries\n");
+		free(ptEntry->pszDest);
+		free(ptEntry->pszSource);
+		return false;
+	}
+	ptEntry->pszDest[0] = '/';
+	memcpy(ptEntry->pszDest + 1, pszDest, sizLen);
+	ptEntry->pszDest[sizLen + 1] = '\0';
+
+	pszSlash = strrchr(ptEntry->pszDest, '/');
+	ptEntry->sizParentLen = pszSlash - ptEntry->pszDest;
+	ptEntry->sizFile = sizFile;
+	ptEntry->pcData = NULL;
+
+	ptManifest->sizEntries++;
+	return true;
+}
+
+
+static void freeManifest(MANIFEST_T *ptManifest){
+	size_t sizCnt;
+
+	for (sizCnt = 0; sizCnt < ptManifest->sizEntries; sizCnt++) {
+		free(ptManifest->ptEntries[sizCnt].pszSource);
+		free(ptManifest->ptEntries[sizCnt].pszDest);
+	}
+	free(ptManifest->ptEntries);
+	ptManifest->ptEntries = NULL;
+	ptManifest->sizEntries = 0;
+	ptManifest->sizAllocated = 0;
+}
+
+
+/*
+	Reads the manifest. All host files are checked before
+	anything is written into the file system.
+	returns: 0=ok, >0=error
+*/
+static int readManifest(MANIFEST_T *ptManifest, const char *pszManifest){
+	FILE *fd;
+	char acLine[4096];
+	char *pszLine;
+	char *pszSource;
+	char *pszDest;
+	unsigned long ulLine;
+	struct stat tStatBuf;
+	int iResult;
+
+	fd = fopen(pszManifest, "r");
+	if (fd==NULL) {
+		fprintf(g_ptStatus, "Could not open manifest %s\n", pszManifest);
+		return 1;
+	}
+
+	iResult = 0;
+	ulLine = 0;
+	while (iResult==0 && fgets(acLine, sizeof(acLine), fd)!=NULL) {
+		ulLine++;
+		if (strchr(acLine, '\n')==NULL && !feof(fd)) {
+			fprintf(g_ptStatus, "%s:%lu: line too long\n", pszManifest, ulLine);
+			iResult = 1;
+			break;
+		}
+
+		/* Leave out blank lines or lines starting with '#'. */
+		pszLine = acLine;
+		pszSource = nextToken(&pszLine);
+		if (pszSource==NULL || pszSource[0]=='#') {
+			continue;
+		}
+		pszDest = nextToken(&pszLine);
+
+		if (nextToken(&pszLine)!=NULL) {
+			fprintf(g_ptStatus, "%s:%lu: too many arguments\n", pszManifest, ulLine);
+			iResult = 1;
+		} else if (pszDest==NULL) {
+			/* a single path is a directory */
+			if (pszSource[strlen(pszSource)-1]!='/') {
+				fprintf(g_ptStatus, "%s:%lu: a directory must end with '/'\n", pszManifest, ulLine);
+				iResult = 1;
+			} else if (!addEntry(ptManifest, NULL, pszSource, 0)) {
+				iResult = 1;
+			}
+		} else if (pszDest[strlen(pszDest)-1]=='/') {
+			fprintf(g_ptStatus, "%s:%lu: the destination of %s is a directory\n", pszManifest, ulLine, pszSource);
+			iResult = 1;
+		} else if (stat(pszSource, &tStatBuf)!=0) {
+			fprintf(g_ptStatus, "%s:%lu: Failed to stat file %s: %s\n", pszManifest, ulLine, pszSource, strerror(errno));
+			iResult = 1;
+		}
+#ifdef __GNUC__
+		else if (S_ISREG(tStatBuf.st_mode)==0) {
+			fprintf(g_ptStatus, "%s:%lu: The path %s does not point to a regular file!\n", pszManifest, ulLine, pszSource);
+			iResult = 1;
+		}
+#endif
+		else if (!addEntry(ptManifest, pszSource, pszDest, (size_t) tStatBuf.st_size)) {
+			iResult = 1;
+		}
+	}
+
+	fclose(fd);
+	return iResult;
+}
+
+
+/* Sort by parent directory, then by name. Parents come before their subdirectories. */
+static int compareEntries(const void *pvEntry1, const void *pvEntry2){
+	const MANIFEST_ENTRY_T *ptEntry1 = (const MANIFEST_ENTRY_T*) pvEntry1;
+	const MANIFEST_ENTRY_T *ptEntry2 = (const MANIFEST_ENTRY_T*) pvEntry2;
+	size_t sizLen;
+	int iResult;
+
+	sizLen = (ptEntry1->sizParentLen < ptEntry2->sizParentLen) ? ptEntry1->sizParentLen : ptEntry2->sizParentLen;
+	iResult = strncmp(ptEntry1->pszDest, ptEntry2->pszDest, sizLen);
+	if (iResult==0) {
+		iResult = (ptEntry1->sizParentLen > ptEntry2->sizParentLen) - (ptEntry1->sizParentLen < ptEntry2->sizParentLen);
+	}
+	if (iResult==0) {
+		iResult = strcmp(ptEntry1->pszDest + sizLen, ptEntry2->pszDest + sizLen);
+	}
+	return iResult;
+}
+
+
+static bool isSameParent(const MANIFEST_ENTRY_T *ptEntry1, const MANIFEST_ENTRY_T *ptEntry2){
+	return ptEntry1->sizParentLen==ptEntry2->sizParentLen &&
+		0==strncmp(ptEntry1->pszDest, ptEntry2->pszDest, ptEntry1->sizParentLen);
+}
+
+
+/* creates the directory pszPath and all missing directories above it */
+static bool makeDirs(fatfs *pFS, char *pszPath){
+	char *pszPos;
+	bool fOk;
+
+	fOk = true;
+	pszPos = pszPath + 1;
+	do {
+		pszPos = strchr(pszPos, '/');
+		if (pszPos!=NULL) {
+			*pszPos = '\0';
+		}
+
+		switch (pFS->gettype(pszPath)) {
+		case fatfs::TYPE_NONE:
+			fOk = pFS->mkdir(pszPath);
+			break;
+		case fatfs::TYPE_FILE:
+			fprintf(g_ptStatus, "%s is a file, not a directory\n", pszPath);
+			fOk = false;
+			break;
+		case fatfs::TYPE_DIRECTORY:
+			break;
+		}
+
+		if (pszPos!=NULL) {
+			*pszPos++ = '/';
+		}
+	} while (fOk && pszPos!=NULL);
+
+	return fOk;
+}
+
+
+typedef struct
+{
+	MANIFEST_T *ptManifest;
+	std::atomic<size_t> sizNext;
+	std::atomic<bool> fFailed;
+} COPY_STATE_T;
+
+
+/* reads a host file directly into its clusters in the image */
+static bool copyFile(const MANIFEST_ENTRY_T *ptEntry){
+	FILE *fd;
+	size_t sizRead;
+	bool fOk;
+
+	fd = fopen(ptEntry->pszSource, "rb");
+	if (fd==NULL) {
+		fprintf(g_ptStatus, "Could not open file %s\n", ptEntry->pszSource);
+		return false;
+	}
+
+	sizRead = fread(ptEntry->pcData, 1, ptEntry->sizFile, fd);
+	fOk = (sizRead==ptEntry->sizFile && fgetc(fd)==EOF);
+	if (!fOk) {
+		fprintf(g_ptStatus, "error reading file %s, was it changed?\n", ptEntry->pszSource);
+	}
+
+	fclose(fd);
+	return fOk;
+}
+
+
+/* copies files until there are none left or one failed */
+static void copyWorker(COPY_STATE_T *ptState){
+	MANIFEST_ENTRY_T *ptEntry;
+	size_t sizIdx;
+
+	while (!ptState->fFailed) {
+		sizIdx = ptState->sizNext++;
+		if (sizIdx >= ptState->ptManifest->sizEntries) {
+			break;
+		}
+		ptEntry = &ptState->ptManifest->ptEntries[sizIdx];
+		if (ptEntry->pcData!=NULL && ptEntry->sizFile>0 && !copyFile(ptEntry)) {
+			ptState->fFailed = true;
+		}
+	}
+}
+
+
+/*
+	Copies the data of all allocated files into the image.
+	The clusters of the files do not overlap and the file system
+	is not touched, so the files are read by several threads.
+	uiThreads = 0 uses one thread per CPU, at least 4, as most of
+	the time is spent waiting for the host files.
+	returns: 0=ok, >0=error
+*/
+static int copyFiles(MANIFEST_T *ptManifest, unsigned int uiThreads){
+	COPY_STATE_T tState;
+	std::vector<std::thread> atWorkers;
+	unsigned int uiCnt;
+
+	if (uiThreads==0) {
+		uiThreads = std::thread::hardware_concurrency();
+		if (uiThreads < 4) {
+			uiThreads = 4;
+		}
+	}
+	if (uiThreads > MANIFEST_MAX_THREADS) {
+		uiThreads = MANIFEST_MAX_THREADS;
+	}
+
+	tState.ptManifest = ptManifest;
+	tState.sizNext = 0;
+	tState.fFailed = false;
+
+	/* this thread is one of the workers */
+	try {
+		for (uiCnt = 1; uiCnt < uiThreads; uiCnt++) {
+			atWorkers.push_back(std::thread(copyWorker, &tState));
+		}
+	} catch (const std::system_error&) {
+		/* continue with the threads which could be started */
+	}
+	copyWorker(&tState);
+
+	for (uiCnt = 0; uiCnt < atWorkers.size(); uiCnt++) {
+		atWorkers[uiCnt].join();
+	}
+
+	return tState.fFailed ? 1 : 0;
+}
+
+
+/*
+	Builds the file system from the sorted entries:
+	1. create all directories
+	2. make room in each directory for all its files
+	3. create the files in order, so their clusters follow each other in the image
+	4. copy the file data, see copyFiles
+	returns: 0=ok, >0=error
+*/
+static int writeManifest(fatfs *pFS, MANIFEST_T *ptManifest, unsigned int uiThreads){
+	MANIFEST_ENTRY_T *ptEntry;
+	MANIFEST_ENTRY_T *ptEnd;
+	MANIFEST_ENTRY_T *ptRun;
+	unsigned long ulEntries;
+	char acRoot[2] = { '/', '\0' };
+	char *pszParent;
+	char cSeparator;
+	char *pabBuffer;
+	size_t sizFileSize;
+	bool fInMemory;
+	bool fOk;
+
+	qsort(ptManifest->ptEntries, ptManifest->sizEntries, sizeof(MANIFEST_ENTRY_T), compareEntries);
+	ptEnd = ptManifest->ptEntries + ptManifest->sizEntries;
+
+	for (ptEntry = ptManifest->ptEntries; ptEntry < ptEnd; ptEntry++) {
+		if (ptEntry+1 < ptEnd && 0==strcmp(ptEntry->pszDest, ptEntry[1].pszDest)) {
+			fprintf(g_ptStatus, "%s is listed more than once\n", ptEntry->pszDest);
+			return 1;
+		}
+	}
+
+	/* Create the directories, parents before their subdirectories */
+	for (ptEntry = ptManifest->ptEntries; ptEntry < ptEnd; ptEntry++) {
+		fOk = true;
+		if (ptEntry->sizParentLen>0 && (ptEntry==ptManifest->ptEntries || !isSameParent(ptEntry-1, ptEntry))) {
+			pszParent = ptEntry->pszDest;
+			cSeparator = pszParent[ptEntry->sizParentLen];
+			pszParent[ptEntry->sizParentLen] = '\0';
+			fOk = makeDirs(pFS, pszParent);
+			pszParent[ptEntry->sizParentLen] = cSeparator;
+		}
+		if (fOk && ptEntry->pszSource==NULL) {
+			fOk = makeDirs(pFS, ptEntry->pszDest);
+		}
+		if (!fOk) return 1;
+	}
+
+	/* Size each directory for all of its files */
+	for (ptRun = ptManifest->ptEntries; ptRun < ptEnd; ptRun = ptEntry) {
+		ulEntries = 0;
+		for (ptEntry = ptRun; ptEntry < ptEnd && isSameParent(ptRun, ptEntry); ptEntry++) {
+			if (ptEntry->pszSource!=NULL) {
+				ulEntries += _FAT_directory_entryCount(ptEntry->pszDest + ptEntry->sizParentLen + 1);
+			}
+		}
+		if (ulEntries > 0) {
+			if (ptRun->sizParentLen==0) {
+				fOk = pFS->reservedir(acRoot, ulEntries);
+			} else {
+				pszParent = ptRun->pszDest;
+				cSeparator = pszParent[ptRun->sizParentLen];
+				pszParent[ptRun->sizParentLen] = '\0';
+				fOk = pFS->reservedir(pszParent, ulEntries);
+				pszParent[ptRun->sizParentLen] = cSeparator;
+			}
+			if (!fOk) return 1;
+		}
+	}
+
+	/* Create the files. The file system is only modified by this thread.
+	   If the image is not in memory, the data can't be copied in place. */
+	fInMemory = pFS->isinmemory();
+	for (ptEntry = ptManifest->ptEntries; ptEntry < ptEnd; ptEntry++) {
+		if (ptEntry->pszSource!=NULL) {
+			if (fInMemory && !pFS->allocfile(ptEntry->sizFile, ptEntry->pszDest, &ptEntry->pcData)) return 1;
+			if (ptEntry->pcData==NULL) {
+				/* no contiguous space left or no image in memory, let writefile allocate the clusters */
+				pabBuffer = readFile(ptEntry->pszSource, &sizFileSize);
+				if (pabBuffer == NULL) return 1;
+				fOk = pFS->writefile(pabBuffer, sizFileSize, ptEntry->pszDest);
+				free(pabBuffer);
+				if (!fOk) return 1;
+			}
+		}
+	}
+
+	return copyFiles(ptManifest, uiThreads);
+}
+
+
+int executeManifest(fatfs *pFS, const char *pszManifest, unsigned int uiThreads){
+	MANIFEST_T tManifest;
+	int iResult;
+
+	tManifest.ptEntries = NULL;
+	tManifest.sizEntries = 0;
+	tManifest.sizAllocated = 0;
+
+	iResult = readManifest(&tManifest, pszManifest);
+	if (iResult==0) {
+		iResult = writeManifest(pFS, &tManifest, uiThreads);
+	}
+	if (iResult==0) {
+		fprintf(g_ptStatus, "Manifest %s: %lu entries written\n", pszManifest, (unsigned long) tManifest.sizEntries);
+	}
+
+	freeManifest(&tManifest);
+	return iResult;
+}
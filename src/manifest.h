@@ -0,0 +1,24 @@
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+#include "fatfs.h"
+
+/*
+	Writes all files and directories listed in a manifest into the file system.
+
+	Each line of the manifest is either
+	  hostfile destfile    copy a file into the file system
+	  destdir/             create a directory
+	Paths containing spaces can be put in double quotes.
+	Blank lines and lines starting with '#' are ignored.
+
+	The whole list is planned before the image is touched: the entries are
+	sorted by directory, all directories are created and sized for their
+	entries, then the files are created in image order. Finally uiThreads
+	threads read the host files directly into the image (0 = automatic).
+
+	returns: 0=ok, >0=error
+*/
+int executeManifest(fatfs *pFS, const char *pszManifest, unsigned int uiThreads);
+
+#endif  // __MANIFEST_H__
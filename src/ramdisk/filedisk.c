@@ -0,0 +1,445 @@
+#ifndef _WIN32
+/* SEEK_DATA and fallocate are extensions on glibc */
+#       define _GNU_SOURCE
+#endif
+
+#include <string.h>
+
+#include "ramdisk/filedisk.h"
+
+#ifdef _WIN32
+#       include <windows.h>
+#else
+#       include <errno.h>
+#       include <fcntl.h>
+#       include <sys/stat.h>
+#       include <unistd.h>
+#endif
+
+
+static int drv_filedisk_startup (const struct IO_INTERFACE_STRUCT* ptIO);
+static int drv_filedisk_isInserted (const struct IO_INTERFACE_STRUCT* ptIO);
+static int drv_filedisk_readSectors (const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors, void* buffer);
+static int drv_filedisk_writeSectors (const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors, const void* buffer);
+static int drv_filedisk_clearStatus (const struct IO_INTERFACE_STRUCT* ptIO);
+static int drv_filedisk_shutdown (const struct IO_INTERFACE_STRUCT* ptIO);
+static int drv_filedisk_fillSectors (const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors, unsigned char value);
+
+/* The sectors are not in memory, there is no fn_mapSectors. */
+#ifdef __GNUC__
+IO_INTERFACE g_tIoIfFileDisk =
+{
+  .ioType             = IO_TYPE_FILE,
+  .features           = FEATURE_MEDIUM_CANREAD|FEATURE_MEDIUM_CANWRITE,
+  .fn_startup         = drv_filedisk_startup,
+  .fn_isInserted      = drv_filedisk_isInserted,
+  .fn_readSectors     = drv_filedisk_readSectors,
+  .fn_writeSectors    = drv_filedisk_writeSectors,
+  .fn_clearStatus     = drv_filedisk_clearStatus,
+  .fn_shutdown        = drv_filedisk_shutdown,
+  .ulBlockSize        = 0,
+  .pvUser             = NULL,
+  .ullStartOffset     = 0,
+  .ullDiskSize        = 0,
+
+  .pfnErrorHandler    = NULL,
+  .pfnvprintf         = NULL,
+  .pvErrUser          = NULL,
+
+  .fn_mapSectors      = NULL,
+  .fn_fillSectors     = drv_filedisk_fillSectors
+};
+#else
+IO_INTERFACE g_tIoIfFileDisk =
+{
+  IO_TYPE_FILE,
+  FEATURE_MEDIUM_CANREAD|FEATURE_MEDIUM_CANWRITE,
+  drv_filedisk_startup,
+  drv_filedisk_isInserted,
+  drv_filedisk_readSectors,
+  drv_filedisk_writeSectors,
+  drv_filedisk_clearStatus,
+  drv_filedisk_shutdown,
+  0,
+  0,
+  NULL,
+  0,
+  0, 
+
+  NULL,
+  NULL,
+  NULL,
+
+  NULL,
+  drv_filedisk_fillSectors
+};
+#endif
+
+
+static bool filedisk_openHandle(FILEDISK_T *ptDisk, const char *pszFilename, bool fWritable, bool fCreate)
+{
+#ifdef _WIN32
+	HANDLE hFile;
+	LARGE_INTEGER tSize;
+
+	memset(ptDisk, 0, sizeof(FILEDISK_T));
+
+	hFile = CreateFileA(pszFilename, fWritable ? (GENERIC_READ|GENERIC_WRITE) : GENERIC_READ,
+		FILE_SHARE_READ, NULL, fCreate ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	if (!GetFileSizeEx(hFile, &tSize)) {
+		CloseHandle(hFile);
+		return false;
+	}
+
+	ptDisk->hFile   = hFile;
+	ptDisk->ullSize = (unsigned long long) tSize.QuadPart;
+#else
+	int fd;
+	struct stat tStatBuf;
+
+	memset(ptDisk, 0, sizeof(FILEDISK_T));
+
+	fd = open(pszFilename, fCreate ? (O_RDWR|O_CREAT|O_TRUNC) : (fWritable ? O_RDWR : O_RDONLY), 0666);
+	if (fd < 0) {
+		return false;
+	}
+
+	if (fstat(fd, &tStatBuf) != 0 || !S_ISREG(tStatBuf.st_mode)) {
+		close(fd);
+		return false;
+	}
+
+	ptDisk->iFd     = fd;
+	ptDisk->ullSize = (unsigned long long) tStatBuf.st_size;
+#endif
+	ptDisk->fWritable = fWritable;
+	ptDisk->fOpen     = true;
+	return true;
+}
+
+
+/*
+Open an existing image file.
+Returns false if the file can not be opened or is empty.
+*/
+bool filedisk_open(FILEDISK_T *ptDisk, const char *pszFilename, bool fWritable)
+{
+	if (!filedisk_openHandle(ptDisk, pszFilename, fWritable, false)) {
+		return false;
+	}
+	if (ptDisk->ullSize == 0) {
+		filedisk_close(ptDisk);
+		return false;
+	}
+	return true;
+}
+
+
+/*
+Create the image file, or truncate an existing one, and extend it to
+ullSize bytes. The file system usually leaves the new blocks unallocated,
+they are read as zeros.
+*/
+bool filedisk_create(FILEDISK_T *ptDisk, const char *pszFilename, unsigned long long ullSize)
+{
+#ifdef _WIN32
+	LARGE_INTEGER tPos;
+#endif
+
+	if (!filedisk_openHandle(ptDisk, pszFilename, true, true)) {
+		return false;
+	}
+
+#ifdef _WIN32
+	tPos.QuadPart = (LONGLONG) ullSize;
+	if (!SetFilePointerEx((HANDLE)ptDisk->hFile, tPos, NULL, FILE_BEGIN) || !SetEndOfFile((HANDLE)ptDisk->hFile)) {
+		filedisk_close(ptDisk);
+		return false;
+	}
+#else
+	if ((unsigned long long) (off_t) ullSize != ullSize || ftruncate(ptDisk->iFd, (off_t) ullSize) != 0) {
+		filedisk_close(ptDisk);
+		return false;
+	}
+#endif
+	ptDisk->ullSize = ullSize;
+	return true;
+}
+
+
+/*
+Read sizLen bytes at ullOffset. Fails if the range is not completely inside the file.
+*/
+bool filedisk_read(FILEDISK_T *ptDisk, unsigned long long ullOffset, void *pvBuffer, size_t sizLen)
+{
+	unsigned char *pbBuffer = (unsigned char*) pvBuffer;
+#ifdef _WIN32
+	OVERLAPPED tOverlapped;
+	DWORD dwChunk;
+	DWORD dwRead;
+#else
+	ssize_t ssizRead;
+#endif
+
+	if (!ptDisk->fOpen || ullOffset > ptDisk->ullSize || sizLen > ptDisk->ullSize - ullOffset) {
+		return false;
+	}
+
+	while (sizLen > 0) {
+#ifdef _WIN32
+		dwChunk = sizLen > 0x40000000 ? 0x40000000 : (DWORD) sizLen;
+		memset(&tOverlapped, 0, sizeof(tOverlapped));
+		tOverlapped.Offset     = (DWORD) ullOffset;
+		tOverlapped.OffsetHigh = (DWORD) (ullOffset >> 32);
+		if (!ReadFile((HANDLE)ptDisk->hFile, pbBuffer, dwChunk, &dwRead, &tOverlapped) || dwRead == 0) {
+			return false;
+		}
+		pbBuffer  += dwRead;
+		ullOffset += dwRead;
+		sizLen    -= dwRead;
+#else
+		ssizRead = pread(ptDisk->iFd, pbBuffer, sizLen, (off_t) ullOffset);
+		if (ssizRead < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ssizRead <= 0) {
+			return false;
+		}
+		pbBuffer  += ssizRead;
+		ullOffset += (unsigned long long) ssizRead;
+		sizLen    -= (size_t) ssizRead;
+#endif
+	}
+	return true;
+}
+
+
+/*
+Write sizLen bytes at ullOffset. Fails if the range is not completely inside the file.
+*/
+bool filedisk_write(FILEDISK_T *ptDisk, unsigned long long ullOffset, const void *pvBuffer, size_t sizLen)
+{
+	const unsigned char *pbBuffer = (const unsigned char*) pvBuffer;
+#ifdef _WIN32
+	OVERLAPPED tOverlapped;
+	DWORD dwChunk;
+	DWORD dwWritten;
+#else
+	ssize_t ssizWritten;
+#endif
+
+	if (!ptDisk->fOpen || !ptDisk->fWritable || ullOffset > ptDisk->ullSize || sizLen > ptDisk->ullSize - ullOffset) {
+		return false;
+	}
+
+	while (sizLen > 0) {
+#ifdef _WIN32
+		dwChunk = sizLen > 0x40000000 ? 0x40000000 : (DWORD) sizLen;
+		memset(&tOverlapped, 0, sizeof(tOverlapped));
+		tOverlapped.Offset     = (DWORD) ullOffset;
+		tOverlapped.OffsetHigh = (DWORD) (ullOffset >> 32);
+		if (!WriteFile((HANDLE)ptDisk->hFile, pbBuffer, dwChunk, &dwWritten, &tOverlapped) || dwWritten == 0) {
+			return false;
+		}
+		pbBuffer  += dwWritten;
+		ullOffset += dwWritten;
+		sizLen    -= dwWritten;
+#else
+		ssizWritten = pwrite(ptDisk->iFd, pbBuffer, sizLen, (off_t) ullOffset);
+		if (ssizWritten < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ssizWritten <= 0) {
+			return false;
+		}
+		pbBuffer  += ssizWritten;
+		ullOffset += (unsigned long long) ssizWritten;
+		sizLen    -= (size_t) ssizWritten;
+#endif
+	}
+	return true;
+}
+
+
+/*
+Set sizLen bytes at ullOffset to bValue. Zeros are written by the file
+system as unwritten extents where it can, other values and file systems
+without support are written from a buffer.
+*/
+bool filedisk_fill(FILEDISK_T *ptDisk, unsigned long long ullOffset, unsigned long long ullLen, unsigned char bValue)
+{
+	unsigned char abBuffer[0x10000];
+	size_t sizChunk;
+
+	if (!ptDisk->fOpen || !ptDisk->fWritable || ullOffset > ptDisk->ullSize || ullLen > ptDisk->ullSize - ullOffset) {
+		return false;
+	}
+
+#if !defined(_WIN32) && defined(FALLOC_FL_ZERO_RANGE)
+	/* the range is inside the file, so it fits into off_t */
+	if (bValue == 0 &&
+		(fallocate(ptDisk->iFd, FALLOC_FL_ZERO_RANGE|FALLOC_FL_KEEP_SIZE, (off_t) ullOffset, (off_t) ullLen) == 0 ||
+		 fallocate(ptDisk->iFd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, (off_t) ullOffset, (off_t) ullLen) == 0)) {
+		return true;
+	}
+#endif
+
+	memset(abBuffer, bValue, sizeof(abBuffer));
+	while (ullLen > 0) {
+		sizChunk = ullLen < sizeof(abBuffer) ? (size_t) ullLen : sizeof(abBuffer);
+		if (!filedisk_write(ptDisk, ullOffset, abBuffer, sizChunk)) {
+			return false;
+		}
+		ullOffset += sizChunk;
+		ullLen    -= sizChunk;
+	}
+	return true;
+}
+
+
+bool filedisk_sync(FILEDISK_T *ptDisk)
+{
+	if (!ptDisk->fOpen) {
+		return false;
+	}
+	if (!ptDisk->fWritable) {
+		return true;
+	}
+#ifdef _WIN32
+	return FlushFileBuffers((HANDLE)ptDisk->hFile) != 0;
+#else
+	return fsync(ptDisk->iFd) == 0;
+#endif
+}
+
+
+unsigned long long filedisk_nextData(FILEDISK_T *ptDisk, unsigned long long ullOffset)
+{
+#if !defined(_WIN32) && defined(SEEK_DATA)
+	off_t tPos;
+
+	if (ptDisk->fOpen && ullOffset < ptDisk->ullSize) {
+		tPos = lseek(ptDisk->iFd, (off_t) ullOffset, SEEK_DATA);
+		if (tPos >= 0) {
+			return (unsigned long long) tPos;
+		} else if (errno == ENXIO) {
+			/* only a hole up to the end of the file */
+			return ptDisk->ullSize;
+		}
+	}
+#endif
+	/* unknown, the data may start right here */
+	return ullOffset;
+}
+
+
+void filedisk_close(FILEDISK_T *ptDisk)
+{
+	if (ptDisk->fOpen) {
+#ifdef _WIN32
+		CloseHandle((HANDLE)ptDisk->hFile);
+#else
+		close(ptDisk->iFd);
+#endif
+	}
+	memset(ptDisk, 0, sizeof(FILEDISK_T));
+}
+
+
+static bool drv_filedisk_checkBoundaries(const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors)
+{
+	u64 ullEnd;
+
+	if (!u64_mulChecked((u64) sector + numSectors, ptIO->ulBlockSize, &ullEnd) ||
+		ullEnd > ptIO->ullDiskSize) {
+		if (ptIO->pfnErrorHandler)
+			ptIO->pfnErrorHandler(ptIO->pvErrUser, "drv_filedisk_checkBoundaries: illegal sector access");
+		return false;
+	} else {
+		return true;
+	}
+}
+
+/*
+Read numSectors sectors from the image file, starting at sector.
+The sectors are contiguous in the file and in the buffer, so this is a single read.
+*/
+static int drv_filedisk_readSectors(const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors, void* buffer) 
+{
+	unsigned long long ullSectorSize = ptIO->ulBlockSize;
+
+	if (!drv_filedisk_checkBoundaries(ptIO, sector, numSectors)) {
+		return 0;
+	}
+	if (!filedisk_read((FILEDISK_T*)ptIO->pvUser, ptIO->ullStartOffset + sector * ullSectorSize, buffer, (size_t) (numSectors * ullSectorSize))) {
+		if (ptIO->pfnErrorHandler)
+			ptIO->pfnErrorHandler(ptIO->pvErrUser, "drv_filedisk_readSectors: could not read sector %lu", sector);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+Write numSectors sectors to the image file, starting at sector.
+*/
+static int drv_filedisk_writeSectors(const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors, const void* buffer) 
+{
+	unsigned long long ullSectorSize = ptIO->ulBlockSize;
+
+	if (!drv_filedisk_checkBoundaries(ptIO, sector, numSectors)) {
+		return 0;
+	}
+	if (!filedisk_write((FILEDISK_T*)ptIO->pvUser, ptIO->ullStartOffset + sector * ullSectorSize, buffer, (size_t) (numSectors * ullSectorSize))) {
+		if (ptIO->pfnErrorHandler)
+			ptIO->pfnErrorHandler(ptIO->pvErrUser, "drv_filedisk_writeSectors: could not write sector %lu", sector);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+Set all bytes of numSectors sectors to value, starting at sector.
+*/
+static int drv_filedisk_fillSectors(const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors, unsigned char value) 
+{
+	unsigned long long ullSectorSize = ptIO->ulBlockSize;
+
+	if (!drv_filedisk_checkBoundaries(ptIO, sector, numSectors)) {
+		return 0;
+	}
+	if (!filedisk_fill((FILEDISK_T*)ptIO->pvUser, ptIO->ullStartOffset + sector * ullSectorSize, numSectors * ullSectorSize, value)) {
+		if (ptIO->pfnErrorHandler)
+			ptIO->pfnErrorHandler(ptIO->pvErrUser, "drv_filedisk_fillSectors: could not fill sector %lu", sector);
+		return 0;
+	}
+	return 1;
+}
+
+static int drv_filedisk_startup (const struct IO_INTERFACE_STRUCT* ptIO) 
+{
+	return ((FILEDISK_T*)ptIO->pvUser)->fOpen;
+}
+
+static int drv_filedisk_isInserted (const struct IO_INTERFACE_STRUCT* ptIO) 
+{
+	return ((FILEDISK_T*)ptIO->pvUser)->fOpen;
+}
+
+static int drv_filedisk_clearStatus (const struct IO_INTERFACE_STRUCT* ptIO) 
+{
+	UNREFERENCED_PARAMETER(ptIO);
+
+	return 1;
+}
+
+/* The file stays open, it is closed by the owner of the FILEDISK_T. */
+static int drv_filedisk_shutdown (const struct IO_INTERFACE_STRUCT* ptIO) 
+{
+	UNREFERENCED_PARAMETER(ptIO);
+
+	return 1;
+}
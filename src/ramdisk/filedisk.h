@@ -0,0 +1,46 @@
+#ifndef RAMDISK_FILEDISK_H_
+#define RAMDISK_FILEDISK_H_
+
+#include <stddef.h>
+
+#include "fat/common.h"
+#include "fat/disk_io.h"
+
+/*
+	An image file accessed with positioned reads and writes. Only the sectors
+	in use are read, so the image may be larger than the memory.
+
+	The IO interface g_tIoIfFileDisk expects a FILEDISK_T in pvUser and the
+	position of the partition in the file in ullStartOffset.
+*/
+typedef struct FILEDISK_STRUCT
+{
+#ifdef _WIN32
+	void   *hFile;
+#else
+	int    iFd;
+#endif
+	unsigned long long ullSize;
+	bool   fWritable;
+	bool   fOpen;
+} FILEDISK_T;
+
+extern IO_INTERFACE g_tIoIfFileDisk;
+
+/* open an existing image file */
+bool filedisk_open(FILEDISK_T *ptDisk, const char *pszFilename, bool fWritable);
+/* create or truncate an image file and set its size, the new file is filled with zeros */
+bool filedisk_create(FILEDISK_T *ptDisk, const char *pszFilename, unsigned long long ullSize);
+bool filedisk_read(FILEDISK_T *ptDisk, unsigned long long ullOffset, void *pvBuffer, size_t sizLen);
+bool filedisk_write(FILEDISK_T *ptDisk, unsigned long long ullOffset, const void *pvBuffer, size_t sizLen);
+/* set ullLen bytes to bValue, zeros may become unwritten extents or holes */
+bool filedisk_fill(FILEDISK_T *ptDisk, unsigned long long ullOffset, unsigned long long ullLen, unsigned char bValue);
+bool filedisk_sync(FILEDISK_T *ptDisk);
+/*
+	Returns the offset of the next data at or after ullOffset. The bytes in between
+	are a hole and read as zeros. Returns ullOffset if the file system can't tell.
+*/
+unsigned long long filedisk_nextData(FILEDISK_T *ptDisk, unsigned long long ullOffset);
+void filedisk_close(FILEDISK_T *ptDisk);
+
+#endif /*RAMDISK_FILEDISK_H_*/
@@ -1,4 +1,5 @@
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "fat/common.h"
@@ -12,6 +13,8 @@ static int drv_ramdisk_startup (const struct IO_INTERFACE_STRUCT* ptIO);
 static int drv_ramdisk_isInserted (const struct IO_INTERFACE_STRUCT* ptIO); 
 static int drv_ramdisk_clearStatus (const struct IO_INTERFACE_STRUCT* ptIO); 
 static int drv_ramdisk_shutdown (const struct IO_INTERFACE_STRUCT* ptIO); 
+static void* drv_ramdisk_mapSectors (const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors); 
+static int drv_ramdisk_fillSectors (const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors, unsigned char value); 
 
 #ifdef __GNUC__
 IO_INTERFACE g_tIoIfRamDisk =
@@ -26,13 +29,15 @@ IO_INTERFACE g_tIoIfRamDisk =
   .fn_shutdown        = drv_ramdisk_shutdown,
   .ulBlockSize        = 0,
   .pvUser             = NULL,
-  .ulStartOffset      = 0,
-  .ulDiskSize         = 0,
+  .ullStartOffset     = 0,
+  .ullDiskSize        = 0,
 
   .pfnErrorHandler    = NULL,
   .pfnvprintf         = NULL,
-  .pvErrUser          = NULL
+  .pvErrUser          = NULL,
 
+  .fn_mapSectors      = drv_ramdisk_mapSectors,
+  .fn_fillSectors     = drv_ramdisk_fillSectors
 };
 #else
 IO_INTERFACE g_tIoIfRamDisk =
@@ -46,23 +51,134 @@ IO_INTERFACE g_tIoIfRamDisk =
   drv_ramdisk_clearStatus,
   drv_ramdisk_shutdown,
   0,
+  0,
   NULL,
   0,
   0, 
 
   NULL,
   NULL,
-  NULL
+  NULL,
+
+  drv_ramdisk_mapSectors,
+  drv_ramdisk_fillSectors
 };
 #endif
 
+/* A RAM disk whose memory is a mapped image file (see ramdisk/mmap.h).
+   The sector access is the same, only the ioType differs. */
+#ifdef __GNUC__
+IO_INTERFACE g_tIoIfMmapDisk =
+{
+  .ioType             = IO_TYPE_MMAP,
+  .features           = FEATURE_MEDIUM_CANREAD|FEATURE_MEDIUM_CANWRITE,
+  .fn_startup         = drv_ramdisk_startup,
+  .fn_isInserted      = drv_ramdisk_isInserted,
+  .fn_readSectors     = drv_ramdisk_readSectors,
+  .fn_writeSectors    = drv_ramdisk_writeSectors,
+  .fn_clearStatus     = drv_ramdisk_clearStatus,
+  .fn_shutdown        = drv_ramdisk_shutdown,
+  .ulBlockSize        = 0,
+  .pvUser             = NULL,
+  .ullStartOffset     = 0,
+  .ullDiskSize        = 0,
+
+  .pfnErrorHandler    = NULL,
+  .pfnvprintf         = NULL,
+  .pvErrUser          = NULL,
+
+  .fn_mapSectors      = drv_ramdisk_mapSectors,
+  .fn_fillSectors     = drv_ramdisk_fillSectors
+};
+#else
+IO_INTERFACE g_tIoIfMmapDisk =
+{
+  IO_TYPE_MMAP,
+  FEATURE_MEDIUM_CANREAD|FEATURE_MEDIUM_CANWRITE,
+  drv_ramdisk_startup,
+  drv_ramdisk_isInserted,
+  drv_ramdisk_readSectors,
+  drv_ramdisk_writeSectors,
+  drv_ramdisk_clearStatus,
+  drv_ramdisk_shutdown,
+  0,
+  0,
+  NULL,
+  0,
+  0, 
+
+  NULL,
+  NULL,
+  NULL,
+
+  drv_ramdisk_mapSectors,
+  drv_ramdisk_fillSectors
+};
+#endif
+
+
+static int drv_lazydisk_readSectors (const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors, void* buffer); 
+static int drv_lazydisk_writeSectors (const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors, const void* buffer); 
+static void* drv_lazydisk_mapSectors (const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors); 
+static int drv_lazydisk_fillSectors (const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors, unsigned char value); 
+
+/* pvUser is a RAMDISK_T */
+#ifdef __GNUC__
+IO_INTERFACE g_tIoIfLazyRamDisk =
+{
+  .ioType             = IO_TYPE_RAM,
+  .features           = FEATURE_MEDIUM_CANREAD|FEATURE_MEDIUM_CANWRITE,
+  .fn_startup         = drv_ramdisk_startup,
+  .fn_isInserted      = drv_ramdisk_isInserted,
+  .fn_readSectors     = drv_lazydisk_readSectors,
+  .fn_writeSectors    = drv_lazydisk_writeSectors,
+  .fn_clearStatus     = drv_ramdisk_clearStatus,
+  .fn_shutdown        = drv_ramdisk_shutdown,
+  .ulBlockSize        = 0,
+  .pvUser             = NULL,
+  .ullStartOffset     = 0,
+  .ullDiskSize        = 0,
+
+  .pfnErrorHandler    = NULL,
+  .pfnvprintf         = NULL,
+  .pvErrUser          = NULL,
+
+  .fn_mapSectors      = drv_lazydisk_mapSectors,
+  .fn_fillSectors     = drv_lazydisk_fillSectors
+};
+#else
+IO_INTERFACE g_tIoIfLazyRamDisk =
+{
+  IO_TYPE_RAM,
+  FEATURE_MEDIUM_CANREAD|FEATURE_MEDIUM_CANWRITE,
+  drv_ramdisk_startup,
+  drv_ramdisk_isInserted,
+  drv_lazydisk_readSectors,
+  drv_lazydisk_writeSectors,
+  drv_ramdisk_clearStatus,
+  drv_ramdisk_shutdown,
+  0,
+  0,
+  NULL,
+  0,
+  0, 
+
+  NULL,
+  NULL,
+  NULL,
+
+  drv_lazydisk_mapSectors,
+  drv_lazydisk_fillSectors
+};
+#endif
 
 bool drv_ramdisk_checkBoundaries(const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors){
-	unsigned long ulSectorSize = ptIO->ulBlockSize;
-	unsigned long ulDiskSize = ptIO->ulDiskSize;
+	u64 ullSectorSize = ptIO->ulBlockSize;
+	u64 ullEnd;
 
-	if (sector * ulSectorSize > ulDiskSize || 
-		(sector + numSectors) * ulSectorSize > ulDiskSize) {
+	/* sector and numSectors are at most 32 bit, their sum can't overflow */
+	if (!u64_mulChecked((u64) sector + numSectors, ullSectorSize, &ullEnd) ||
+		ullEnd > ptIO->ullDiskSize) {
 		if (ptIO->pfnErrorHandler)
 			ptIO->pfnErrorHandler(ptIO->pvErrUser, "drv_ramdisk_checkBoundaries: illegal sector access");
 		return false;
@@ -85,7 +201,7 @@ int drv_ramdisk_readSectors(const struct IO_INTERFACE_STRUCT* ptIO, unsigned lon
 
   if (drv_ramdisk_checkBoundaries(ptIO, sector, numSectors)){
   //if (sector * ulSectorSize < ulDiskSize && (sector + numSectors) * ulSectorSize < ulDiskSize){
-	memcpy(buffer, pbData + sector * ulSectorSize, numSectors * ulSectorSize);
+	memcpy(buffer, pbData + (size_t) sector * ulSectorSize, (size_t) numSectors * ulSectorSize);
 	return 1;
   } else {
 	return 0;
@@ -106,13 +222,44 @@ int drv_ramdisk_writeSectors(const struct IO_INTERFACE_STRUCT* ptIO, unsigned lo
 
  // if (sector * ulSectorSize < ulDiskSize && (sector + numSectors) * ulSectorSize < ulDiskSize){
   if (drv_ramdisk_checkBoundaries(ptIO, sector, numSectors)){
-	memcpy(pbData + sector * ulSectorSize, buffer, numSectors * ulSectorSize);
+	memcpy(pbData + (size_t) sector * ulSectorSize, buffer, (size_t) numSectors * ulSectorSize);
 	return 1;
   }else {
 	return 0;
   }
 }
 
+/*
+Return a pointer to numSectors sectors in the RAM disk, starting at sector.
+*/
+void* drv_ramdisk_mapSectors(const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors) 
+{
+  unsigned long ulSectorSize = ptIO->ulBlockSize;
+  unsigned char *pbData = (unsigned char*)ptIO->pvUser;
+
+  if (drv_ramdisk_checkBoundaries(ptIO, sector, numSectors)){
+	return pbData + (size_t) sector * ulSectorSize;
+  } else {
+	return NULL;
+  }
+}
+
+/*
+Set all bytes of numSectors sectors to value, starting at sector.
+*/
+int drv_ramdisk_fillSectors(const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors, unsigned char value) 
+{
+  unsigned long ulSectorSize = ptIO->ulBlockSize;
+  unsigned char *pbData = (unsigned char*)ptIO->pvUser;
+
+  if (drv_ramdisk_checkBoundaries(ptIO, sector, numSectors)){
+	memset(pbData + (size_t) sector * ulSectorSize, value, (size_t) numSectors * ulSectorSize);
+	return 1;
+  } else {
+	return 0;
+  }
+}
+
 /*
 Initialise the disc to a state ready for data reading or writing
 */
@@ -147,3 +294,164 @@ int drv_ramdisk_shutdown (const struct IO_INTERFACE_STRUCT* ptIO)
 
   return 1;
 }
+
+
+/*
+Lazily erased RAM disk: a bit per sector tells if the memory holds the sector.
+*/
+static inline bool ramdisk_isValid(const RAMDISK_T *ptDisk, unsigned long sector)
+{
+  return (ptDisk->pbValid[sector >> 3] & (1U << (sector & 7))) != 0;
+}
+
+static inline void ramdisk_setValidBit(RAMDISK_T *ptDisk, unsigned long sector, bool fValid)
+{
+  if (fValid) {
+	ptDisk->pbValid[sector >> 3] |= (unsigned char) (1U << (sector & 7));
+  } else {
+	ptDisk->pbValid[sector >> 3] &= (unsigned char) ~(1U << (sector & 7));
+  }
+}
+
+static void ramdisk_setValid(RAMDISK_T *ptDisk, unsigned long sector, unsigned long numSectors, bool fValid)
+{
+  while (numSectors > 0 && (sector & 7) != 0) {
+	ramdisk_setValidBit(ptDisk, sector, fValid);
+	++sector;
+	--numSectors;
+  }
+  memset(ptDisk->pbValid + (sector >> 3), fValid ? 0xff : 0x00, numSectors >> 3);
+  sector += numSectors & ~7UL;
+  numSectors &= 7;
+  while (numSectors > 0) {
+	ramdisk_setValidBit(ptDisk, sector, fValid);
+	++sector;
+	--numSectors;
+  }
+}
+
+bool ramdisk_init(RAMDISK_T *ptDisk, void *pvData, unsigned long ulSectorSize, unsigned long ulSectors, unsigned char bErase)
+{
+  ptDisk->pbData = (unsigned char*) pvData;
+  ptDisk->pbValid = (unsigned char*) calloc(((size_t) ulSectors + 7) / 8 + 1, 1);
+  ptDisk->ulSectorSize = ulSectorSize;
+  ptDisk->ulSectors = ulSectors;
+  ptDisk->bErase = bErase;
+  return ptDisk->pbValid != NULL;
+}
+
+void ramdisk_free(RAMDISK_T *ptDisk)
+{
+  free(ptDisk->pbValid);
+  memset(ptDisk, 0, sizeof(RAMDISK_T));
+}
+
+void ramdisk_materialize(RAMDISK_T *ptDisk, unsigned long sector, unsigned long numSectors)
+{
+  unsigned long ulEnd = sector + numSectors;
+  unsigned long ulRun;
+
+  while (sector < ulEnd) {
+	/* skip groups of 8 valid sectors at once */
+	if ((sector & 7) == 0 && sector + 8 <= ulEnd && ptDisk->pbValid[sector >> 3] == 0xff) {
+	  sector += 8;
+	} else if (ramdisk_isValid(ptDisk, sector)) {
+	  ++sector;
+	} else {
+	  for (ulRun = sector + 1; ulRun < ulEnd && !ramdisk_isValid(ptDisk, ulRun); ++ulRun);
+	  memset(ptDisk->pbData + (size_t) sector * ptDisk->ulSectorSize, ptDisk->bErase, (size_t) (ulRun - sector) * ptDisk->ulSectorSize);
+	  ramdisk_setValid(ptDisk, sector, ulRun - sector, true);
+	  sector = ulRun;
+	}
+  }
+}
+
+void ramdisk_read(const RAMDISK_T *ptDisk, unsigned long long ullOffset, void *pvBuffer, size_t sizLen)
+{
+  unsigned char *pbBuffer = (unsigned char*) pvBuffer;
+  unsigned long sector;
+  unsigned long long ullRunEnd;
+  size_t sizRun;
+  bool fValid;
+
+  while (sizLen > 0) {
+	/* a run of sectors which are all valid or all erased */
+	sector = (unsigned long) (ullOffset / ptDisk->ulSectorSize);
+	fValid = ramdisk_isValid(ptDisk, sector);
+	do {
+	  ++sector;
+	  ullRunEnd = (unsigned long long) sector * ptDisk->ulSectorSize;
+	} while (ullRunEnd < ullOffset + sizLen && ramdisk_isValid(ptDisk, sector) == fValid);
+	sizRun = (size_t) (ullRunEnd < ullOffset + sizLen ? ullRunEnd - ullOffset : sizLen);
+
+	if (fValid) {
+	  memcpy(pbBuffer, ptDisk->pbData + (size_t) ullOffset, sizRun);
+	} else {
+	  memset(pbBuffer, ptDisk->bErase, sizRun);
+	}
+	pbBuffer += sizRun;
+	ullOffset += sizRun;
+	sizLen -= sizRun;
+  }
+}
+
+int drv_lazydisk_readSectors(const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors, void* buffer) 
+{
+  const RAMDISK_T *ptDisk = (const RAMDISK_T*)ptIO->pvUser;
+
+  if (drv_ramdisk_checkBoundaries(ptIO, sector, numSectors)){
+	ramdisk_read(ptDisk, (unsigned long long) sector * ptIO->ulBlockSize, buffer, (size_t) numSectors * ptIO->ulBlockSize);
+	return 1;
+  } else {
+	return 0;
+  }
+}
+
+int drv_lazydisk_writeSectors(const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors, const void* buffer) 
+{
+  RAMDISK_T *ptDisk = (RAMDISK_T*)ptIO->pvUser;
+
+  if (drv_ramdisk_checkBoundaries(ptIO, sector, numSectors)){
+	memcpy(ptDisk->pbData + (size_t) sector * ptIO->ulBlockSize, buffer, (size_t) numSectors * ptIO->ulBlockSize);
+	ramdisk_setValid(ptDisk, sector, numSectors, true);
+	return 1;
+  } else {
+	return 0;
+  }
+}
+
+/*
+The sectors are erased before they are handed out.
+*/
+void* drv_lazydisk_mapSectors(const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors) 
+{
+  RAMDISK_T *ptDisk = (RAMDISK_T*)ptIO->pvUser;
+
+  if (drv_ramdisk_checkBoundaries(ptIO, sector, numSectors)){
+	ramdisk_materialize(ptDisk, sector, numSectors);
+	return ptDisk->pbData + (size_t) sector * ptIO->ulBlockSize;
+  } else {
+	return NULL;
+  }
+}
+
+/*
+Filling with the erase value only forgets the sectors, the memory is
+erased when they are mapped.
+*/
+int drv_lazydisk_fillSectors(const struct IO_INTERFACE_STRUCT* ptIO, unsigned long sector, unsigned long numSectors, unsigned char value) 
+{
+  RAMDISK_T *ptDisk = (RAMDISK_T*)ptIO->pvUser;
+
+  if (drv_ramdisk_checkBoundaries(ptIO, sector, numSectors)){
+	if (value == ptDisk->bErase) {
+	  ramdisk_setValid(ptDisk, sector, numSectors, false);
+	} else {
+	  memset(ptDisk->pbData + (size_t) sector * ptIO->ulBlockSize, value, (size_t) numSectors * ptIO->ulBlockSize);
+	  ramdisk_setValid(ptDisk, sector, numSectors, true);
+	}
+	return 1;
+  } else {
+	return 0;
+  }
+}
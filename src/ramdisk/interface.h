@@ -1,11 +1,40 @@
 #ifndef RAMDISK_INTERFACE_H_
 #define RAMDISK_INTERFACE_H_
 
+#include <stddef.h>
+
+#include "fat/common.h"
 #include "fat/disk_io.h"
 
 #define RAMDISK_SIZE          0x00100000UL
 #define RAMDISK_CRC32_LENGTH  0x400UL
 
+/*
+	A RAM disk which is erased lazily. A sector which was never written reads
+	as bErase without touching its memory, so a zeroed allocation stays in the
+	zero pages of the OS. Mapped sectors are erased before they are handed out.
+
+	The IO interface g_tIoIfLazyRamDisk expects a RAMDISK_T in pvUser.
+*/
+typedef struct RAMDISK_STRUCT
+{
+	unsigned char *pbData;
+	unsigned char *pbValid;        // one bit per sector, set if the memory holds the sector
+	unsigned long ulSectorSize;
+	unsigned long ulSectors;
+	unsigned char bErase;
+} RAMDISK_T;
+
 extern IO_INTERFACE g_tIoIfRamDisk;
+extern IO_INTERFACE g_tIoIfMmapDisk;
+extern IO_INTERFACE g_tIoIfLazyRamDisk;
+
+/* pvData holds ulSectors sectors, all of them start out erased */
+bool ramdisk_init(RAMDISK_T *ptDisk, void *pvData, unsigned long ulSectorSize, unsigned long ulSectors, unsigned char bErase);
+void ramdisk_free(RAMDISK_T *ptDisk);
+/* write the erase value into the memory of the sectors which were never written */
+void ramdisk_materialize(RAMDISK_T *ptDisk, unsigned long sector, unsigned long numSectors);
+/* copy bytes from the disk, erased sectors read as bErase */
+void ramdisk_read(const RAMDISK_T *ptDisk, unsigned long long ullOffset, void *pvBuffer, size_t sizLen);
 
 #endif /*RAMDISK_INTERFACE_H_*/
@@ -0,0 +1,127 @@
+
+#include <string.h>
+
+#include "ramdisk/mmap.h"
+
+#ifdef _WIN32
+#       include <windows.h>
+#else
+#       include <fcntl.h>
+#       include <sys/mman.h>
+#       include <sys/stat.h>
+#       include <unistd.h>
+#endif
+
+
+/*
+Map the whole file into memory.
+Returns false if the file can not be opened, is empty or can not be mapped.
+*/
+bool mmapdisk_open(MMAPDISK_T *ptDisk, const char *pszFilename, bool fShared)
+{
+#ifdef _WIN32
+	HANDLE hFile;
+	HANDLE hMapping;
+	LARGE_INTEGER tSize;
+	void *pvData;
+
+	memset(ptDisk, 0, sizeof(MMAPDISK_T));
+
+	hFile = CreateFileA(pszFilename, fShared ? (GENERIC_READ|GENERIC_WRITE) : GENERIC_READ,
+		FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	if (!GetFileSizeEx(hFile, &tSize) || tSize.QuadPart == 0 || (ULONGLONG)tSize.QuadPart > (size_t)-1) {
+		CloseHandle(hFile);
+		return false;
+	}
+
+	hMapping = CreateFileMappingA(hFile, NULL, fShared ? PAGE_READWRITE : PAGE_WRITECOPY, 0, 0, NULL);
+	if (hMapping == NULL) {
+		CloseHandle(hFile);
+		return false;
+	}
+
+	pvData = MapViewOfFile(hMapping, fShared ? FILE_MAP_WRITE : FILE_MAP_COPY, 0, 0, 0);
+	if (pvData == NULL) {
+		CloseHandle(hMapping);
+		CloseHandle(hFile);
+		return false;
+	}
+
+	ptDisk->pvData   = pvData;
+	ptDisk->sizData  = (size_t) tSize.QuadPart;
+	ptDisk->fShared  = fShared;
+	ptDisk->hFile    = hFile;
+	ptDisk->hMapping = hMapping;
+	return true;
+#else
+	int fd;
+	struct stat tStatBuf;
+	void *pvData;
+
+	memset(ptDisk, 0, sizeof(MMAPDISK_T));
+
+	fd = open(pszFilename, fShared ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	if (fstat(fd, &tStatBuf) != 0 || !S_ISREG(tStatBuf.st_mode) || tStatBuf.st_size == 0 ||
+		(unsigned long long) tStatBuf.st_size > (size_t)-1) {
+		close(fd);
+		return false;
+	}
+
+	/* A private mapping of a read-only descriptor may still be written,
+	   the changes only go to anonymous copies of the touched pages. */
+	pvData = mmap(NULL, (size_t) tStatBuf.st_size, PROT_READ|PROT_WRITE,
+		fShared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (pvData == MAP_FAILED) {
+		return false;
+	}
+
+	ptDisk->pvData  = pvData;
+	ptDisk->sizData = (size_t) tStatBuf.st_size;
+	ptDisk->fShared = fShared;
+	return true;
+#endif
+}
+
+
+/*
+Write the dirty pages of a shared mapping back to the file.
+Does nothing for a private mapping.
+*/
+bool mmapdisk_sync(MMAPDISK_T *ptDisk)
+{
+	if (ptDisk->pvData == NULL) {
+		return false;
+	}
+	if (!ptDisk->fShared) {
+		return true;
+	}
+#ifdef _WIN32
+	return FlushViewOfFile(ptDisk->pvData, 0) && FlushFileBuffers((HANDLE)ptDisk->hFile);
+#else
+	return msync(ptDisk->pvData, ptDisk->sizData, MS_SYNC) == 0;
+#endif
+}
+
+
+void mmapdisk_close(MMAPDISK_T *ptDisk)
+{
+	if (ptDisk->pvData != NULL) {
+#ifdef _WIN32
+		UnmapViewOfFile(ptDisk->pvData);
+		CloseHandle((HANDLE)ptDisk->hMapping);
+		CloseHandle((HANDLE)ptDisk->hFile);
+#else
+		munmap(ptDisk->pvData, ptDisk->sizData);
+#endif
+	}
+	memset(ptDisk, 0, sizeof(MMAPDISK_T));
+}
@@ -0,0 +1,30 @@
+#ifndef RAMDISK_MMAP_H_
+#define RAMDISK_MMAP_H_
+
+#include <stddef.h>
+
+#include "fat/common.h"
+
+/*
+	A file mapped into memory. The mapping is used as the backing store of a
+	RAM disk, so the FAT code accesses the image file without copying it.
+
+	fShared == true:  changes are written through to the file.
+	fShared == false: the mapping is copy-on-write, the file is never modified.
+*/
+typedef struct MMAPDISK_STRUCT
+{
+	void   *pvData;
+	size_t sizData;
+	bool   fShared;
+#ifdef _WIN32
+	void   *hFile;
+	void   *hMapping;
+#endif
+} MMAPDISK_T;
+
+bool mmapdisk_open(MMAPDISK_T *ptDisk, const char *pszFilename, bool fShared);
+bool mmapdisk_sync(MMAPDISK_T *ptDisk);
+void mmapdisk_close(MMAPDISK_T *ptDisk);
+
+#endif /*RAMDISK_MMAP_H_*/
@@ -407,6 +407,57 @@ assertFail(fs.getdirentries, fs, nil)
 assertFail(fs.getdirentries, fs)
 
 
+--------------------------------------------------------------------------
+print()
+print("Testing fs:direntries")
+
+-- the walk returns the entries of getdirentries without . and ..
+tNames = {}
+for i, entry in ipairs(fs:getdirentries("/PORT_0")) do
+	if entry.name~="." and entry.name~=".." then
+		tNames[entry.name] = entry
+	end
+end
+iCount = 0
+for entry in fs:direntries("/PORT_0") do
+	print(entry.name, entry.isdir and "<Dir>" or entry.filesize)
+	assert(tNames[entry.name])
+	assert(entry.isdir==tNames[entry.name].isdir)
+	assert(entry.filesize==tNames[entry.name].filesize)
+	tNames[entry.name] = nil
+	iCount = iCount + 1
+end
+assert(iCount>0)
+assert(next(tNames)==nil)
+
+-- empty directory
+for entry in fs:direntries("SYSTEM") do
+	error("unexpected entry " .. entry.name)
+end
+
+-- Error conditions:
+-- non-existent directory or a file: Lua error instead of a nil iterator
+fOk, strMsg = pcall(function() for entry in fs:direntries("/PORT_9") do end end)
+assert(not fOk and strMsg:find("not a directory"))
+fOk, strMsg = pcall(function() for entry in fs:direntries("PORT_0/TEST.NXF") do end end)
+assert(not fOk and strMsg:find("not a directory"))
+-- missing arguments
+assertFail(fs.direntries, fs, nil)
+assertFail(fs.direntries, fs)
+
+
+--------------------------------------------------------------------------
+print()
+print("Testing fs:getstats")
+
+-- nothing if the library was built without the counters
+t = fs:getstats()
+if t then
+	assert(t.direntriesscanned>0)
+	assert(t.heappeak>=t.heapcurrent)
+end
+
+
 --------------------------------------------------------------------------
 print()
 print("Testing fs:deletefile")
@@ -422,3 +473,115 @@ assertFail(fs.deletefile, fs, "/PORT_9/TEST.NXF")
 -- file does not exist
 assertFail(fs.deletefile, fs, "/PORT_0/TEST.NXF")
 
+
+--------------------------------------------------------------------------
+print()
+print("Testing fs:open/seek/read/write/truncate/close")
+
+-- a refused call either raises an error or returns false
+function assertRefused(...)
+	local fRes, x = pcall(...)
+	assert(not fRes or not x, "call did not fail as expected")
+end
+
+fs = fatfs.fatfs_create(528, 8192-125, 8192*528, 125*528)
+strData = string.rep("0123456789abcdef", 10000)
+assertTrue(fs.writefile, fs, strData, "/HANDLE.BIN")
+
+h = fs:open("/HANDLE.BIN", fatfs.fatfs_OPEN_WRITE)
+assert(h)
+assert(fs:size(h)==strData:len())
+
+-- patch the middle
+assertTrue(fs.seek, fs, h, 50000)
+assertTrue(fs.write, fs, h, "PATCH")
+assert(fs:tell(h)==50005)
+strData = strData:sub(1, 50000) .. "PATCH" .. strData:sub(50006)
+assertTrue(fs.seek, fs, h, 49998)
+assert(fs:read(h, 9)==strData:sub(49999, 50007))
+
+-- extend with zeros, then shrink
+assertTrue(fs.truncate, fs, h, 200000)
+assert(fs:size(h)==200000)
+strData = strData .. string.rep("\0", 200000-strData:len())
+assertTrue(fs.seek, fs, h, 159990)
+assert(fs:read(h, 20)==strData:sub(159991, 160010))
+assertTrue(fs.truncate, fs, h, 123457)
+assert(fs:size(h)==123457)
+strData = strData:sub(1, 123457)
+
+-- the file has an open handle
+assertRefused(fs.open, fs, "/HANDLE.BIN", fatfs.fatfs_OPEN_READ)
+assertRefused(fs.writefile, fs, "abc", "/HANDLE.BIN")
+assertRefused(fs.deletefile, fs, "/HANDLE.BIN")
+
+assertTrue(fs.close, fs, h)
+assert(fs:getfilesize("/HANDLE.BIN")==123457)
+assert(fs:readfile("/HANDLE.BIN")==strData)
+
+-- read up to the end
+h = fs:open("/HANDLE.BIN")
+assert(h)
+assertTrue(fs.seek, fs, h, 123450)
+assert(fs:read(h, 100)==strData:sub(123451))
+assertNil(fs.read, fs, h, 100)
+assertTrue(fs.close, fs, h)
+
+-- OPEN_CREATE empties an existing file and creates a missing one
+h = fs:open("/HANDLE.BIN", fatfs.fatfs_OPEN_CREATE)
+assert(fs:size(h)==0)
+assertTrue(fs.write, fs, h, "abc")
+assertTrue(fs.close, fs, h)
+assert(fs:readfile("/HANDLE.BIN")=="abc")
+h = fs:open("/NEW.BIN", fatfs.fatfs_OPEN_CREATE)
+assertTrue(fs.write, fs, h, strData)
+assertTrue(fs.close, fs, h)
+assert(fs:readfile("/NEW.BIN")==strData)
+assertTrue(fs.deletefile, fs, "/NEW.BIN")
+
+-- the handles are freed by the garbage collector
+h = nil
+collectgarbage()
+
+-- Error conditions:
+-- file does not exist
+assertRefused(fs.open, fs, "/MISSING.BIN", fatfs.fatfs_OPEN_READ)
+assertRefused(fs.open, fs, "/PORT_9/NEW.BIN", fatfs.fatfs_OPEN_CREATE)
+-- position behind the end of the file
+h = fs:open("/HANDLE.BIN")
+assertRefused(fs.seek, fs, h, 4)
+assertTrue(fs.close, fs, h)
+-- missing arguments
+assertFail(fs.open, fs, nil)
+assertFail(fs.open, fs)
+
+
+--------------------------------------------------------------------------
+print()
+print("Testing a new entry behind deleted entries at the end of a directory")
+
+-- the deleted entries before the end marker are too few for the new entry,
+-- it must start at the end marker and be followed by a new one
+fs = fatfs.fatfs_create(512, 70000)
+assertTrue(fs.mkdir, fs, "/D")
+assertTrue(fs.writefile, fs, "1234", "/D/Long name a.bin")
+assertTrue(fs.writefile, fs, "1234", "/D/A.BIN")
+assertTrue(fs.deletefile, fs, "/D/A.BIN")
+strData = string.rep("x", 1000)
+assertTrue(fs.writefile, fs, strData, "/D/another long one.bin")
+assert(fs:getfilesize("/D/another long one.bin")==1000)
+assert(fs:readfile("/D/another long one.bin")==strData)
+
+-- the alias entry holds the size and the end marker follows it
+strImage = fs:getimage()
+iPos = strImage:find("ANOTHE~1BIN", 1, true)
+assert(iPos and (iPos-1)%32==0)
+l = strImage:byte(iPos+28) + strImage:byte(iPos+29)*0x100 + strImage:byte(iPos+30)*0x10000 + strImage:byte(iPos+31)*0x1000000
+assert(l==1000)
+assert(strImage:byte(iPos+32)==0)
+strImage = nil
+
+assertTrue(fs.writefile, fs, strData, "/D/Long name b.dat")
+assert(fs:readfile("/D/another long one.bin")==strData)
+assert(fs:readfile("/D/Long name b.dat")==strData)
+
@@ -14,6 +14,29 @@ fc /b data\netTAP_bsl.bin tmp\netTAP_bsl.bin
 fc /b data\NTPNSNSC.NXF tmp\NTPNSNSC.NXF
 fc /b data\ledflash.lua tmp\ledflash.lua
 
+rem build the file tree from a manifest and compare
+echo data\NTPNSNSC.NXF PORT_0/NTPNSNSC.NXF> tmp\test.manifest
+echo data\ledflash.lua PORT_1/netscrpt.lua>> tmp\test.manifest
+echo SYSTEM/>> tmp\test.manifest
+%FAT_TOOL% -create 528 8067 0x420000 66000 -manifest tmp\test.manifest -saveimage tmp\manifest.bin
+%FAT_TOOL% -mount tmp\manifest.bin 66000 -dir / -r -readfile PORT_0/NTPNSNSC.NXF tmp\manifest_NTPNSNSC.NXF -readfile PORT_1/netscrpt.lua tmp\manifest_ledflash.lua
+
+fc /b data\NTPNSNSC.NXF tmp\manifest_NTPNSNSC.NXF
+fc /b data\ledflash.lua tmp\manifest_ledflash.lua
+
+rem a trimmed image written over an empty image gives the full image again
+%FAT_TOOL% -mount tmp\test.bin 66000 -saveimage tmp\trim.bin --trim
+%FAT_TOOL% -create 528 8067 0x420000 66000 -writeraw tmp\trim.bin 0 -saveimage tmp\untrim.bin
+
+fc /b tmp\test.bin tmp\untrim.bin
+
+rem build an image directly in a file, mount it from the file and compare
+%FAT_TOOL% -createpath tmp\path.bin 528 8067 0x420000 66000 -writeraw data\netTAP_bsl.bin 0 -mkdir PORT_0 -writefile data\NTPNSNSC.NXF PORT_0/NTPNSNSC.NXF
+%FAT_TOOL% -mountpath tmp\path.bin 66000 -dir / -r -readfile PORT_0/NTPNSNSC.NXF tmp\path_NTPNSNSC.NXF -readraw 0 48796 tmp\path_netTAP_bsl.bin
+
+fc /b data\netTAP_bsl.bin tmp\path_netTAP_bsl.bin
+fc /b data\NTPNSNSC.NXF tmp\path_NTPNSNSC.NXF
+
 rem some testing - each test should fail
 set FAT_TEST=%FAT_TOOL% -create 528 8067 0x420000 66000
 